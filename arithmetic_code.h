@@ -21,11 +21,15 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <functional>
 #include <iterator>
 #include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 
 template <typename FixedPoint = uint64_t, typename CompressedDigit = uint16_t, int MinRange = 0>
@@ -82,6 +86,10 @@ struct arithmetic_code {
   // In the base case i=1, K_1=0: C=C_1 is represented as a series of future decisions b_i.
   // In the final case i=n, K_n=K: C is represented as a string of compressed digits.
   // The various encoding methods modify K, x, r, R while keeping C fixed.
+  // The most recent digits c_k may still change if a later x_i carries into
+  // them. Only the last digit that is not M-1 and the number of M-1 digits
+  // after it are held back; a carry increments the former and wraps the
+  // latter to 0.
   template <typename OutputIterator,
             typename OutputDigit = typename std::iterator_traits<OutputIterator>::value_type>
   class encoder {
@@ -103,7 +111,8 @@ struct arithmetic_code {
      }
     // Symbol is int instead of bool because additional versions of `put()` could
     // accept more than two symbols, e.g. one could call `put(2, p1, p2, p3)`.
-    size_t put(int symbol, std::function<FixedPoint(FixedPoint)> probability_of_1) {
+    template <typename ProbabilityOf1>
+    size_t put(int symbol, ProbabilityOf1 probability_of_1) {
       FixedPoint range_of_1 = probability_of_1(range);
       FixedPoint range_of_0 = range - range_of_1;
       if (symbol != 0) {
@@ -118,7 +127,7 @@ struct arithmetic_code {
         }
         size_t emitted_before = get_bytes_emitted();
         while (range < max_range/digit_base) {
-          renormalize_and_emit_digit<CompressedDigit>();
+          renormalize_and_emit_digit();
         }
         return get_bytes_emitted() - emitted_before;
       }
@@ -136,47 +145,50 @@ struct arithmetic_code {
         }
       }
 
+      // Resolve the final carry, then emit x down to its last nonzero digit.
+      emit_held_digits(low >= fixed_one);
+      low %= fixed_one;
+      static constexpr FixedPoint base = digit_base_for<OutputDigit>();
+      static constexpr FixedPoint most_significant_digit = fixed_one / base;
       while (low != 0) {
-        range = 1;
-        renormalize_and_emit_digit<OutputDigit>();
+        emit_digit(OutputDigit(low / most_significant_digit));
+        low = (low % most_significant_digit) * base;
       }
       range = 0;  // mark complete
     }
 
    private:
-    template <typename Digit>
     void renormalize_and_emit_digit() {
-      static constexpr FixedPoint base = digit_base_for<Digit>();
-      static constexpr FixedPoint most_significant_digit = fixed_one / base;
+      static constexpr FixedPoint most_significant_digit = fixed_one / digit_base;
       static_assert(is_power_of_2(most_significant_digit), "expected power of 2");
+      static constexpr CompressedDigit max_digit = std::numeric_limits<CompressedDigit>::max();
 
-      // Check for a carry bit, and cascade from lowest overflow digit to highest.
-      if (low >= fixed_one) {
-        for (int i = overflow.size()-1; i >= 0; i--) {
-          if (++overflow[i] != 0) break;
-        }
-        low -= fixed_one;
-      }
-      assert(low < fixed_one);
-
-      // Compare the minimum and maximum possible values of the top digit.
-      // If different, defer emitting the digit until we're sure we won't have to carry.
-      Digit digit = Digit(low / most_significant_digit);
-      if (digit != Digit((low + range - 1) / most_significant_digit)) {
-        assert(range < most_significant_digit);
-        overflow.push_back(digit);
+      // low < 2*fixed_one, so the top digit is at most digit_base plus a carry bit.
+      bool carry = (low >= fixed_one);
+      CompressedDigit digit = CompressedDigit(low / most_significant_digit);
+      if (digit != max_digit || carry) {
+        emit_held_digits(carry);
+        held_digit = digit;
+        has_held_digit = true;
       } else {
-        for (CompressedDigit overflow_digit : overflow) {
-          emit_digit(overflow_digit);
-        }
-        overflow.clear();
-        emit_digit(digit);
+        // A later carry could still propagate through this digit.
+        held_max_digits++;
       }
 
-      // Subtract away the emitted/overflowed digit and renormalize.
-      low -= digit * most_significant_digit;
-      low *= base;
-      range *= base;
+      // Subtract away the emitted/held digit and renormalize.
+      low = (low % most_significant_digit) * digit_base;
+      range *= digit_base;
+    }
+
+    // Emit the held-back digits, adding the carry bit.
+    void emit_held_digits(bool carry) {
+      if (has_held_digit) {
+        emit_digit(CompressedDigit(held_digit + carry));
+        has_held_digit = false;
+      }
+      for (; held_max_digits > 0; held_max_digits--) {
+        emit_digit(CompressedDigit(std::numeric_limits<CompressedDigit>::max() + carry));
+      }
     }
 
     // Emit a CompressedDigit as one or more OutputDigits. Loop should be
@@ -191,13 +203,16 @@ struct arithmetic_code {
     size_t bytes_emitted;
     // Output digits are emitted to this iterator as they are produced.
     OutputIterator out;
-    // The lower bound x, initialized to 0. (When overflow.size() > 0, low is
-    // the fractional digits of x/R_0.)
+    // The lower bound x, initialized to 0. May be >= fixed_one (a carry into
+    // the held-back digits) until the next digit is emitted.
     FixedPoint low;
     // The range r, which starts as fixed-point 1.0.
     FixedPoint range;
-    // High digits of x. If overflow.size() = s, then R = R_0 M^s (where R_0 = fixed_one).
-    std::vector<CompressedDigit> overflow;
+    // The last digit that is not max_digit and not yet emitted, if any,
+    // followed by held_max_digits digits equal to max_digit.
+    CompressedDigit held_digit = 0;
+    bool has_held_digit = false;
+    size_t held_max_digits = 0;
   };
 
   // The decoder object takes an input iterator (e.g. from vector or istream)
@@ -229,7 +244,8 @@ struct arithmetic_code {
       assert(range == initial_range);  // Should be true if we set digit_alignment correctly.
     }
 
-    int get(std::function<FixedPoint(FixedPoint)> probability_of_1) {
+    template <typename ProbabilityOf1>
+    int get(ProbabilityOf1 probability_of_1) {
       FixedPoint range_of_1 = probability_of_1(range);
       FixedPoint range_of_0 = range - range_of_1;
       int symbol = (low >= range_of_0);
@@ -296,9 +312,215 @@ struct arithmetic_code {
     // The range r, which is initialized to fixed-point 1.0.
     FixedPoint range;
   };
+
+  // Decoder specialised for reading bytes from memory. The generic decoder
+  // checks for the end of input on every byte; here a renormalization checks
+  // once that enough bytes remain for any number of digits it could consume,
+  // and only falls back to checked reads near the end. Input past the end
+  // reads as zeros, as in the generic decoder.
+  template <typename Byte>
+  class decoder<const Byte*, uint8_t> {
+    static_assert(sizeof(Byte) == 1, "byte pointers only");
+
+   public:
+    decoder() : decoder(nullptr, nullptr) {}
+    decoder(const Byte* in, const Byte* end)
+      : decoder(in, end, fixed_one) {}
+    decoder(const Byte* in, const Byte* end, FixedPoint initial_range)
+      : in(reinterpret_cast<const uint8_t*>(in)), end(reinterpret_cast<const uint8_t*>(end)) {
+      // The first digit is read skewed by digit_alignment, see the generic decoder.
+      next_digit = consume_digit_aligned<true>();
+      low = next_digit / digit_alignment;
+      range = digit_base / digit_alignment;
+      while (range < initial_range) {
+        renormalize_and_consume_digit<true>();
+      }
+      assert(range == initial_range);
+    }
+
+    template <typename ProbabilityOf1>
+    int get(ProbabilityOf1 probability_of_1) {
+      FixedPoint range_of_1 = probability_of_1(range);
+      FixedPoint range_of_0 = range - range_of_1;
+      int symbol = (low >= range_of_0);
+      if (symbol != 0) {
+        low -= range_of_0;
+        range = range_of_1;
+      } else {
+        range = range_of_0;
+      }
+      if (range < min_range) {
+        // Renormalizing from range >= 1 consumes less than a FixedPoint of input.
+        if (size_t(end - in) >= sizeof(FixedPoint)) {
+          while (range < max_range/digit_base) {
+            renormalize_and_consume_digit<false>();
+          }
+        } else {
+          while (range < max_range/digit_base) {
+            renormalize_and_consume_digit<true>();
+          }
+        }
+      }
+      return symbol;
+    }
+
+   private:
+    static constexpr CompressedDigit digit_alignment =
+      std::numeric_limits<FixedPoint>::max()/fixed_one + 1;
+
+    template <bool checked>
+    void renormalize_and_consume_digit() {
+      assert(low < fixed_one/digit_base);
+      CompressedDigit in_digit = consume_digit_aligned<checked>();
+      CompressedDigit digit = ((next_digit * (digit_base/digit_alignment)) |
+                               (in_digit / digit_alignment));
+      next_digit = in_digit;
+      low = low * digit_base + digit;
+      range *= digit_base;
+    }
+
+    template <bool checked>
+    CompressedDigit consume_digit_aligned() {
+      CompressedDigit digit = 0;
+      for (size_t i = 0; i < sizeof(CompressedDigit); i++) {
+        digit = CompressedDigit(digit << 8) | (!checked || in < end ? *in++ : 0);
+      }
+      return digit;
+    }
+
+    const uint8_t *in, *end;
+    // The last digit read from the input - the lower bits are still to be used.
+    CompressedDigit next_digit;
+    // The offset z from the lower bound.
+    FixedPoint low;
+    // The range r, which is initialized to fixed-point 1.0.
+    FixedPoint range;
+  };
 };
 
 
+// Interleaves 1, 2 or 4 (up to MaxStreams) independent coder states in one payload,
+// assigning symbols to them round-robin, so the decoder can overlap their
+// renormalization dependency chains. The payload is the varint byte length of
+// each stream but the last, followed by the streams; with one stream it is
+// identical to Code's payload.
+template <typename Code, int MaxStreams = 4>
+struct interleaved_code {
+  static void check_streams(int streams) {
+    if (streams < 1 || streams > MaxStreams || (streams & (streams - 1))) {
+      throw std::invalid_argument("Unsupported number of coder streams: " + std::to_string(streams));
+    }
+  }
+
+  template <typename OutputIterator>
+  class encoder {
+    typedef std::vector<uint8_t> buffer;
+    typedef typename Code::template encoder<std::back_insert_iterator<buffer>, uint8_t> stream_encoder;
+
+   public:
+    encoder(OutputIterator out, int streams) : out(out), streams(streams) {
+      check_streams(streams);
+      encoders.reserve(streams);
+      for (int i = 0; i < streams; i++) {
+        encoders.emplace_back(std::back_inserter(buffers[i]));
+      }
+    }
+    encoder(const encoder&) = delete;
+    encoder& operator=(const encoder&) = delete;
+    ~encoder() { finish(); }
+
+    // Reserve room for about this many bytes of output in total.
+    void reserve(size_t size) {
+      for (int i = 0; i < streams; i++) {
+        buffers[i].reserve(size / streams + 1);
+      }
+    }
+
+    template <typename ProbabilityOf1>
+    size_t put(int symbol, ProbabilityOf1 probability_of_1) {
+      size_t bytes = encoders[next].put(symbol, probability_of_1);
+      if (++next == streams) {
+        next = 0;
+      }
+      return bytes;
+    }
+
+    void finish() {
+      if (finished) {
+        return;
+      }
+      finished = true;
+      for (auto& e : encoders) {
+        e.finish();
+      }
+      for (int i = 0; i < streams - 1; i++) {
+        for (size_t n = buffers[i].size(); ; n >>= 7) {
+          *out++ = uint8_t(n < 0x80 ? n : (n & 0x7F) | 0x80);
+          if (n < 0x80) break;
+        }
+      }
+      for (int i = 0; i < streams; i++) {
+        out = std::copy(buffers[i].begin(), buffers[i].end(), out);
+      }
+    }
+
+   private:
+    OutputIterator out;
+    int streams;
+    int next = 0;
+    bool finished = false;
+    buffer buffers[MaxStreams];
+    std::vector<stream_encoder> encoders;
+  };
+
+  template <typename Byte>
+  class decoder {
+    static_assert(sizeof(Byte) == 1, "byte pointers only");
+    typedef typename Code::template decoder<const Byte*, uint8_t> stream_decoder;
+
+   public:
+    decoder() : streams(1) {}
+    decoder(const Byte* in, const Byte* end, int streams) : streams(streams) {
+      check_streams(streams);
+      size_t sizes[MaxStreams];
+      for (int i = 0; i < streams - 1; i++) {
+        sizes[i] = 0;
+        for (int shift = 0; ; shift += 7) {
+          if (in == end || shift > 63) {
+            throw std::runtime_error("Truncated interleaved coder header.");
+          }
+          uint8_t byte = *in++;
+          sizes[i] |= size_t(byte & 0x7F) << shift;
+          if (!(byte & 0x80)) break;
+        }
+      }
+      for (int i = 0; i < streams; i++) {
+        if (i == streams - 1) {
+          sizes[i] = end - in;
+        } else if (sizes[i] > size_t(end - in)) {
+          throw std::runtime_error("Truncated interleaved coder stream.");
+        }
+        decoders[i] = stream_decoder(in, in + sizes[i]);
+        in += sizes[i];
+      }
+    }
+
+    template <typename ProbabilityOf1>
+    int get(ProbabilityOf1 probability_of_1) {
+      int symbol = decoders[next].get(probability_of_1);
+      if (++next == streams) {
+        next = 0;
+      }
+      return symbol;
+    }
+
+   private:
+    int streams;
+    int next = 0;
+    stream_decoder decoders[MaxStreams];
+  };
+};
+
 template <typename Coder = arithmetic_code<>,
           typename OutputContainer>
 typename Coder::template encoder<std::back_insert_iterator<OutputContainer>,
@@ -0,0 +1,170 @@
+//
+// Compresses the files listed in a manifest on a pool of threads.
+//
+// Each manifest line is "<input> <output>"; separate them with a tab if the
+// paths contain spaces. Empty lines and lines starting with '#' are skipped.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "file_io.h"
+#include "recode.h"
+#include "worker_pool.h"
+
+
+class batch_compressor {
+ public:
+  // Inputs are admitted while the estimated memory of the jobs in flight
+  // stays within max_memory bytes; a larger file runs on its own.
+  batch_compressor(int num_workers, size_t max_memory,
+      const avrecode::compressor_options& opts = avrecode::compressor_options())
+    : num_workers(num_workers), max_memory(max_memory), opts(opts) {}
+
+  void read_manifest(const std::string& manifest_filename) {
+    std::ifstream manifest(manifest_filename);
+    if (!manifest) {
+      throw std::invalid_argument("Failed to open manifest: " + manifest_filename);
+    }
+    std::string line;
+    for (int line_number = 1; std::getline(manifest, line); line_number++) {
+      if (line.empty() || line[0] == '#') continue;
+      job j;
+      size_t tab = line.find('\t');
+      if (tab != std::string::npos) {
+        j.input = line.substr(0, tab);
+        j.output = line.substr(tab + 1);
+      } else {
+        std::istringstream words(line);
+        std::string extra;
+        words >> j.input >> j.output >> extra;
+        if (!extra.empty()) j.output.clear();
+      }
+      if (j.input.empty() || j.output.empty()) {
+        throw std::invalid_argument(manifest_filename + ":" + std::to_string(line_number) +
+                                    ": expected <input> <output>");
+      }
+      struct stat st;
+      j.input_bytes = stat(j.input.c_str(), &st) == 0 ? st.st_size : 0;
+      jobs.push_back(j);
+    }
+  }
+
+  // Compresses every file, largest first so the longest jobs don't start
+  // last, and writes a per-file and total summary. Returns the number of
+  // failed files.
+  size_t run(std::ostream& summary) {
+    std::stable_sort(jobs.begin(), jobs.end(), [](const job& a, const job& b) {
+      return a.input_bytes > b.input_bytes;
+    });
+    auto start = std::chrono::steady_clock::now();
+    {
+      worker_pool<avrecode::recoder> pool(num_workers);
+      for (job& j : jobs) {
+        size_t cost = memory_cost(j);
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          memory_released.wait(lock, [&]() {
+            return memory_in_flight == 0 || memory_in_flight + cost <= max_memory;
+          });
+          memory_in_flight += cost;
+        }
+        pool.submit([this, &j, cost](avrecode::recoder& r) {
+          run_job(r, &j);
+          std::lock_guard<std::mutex> lock(mutex);
+          memory_in_flight -= cost;
+          memory_released.notify_all();
+        });
+      }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t failed = 0, input_bytes = 0, output_bytes = 0;
+    for (const job& j : jobs) {
+      if (!j.error.empty()) {
+        failed++;
+        summary << j.input << ": error: " << j.error << std::endl;
+        continue;
+      }
+      input_bytes += j.input_bytes;
+      output_bytes += j.output_bytes;
+      summary << j.input << ": " << ratio(j.output_bytes, j.input_bytes) << "% in "
+              << j.seconds << " s" << std::endl;
+    }
+    summary << "Batch of " << jobs.size() << " files, " << failed << " failed, on "
+            << num_workers << " threads:" << std::endl;
+    summary << " compression ratio: " << ratio(output_bytes, input_bytes) << "%" << std::endl;
+    summary << " throughput: " << input_bytes / 1e6 / seconds << " MB/s in " << seconds << " s" << std::endl;
+    return failed;
+  }
+
+ private:
+  struct job {
+    std::string input, output;
+    size_t input_bytes = 0, output_bytes = 0;
+    double seconds = 0;
+    std::string error;
+  };
+
+  // The mapped input, and the recoded blocks the compressor holds until the
+  // video is decoded, which are rarely larger; the output streams to its
+  // file. Plus the decoder's frames and the model, whatever the input.
+  static size_t memory_cost(const job& j) {
+    return 2 * j.input_bytes + (size_t(64) << 20);
+  }
+
+  static double ratio(size_t compressed, size_t original) {
+    return original ? compressed * 100. / original : 100.;
+  }
+
+  void run_job(avrecode::recoder& r, job *j) {
+    auto start = std::chrono::steady_clock::now();
+    try {
+      mapped_file in(j->input);
+      j->input_bytes = in.size;
+      // Written next to the output and renamed into place, so a failed job
+      // never leaves a truncated file.
+      std::string tmp_output = j->output + ".tmp";
+      try {
+        std::ofstream out(tmp_output, std::ios::binary | std::ios::trunc);
+        if (!out) {
+          throw std::runtime_error("Failed to create " + tmp_output + ": " + strerror(errno));
+        }
+        avrecode::compress_stats stats;
+        r.compress(in.bytes, in.size, out, opts, &stats);
+        out.close();
+        if (!out || rename(tmp_output.c_str(), j->output.c_str()) < 0) {
+          throw std::runtime_error("Failed to write " + j->output + ": " + strerror(errno));
+        }
+        j->output_bytes = stats.compressed_bytes;
+      } catch (...) {
+        unlink(tmp_output.c_str());
+        throw;
+      }
+    } catch (const std::exception& e) {
+      j->error = e.what();
+    }
+    j->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  int num_workers;
+  size_t max_memory;
+  avrecode::compressor_options opts;
+  std::vector<job> jobs;
+
+  std::mutex mutex;
+  std::condition_variable memory_released;
+  size_t memory_in_flight = 0;
+};
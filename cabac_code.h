@@ -4,7 +4,9 @@
 
 #pragma once
 
-#include "arithmetic_code.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 
 extern "C" {
 #include "libavcodec/cabac.h"
@@ -14,73 +16,214 @@ static const uint8_t * const ff_h264_mlps_state = ff_h264_cabac_tables + H264_ML
 
 
 struct cabac {
-  // Word size for encoder/decoder state. Reasonable values: uint64_t, uint32_t.
-  typedef uint32_t fixed_point;
-  // Word size for compressed data. Reasonable values: uint16_t, uint8_t.
-  typedef uint16_t compressed_digit;
-  // min_range must be at least 0x200 so that range/2 never rounds in put_bypass.
-  static constexpr int min_range = 0x200;
-
-  typedef arithmetic_code<fixed_point, compressed_digit, min_range> cabac_arithmetic_code;
+  // The context state transition after a symbol, as made by encoder::put and
+  // decoder::get. Lets the state be advanced apart from the coder.
+  static void update_state(int symbol, uint8_t *state) {
+    int s = *state;
+    *state = symbol != (s & 1) ? ff_h264_mlps_state[127 - s] : ff_h264_mlps_state[128 + s];
+  }
 
+  // CABAC encoder as specified by H.264 9.3.4.2, using the same state tables
+  // as libavcodec's decoder. The arithmetic coder state is a 9-bit range and a
+  // low bound holding the 10-bit register plus bits queued for the next output
+  // byte. Bytes that could still change due to a carry are held back: the
+  // last byte before a run of 0xFF bytes in `cache`, and the run length in
+  // `outstanding`.
   template <typename OutputIterator>
   class encoder {
    public:
-    // Initial range is set so that (range >> normalize) == 0x1FE as required by CABAC spec.
-    explicit encoder(OutputIterator out) : e(out, (cabac_arithmetic_code::fixed_one/0x200)*0x1FE) {}
+    explicit encoder(OutputIterator out) : out(out) {}
 
-    // Translate CABAC tables into generic arithmetic coding.
+    // Returns the number of bytes produced, for billing.
     size_t put(int symbol, uint8_t* state) {
-      bool is_less_probable_symbol = (symbol != ((*state) & 1));
-      size_t retval = e.put(is_less_probable_symbol, [state](fixed_point range) {
-        // Find the normalizer such that range >> normalize is between 0x100 and 0x200.
-        int normalize = log2(range / 0x100);
-        // Use the most significant two bits of range (other than the leading 1) as an index into the table.
-        int range_approx = int(range >> (normalize-1));
-        fixed_point range_of_less_probable_symbol = ff_h264_lps_range[(range_approx & 0x180) + *state];
-        return range_of_less_probable_symbol << normalize;
-      });
-      if (is_less_probable_symbol) {
-        *state = ff_h264_mlps_state[127 - *state];
+      int s = *state;
+      uint32_t range_of_less_probable_symbol = ff_h264_lps_range[2*(range & 0xC0) + s];
+      range -= range_of_less_probable_symbol;
+      if (symbol != (s & 1)) {
+        low += range;
+        range = range_of_less_probable_symbol;
+        *state = ff_h264_mlps_state[127 - s];
       } else {
-        *state = ff_h264_mlps_state[128 + *state];
+        *state = ff_h264_mlps_state[128 + s];
       }
-      return retval;
+      return renormalize();
     }
 
-    // Simple implementation: put_bypass assumes a symbol probability of exactly 1/2.
+    // Bypass symbols have a probability of exactly 1/2.
     size_t put_bypass(int symbol) {
-      return e.put(symbol, [](fixed_point range) { return range/2; });
+      low <<= 1;
+      if (symbol) {
+        low += range;
+      }
+      queue += 1;
+      return queue >= 0 ? put_byte() : 0;
     }
 
     // The end of stream symbol is always assumed to have probability ~2/256.
     size_t put_terminate(int end_of_stream_symbol) {
-      size_t retval = e.put(end_of_stream_symbol, [](fixed_point range) {
-        int normalize = log2(range / 0x100);
-        return fixed_point(2) << normalize;
-      });
-      
-      if (end_of_stream_symbol) {
-        e.finish();
+      range -= 2;
+      if (!end_of_stream_symbol) {
+        return renormalize();
+      }
+      // Flush (9.3.4.5): emit the remaining bits of low with the final bit
+      // replaced by the stop bit, padded with zeros to a byte boundary.
+      low += range;
+      low |= 1;
+      low <<= 9;
+      queue += 9;
+      size_t bytes = 0;
+      for (int i = 0; i < 2; i++) {
+        if (queue >= 0) bytes += put_byte();
       }
-      return retval;
+      low <<= -queue;
+      queue = 0;
+      bytes += put_byte();
+      flush_pending(0);
+      return bytes;
     }
 
    private:
-    static int log2(uint64_t x) {
-      int i = 0;
-      if (x >> 32) { x >>= 32; i += 32; }
-      if (x >> 16) { x >>= 16; i += 16; }
-      if (x >>  8) { x >>=  8; i +=  8; }
-      if (x >>  4) { x >>=  4; i +=  4; }
-      if (x >>  2) { x >>=  2; i +=  2; }
-      if (x >>  1) { x >>=  1; i +=  1; }
-      return i;
+    size_t renormalize() {
+      if (range >= 0x100) {
+        return 0;
+      }
+      int shift = __builtin_clz(range) - (32 - 9);
+      range <<= shift;
+      low <<= shift;
+      queue += shift;
+      return queue >= 0 ? put_byte() : 0;
     }
 
-    cabac_arithmetic_code::encoder<OutputIterator, uint8_t> e;
+    // Move the top byte of low out of the register.
+    size_t put_byte() {
+      uint32_t byte = low >> (queue + 10);
+      low &= (0x400u << queue) - 1;
+      queue -= 8;
+      if (byte == 0xFF) {
+        // A later carry could still propagate through this byte.
+        outstanding++;
+      } else {
+        flush_pending(byte >> 8);
+        cache = uint8_t(byte);
+        has_cache = true;
+      }
+      return 1;
+    }
+
+    // Write the held-back bytes, adding the carry bit.
+    void flush_pending(uint32_t carry) {
+      if (has_cache) {
+        *out++ = uint8_t(cache + carry);
+        has_cache = false;
+      }
+      for (; outstanding > 0; outstanding--) {
+        *out++ = uint8_t(0xFF + carry);
+      }
+    }
+
+    OutputIterator out;
+    uint32_t low = 0;
+    uint32_t range = 0x1FE;
+    // Number of bits in low beyond the 10-bit register, minus 8. When it
+    // reaches zero, the top byte of low is ready to be output. Starts at -9
+    // so that the leading (always zero) integer bit is never output.
+    int queue = -9;
+    uint8_t cache = 0;
+    bool has_cache = false;
+    size_t outstanding = 0;
   };
 
+  // CABAC decoder as specified by H.264 9.3.3.2, with the same results and
+  // context state updates as libavcodec's ff_get_cabac, ff_get_cabac_bypass
+  // and ff_get_cabac_terminate. The 9-bit offset is the top of a 64-bit window
+  // of input bits, which is refilled six bytes at a time. Input past the end
+  // of the buffer reads as zeros.
   class decoder {
+   public:
+    decoder() : decoder(nullptr, 0) {}
+    decoder(const uint8_t *buf, int size) : in(buf), end(buf + size) {
+      refill();
+    }
+
+    int get(uint8_t *state) {
+      int s = *state;
+      uint32_t range_of_less_probable_symbol = ff_h264_lps_range[2*(range & 0xC0) + s];
+      range -= range_of_less_probable_symbol;
+      uint64_t scaled_range = uint64_t(range) << count;
+      int symbol;
+      if (value < scaled_range) {
+        symbol = s & 1;
+        *state = ff_h264_mlps_state[128 + s];
+        // The more probable symbol's range is at least 0x80.
+        if (range < 0x100) {
+          range <<= 1;
+          count -= 1;
+        }
+      } else {
+        symbol = !(s & 1);
+        *state = ff_h264_mlps_state[127 - s];
+        value -= scaled_range;
+        int shift = __builtin_clz(range_of_less_probable_symbol) - (32 - 9);
+        range = range_of_less_probable_symbol << shift;
+        count -= shift;
+      }
+      if (count < 0) {
+        refill();
+      }
+      return symbol;
+    }
+
+    int get_bypass() {
+      if (--count < 0) {
+        refill();
+      }
+      uint64_t scaled_range = uint64_t(range) << count;
+      if (value < scaled_range) {
+        return 0;
+      }
+      value -= scaled_range;
+      return 1;
+    }
+
+    int get_terminate() {
+      range -= 2;
+      if (value >= uint64_t(range) << count) {
+        return 1;
+      }
+      if (range < 0x100) {
+        range <<= 1;
+        if (--count < 0) {
+          refill();
+        }
+      }
+      return 0;
+    }
+
+   private:
+    static constexpr int refill_bytes = 6;
+
+    // Append the next refill_bytes of input to the window. Requires count < 0,
+    // so the window has room.
+    void refill() {
+      uint64_t bits;
+      if (end - in >= 8) {
+        memcpy(&bits, in, sizeof(bits));
+        bits = __builtin_bswap64(bits) >> (8 * (8 - refill_bytes));
+        in += refill_bytes;
+      } else {
+        bits = 0;
+        for (int i = 0; i < refill_bytes; i++) {
+          bits = (bits << 8) | (in < end ? *in++ : 0);
+        }
+      }
+      value = (value << (8 * refill_bytes)) | bits;
+      count += 8 * refill_bytes;
+    }
+
+    const uint8_t *in, *end;
+    // The offset is value >> count; the lower count bits are read-ahead input.
+    uint64_t value = 0;
+    int count = -9;
+    uint32_t range = 0x1FE;
   };
 };
@@ -0,0 +1,73 @@
+//
+// CRC-32C (Castagnoli) checksums of blocks, using the SSE4.2 crc32
+// instruction when the CPU has it.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+
+struct crc32c {
+  // Checksum of size bytes.
+  static uint32_t of(const void *data, size_t size) {
+    return extend(0, data, size);
+  }
+
+  // Checksum of the bytes checksummed by crc followed by size more bytes.
+  static uint32_t extend(uint32_t crc, const void *data, size_t size) {
+#if defined(__x86_64__)
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42) {
+      return extend_sse42(crc, static_cast<const uint8_t*>(data), size);
+    }
+#endif
+    return extend_software(crc, static_cast<const uint8_t*>(data), size);
+  }
+
+  static uint32_t extend_software(uint32_t crc, const uint8_t *p, size_t size) {
+    static const table t;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+      crc = t.entries[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+  }
+
+#if defined(__x86_64__)
+  __attribute__((target("sse4.2")))
+  static uint32_t extend_sse42(uint32_t crc, const uint8_t *p, size_t size) {
+    uint64_t c = ~crc & 0xffffffffu;
+    for (; size >= 8; p += 8, size -= 8) {
+      uint64_t word;
+      memcpy(&word, p, 8);
+      c = _mm_crc32_u64(c, word);
+    }
+    uint32_t c32 = c;
+    for (; size > 0; p++, size--) {
+      c32 = _mm_crc32_u8(c32, *p);
+    }
+    return ~c32;
+  }
+#endif
+
+ private:
+  struct table {
+    table() {
+      for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+          crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+        }
+        entries[i] = crc;
+      }
+    }
+    uint32_t entries[256];
+  };
+};
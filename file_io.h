@@ -0,0 +1,63 @@
+//
+// Whole-descriptor reads and writes, and whole files mapped into memory.
+//
+
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include "libavutil/file.h"
+}
+
+
+// Reads a whole file descriptor.
+inline std::string read_fd(int fd) {
+  std::string data;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    data.reserve(st.st_size);
+  }
+  char buffer[1 << 16];
+  while (true) {
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) throw std::runtime_error(std::string("Read failed: ") + strerror(errno));
+    if (n == 0) return data;
+    data.append(buffer, n);
+  }
+}
+
+inline void write_fd(int fd, const std::string& data) {
+  for (size_t pos = 0; pos < data.size(); ) {
+    ssize_t n = write(fd, data.data() + pos, data.size() - pos);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) throw std::runtime_error(std::string("Write failed: ") + strerror(errno));
+    pos += n;
+  }
+}
+
+// A whole input file mapped into memory.
+class mapped_file {
+ public:
+  explicit mapped_file(const std::string& filename) {
+    if (av_file_map(filename.c_str(), &bytes, &size, 0, NULL) < 0) {
+      throw std::invalid_argument("Failed to open file: " + filename);
+    }
+  }
+  mapped_file(const mapped_file&) = delete;
+  ~mapped_file() {
+    av_file_unmap(bytes, size);
+  }
+
+  uint8_t *bytes;
+  size_t size;
+};
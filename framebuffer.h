@@ -37,6 +37,9 @@ class FrameBuffer {
     void set_frame_num(int frame_num) {
         frame_num_ = frame_num;
     }
+    int frame_num() const {
+        return frame_num_;
+    }
     bool is_same_frame(int frame_num) const {
         return frame_num_ == frame_num && width_ != 0 && height_ != 0;
     }
@@ -47,6 +50,7 @@ class FrameBuffer {
         return height_;
     }
     void init(uint32_t width, uint32_t height, uint32_t nblocks) {
+        destroy();
         height_ = height;
         width_ = width;
         nblocks_ = width * height;
@@ -0,0 +1,16 @@
+//
+// Compile-time checks of the libavcodec structures that recode.cpp relies
+// on but can't see from C++.
+//
+
+#include <stddef.h>
+
+#include "libavcodec/h264.h"
+
+// cabac_decoder finds a slice's CABAC states just past the CABACContext the
+// init_decoder hook is given, and keys the model by offsets into them.
+_Static_assert(offsetof(H264SliceContext, cabac_state) ==
+               offsetof(H264SliceContext, cabac) + sizeof(CABACContext),
+               "H264SliceContext.cabac_state must follow H264SliceContext.cabac");
+_Static_assert(sizeof(((H264SliceContext*)0)->cabac_state) == 1024,
+               "H264SliceContext.cabac_state must hold 1024 states");
@@ -0,0 +1,1212 @@
+//
+// The context model that codes H.264 CABAC bins into the recoded stream.
+//
+
+#pragma once
+
+#include <cassert>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+extern "C" {
+#include "libavcodec/cabac.h"
+#include "libavcodec/coding_hooks.h"
+}
+
+#include "framebuffer.h"
+
+namespace avrecode {
+namespace {
+
+//#define DO_NEIGHBOR_LOGGING
+#ifdef DO_NEIGHBOR_LOGGING
+#define LOG_NEIGHBORS printf
+#else
+#define LOG_NEIGHBORS(...)
+#endif
+
+typedef uint64_t range_t;
+
+
+struct r_scan8 {
+    uint16_t scan8_index;
+    bool neighbor_left;
+    bool neighbor_up;
+    bool is_invalid() const {
+        return scan8_index == 0 && neighbor_left && neighbor_up;
+    }
+    static constexpr r_scan8 inv() {
+        return {0, true, true};
+    }
+};
+/* Scan8 organization:
+ *    0 1 2 3 4 5 6 7
+ * 0  DY    y y y y y
+ * 1        y Y Y Y Y
+ * 2        y Y Y Y Y
+ * 3        y Y Y Y Y
+ * 4  du    y Y Y Y Y
+ * 5  DU    u u u u u
+ * 6        u U U U U
+ * 7        u U U U U
+ * 8        u U U U U
+ * 9  dv    u U U U U
+ * 10 DV    v v v v v
+ * 11       v V V V V
+ * 12       v V V V V
+ * 13       v V V V V
+ * 14       v V V V V
+ * DY/DU/DV are for luma/chroma DC.
+ */
+constexpr uint8_t scan_8[16 * 3 + 3] = {
+    4 +  1 * 8, 5 +  1 * 8, 4 +  2 * 8, 5 +  2 * 8,
+    6 +  1 * 8, 7 +  1 * 8, 6 +  2 * 8, 7 +  2 * 8,
+    4 +  3 * 8, 5 +  3 * 8, 4 +  4 * 8, 5 +  4 * 8,
+    6 +  3 * 8, 7 +  3 * 8, 6 +  4 * 8, 7 +  4 * 8,
+    4 +  6 * 8, 5 +  6 * 8, 4 +  7 * 8, 5 +  7 * 8,
+    6 +  6 * 8, 7 +  6 * 8, 6 +  7 * 8, 7 +  7 * 8,
+    4 +  8 * 8, 5 +  8 * 8, 4 +  9 * 8, 5 +  9 * 8,
+    6 +  8 * 8, 7 +  8 * 8, 6 +  9 * 8, 7 +  9 * 8,
+    4 + 11 * 8, 5 + 11 * 8, 4 + 12 * 8, 5 + 12 * 8,
+    6 + 11 * 8, 7 + 11 * 8, 6 + 12 * 8, 7 + 12 * 8,
+    4 + 13 * 8, 5 + 13 * 8, 4 + 14 * 8, 5 + 14 * 8,
+    6 + 13 * 8, 7 + 13 * 8, 6 + 14 * 8, 7 + 14 * 8,
+    0 +  0 * 8, 0 +  5 * 8, 0 + 10 * 8
+};
+
+constexpr r_scan8 reverse_scan_8[15][8] = {
+    //Y
+    {{16 * 3, false, false}, r_scan8::inv(), r_scan8::inv(), {15, true, true},
+     {10, false, true}, {11, false, true}, {14, false, true}, {15, false, true}},
+    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {5, true, false},
+     {0, false, false}, {1, false, false}, {4, false, false}, {5, false, false}},
+    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {7, true, false},
+     {2, false, false}, {3, false, false}, {6, false, false}, {7, false, false}},
+    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {13, true, false},
+     {8, false, false}, {9, false, false}, {12, false, false}, {13, false, false}},
+    {{16 * 3 + 1,false, true}, r_scan8::inv(), r_scan8::inv(), {15, true, false},
+     {10, false, false}, {11, false, false}, {14, false, false}, {15, false, false}},
+    // U
+    {{16 * 3 + 1,false, false}, r_scan8::inv(), r_scan8::inv(), {16 + 15, true, true},
+     {16 + 10, false, true}, {16 + 11, false, true}, {16 + 14, false, true}, {16 + 15, false, true}},
+    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {16 + 5, true, false},
+     {16 + 0, false, false}, {16 + 1, false, false}, {16 + 4, false, false}, {16 + 5, false, false}},
+    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {16 + 7, true, false},
+     {16 + 2, false, false}, {16 + 3, false, false}, {16 + 6, false, false}, {16 + 7, false, false}},
+    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {16 + 13, true, false},
+     {16 + 8, false, false}, {16 + 9, false, false}, {16 + 12, false, false}, {16 + 13, false, false}},
+    {{16 * 3 + 2,false, true}, r_scan8::inv(), r_scan8::inv(), {16 + 15, true, false},
+     {16 + 10, false, false}, {16 + 11, false, false}, {16 + 14, false, false}, {16 + 15, false, false}},
+    // V
+    {{16 * 3 + 2,false, false}, r_scan8::inv(), r_scan8::inv(), {32 + 15, true, true},
+     {32 + 10, false, true}, {32 + 11, false, true}, {32 + 14, false, true}, {32 + 15, false, true}},
+    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {32 + 5, true, false},
+     {32 + 0, false, false}, {32 + 1, false, false}, {32 + 4, false, false}, {32 + 5, false, false}},
+    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {32 + 7, true, false},
+     {32 + 2, false, false}, {32 + 3, false, false}, {32 + 6, false, false}, {32 + 7, false, false}},
+    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {32 + 13, true, false},
+     {32 + 8, false, false}, {32 + 9, false, false}, {32 + 12, false, false}, {32 + 13, false, false}},
+    {{32 + 16 * 3 + 1,false, true}, r_scan8::inv(), r_scan8::inv(), {32 + 15, true, false},
+     {32 + 10, false, false}, {32 + 11, false, false}, {32 + 14, false, false}, {32 + 15, false, false}}};
+
+// Encoder / decoder for recoded CABAC blocks.
+typedef std::tuple<const void*, int, int> model_key;
+/*
+not sure these tables are the ones we want to use
+constexpr uint8_t unzigzag16[16] = {
+    0 + 0 * 4, 0 + 1 * 4, 1 + 0 * 4, 0 + 2 * 4,
+    0 + 3 * 4, 1 + 1 * 4, 1 + 2 * 4, 1 + 3 * 4,
+    2 + 0 * 4, 2 + 1 * 4, 2 + 2 * 4, 2 + 3 * 4,
+    3 + 0 * 4, 3 + 1 * 4, 3 + 2 * 4, 3 + 3 * 4,
+};
+constexpr uint8_t zigzag16[16] = {
+    0, 2, 8, 12,
+    1, 5, 9, 13,
+    3, 6, 10, 14,
+    4, 7, 11, 15
+};
+
+constexpr uint8_t zigzag_field64[64] = {
+    0 + 0 * 8, 0 + 1 * 8, 0 + 2 * 8, 1 + 0 * 8,
+    1 + 1 * 8, 0 + 3 * 8, 0 + 4 * 8, 1 + 2 * 8,
+    2 + 0 * 8, 1 + 3 * 8, 0 + 5 * 8, 0 + 6 * 8,
+    0 + 7 * 8, 1 + 4 * 8, 2 + 1 * 8, 3 + 0 * 8,
+    2 + 2 * 8, 1 + 5 * 8, 1 + 6 * 8, 1 + 7 * 8,
+    2 + 3 * 8, 3 + 1 * 8, 4 + 0 * 8, 3 + 2 * 8,
+    2 + 4 * 8, 2 + 5 * 8, 2 + 6 * 8, 2 + 7 * 8,
+    3 + 3 * 8, 4 + 1 * 8, 5 + 0 * 8, 4 + 2 * 8,
+    3 + 4 * 8, 3 + 5 * 8, 3 + 6 * 8, 3 + 7 * 8,
+    4 + 3 * 8, 5 + 1 * 8, 6 + 0 * 8, 5 + 2 * 8,
+    4 + 4 * 8, 4 + 5 * 8, 4 + 6 * 8, 4 + 7 * 8,
+    5 + 3 * 8, 6 + 1 * 8, 6 + 2 * 8, 5 + 4 * 8,
+    5 + 5 * 8, 5 + 6 * 8, 5 + 7 * 8, 6 + 3 * 8,
+    7 + 0 * 8, 7 + 1 * 8, 6 + 4 * 8, 6 + 5 * 8,
+    6 + 6 * 8, 6 + 7 * 8, 7 + 2 * 8, 7 + 3 * 8,
+    7 + 4 * 8, 7 + 5 * 8, 7 + 6 * 8, 7 + 7 * 8,
+};
+
+*/
+constexpr uint8_t zigzag4[4] = {
+    0, 1, 2, 3
+};
+constexpr uint8_t unzigzag4[4] = {
+    0, 1, 2, 3
+};
+
+constexpr uint8_t unzigzag16[16] = {
+    0, 1, 4, 8,
+    5, 2, 3, 6,
+    9, 12, 13, 10,
+    7, 11, 14, 15
+};
+constexpr uint8_t zigzag16[16] = {
+    0, 1, 5, 6,
+    2, 4, 7, 12,
+    3, 8, 11, 13,
+    9, 10, 14, 15
+};
+constexpr uint8_t unzigzag64[64] = {
+    0,   1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+constexpr uint8_t zigzag64[64] = {
+    0, 1, 5, 6, 14, 15, 27, 28,
+    2, 4, 7, 13, 16, 26, 29, 42,
+    3, 8, 12, 17, 25, 30, 41, 43,
+    9, 11, 18, 24, 31, 40, 44, 53,
+    10, 19, 23, 32, 39, 45, 52, 54,
+    20, 22, 33, 38, 46, 51, 55, 60,
+    21, 34, 37, 47, 50, 56, 59, 61,
+    35, 36, 48, 49, 57, 58, 62, 63
+};
+
+
+int test_reverse_scan8() {
+    for (size_t i = 0; i < sizeof(scan_8)/ sizeof(scan_8[0]); ++i) {
+        auto a = reverse_scan_8[scan_8[i] >> 3][scan_8[i] & 7];
+        assert(a.neighbor_left == false && a.neighbor_up == false);
+        assert(a.scan8_index == i);
+        if (a.scan8_index != i) {
+            return 1;
+        }
+    }
+    for (int i = 0;i < 16; ++i) {
+        assert(zigzag16[unzigzag16[i]] == i);
+        assert(unzigzag16[zigzag16[i]] == i);
+    }
+    return 0;
+}
+int make_sure_reverse_scan8 = test_reverse_scan8();
+struct CoefficientCoord {
+    int mb_x;
+    int mb_y;
+    int scan8_index;
+    int zigzag_index;
+};
+
+bool get_neighbor_sub_mb(bool above, int sub_mb_size,
+                  CoefficientCoord input,
+                  CoefficientCoord *output) {
+    int mb_x = input.mb_x;
+    int mb_y = input.mb_y;
+    int scan8_index = input.scan8_index;
+    output->scan8_index = scan8_index;
+    output->mb_x = mb_x;
+    output->mb_y = mb_y;
+    output->zigzag_index = input.zigzag_index;
+    if (scan8_index >= 16 * 3) {
+        if (above) {
+            if (mb_y > 0) {
+                output->mb_y -= 1;
+                return true;
+            }
+            return false;
+        } else {
+            if (mb_x > 0) {
+                output->mb_x -= 1;
+                return true;
+            }
+            return false;
+        }
+    }
+    int scan8 = scan_8[scan8_index];
+    int left_shift = (above ? 0 : -1);
+    int above_shift = (above ? -1 : 0);
+    auto neighbor = reverse_scan_8[(scan8 >> 3) + above_shift][(scan8 & 7) + left_shift];
+    if (neighbor.neighbor_left) {
+        if (mb_x == 0){
+            return false;
+        } else {
+            --mb_x;
+        }
+    }
+    if (neighbor.neighbor_up) {
+        if (mb_y == 0) {
+            return false;
+        } else {
+            --mb_y;
+        }
+    }
+    output->scan8_index = neighbor.scan8_index;
+    if (sub_mb_size >= 32) {
+        output->scan8_index /= 4;
+        output->scan8_index *= 4; // round down to the nearest multiple of 4
+    }
+    output->zigzag_index = input.zigzag_index;
+    output->mb_x = mb_x;
+    output->mb_y = mb_y;
+    return true;
+}
+int log2(int y) {
+    int x = -1;
+    while (y) {
+        y/=2;
+        x++;
+    }
+    return x;
+}
+bool get_neighbor(bool above, int sub_mb_size,
+                  CoefficientCoord input,
+                  CoefficientCoord *output) {
+    int mb_x = input.mb_x;
+    int mb_y = input.mb_y;
+    int scan8_index = input.scan8_index;
+    int zigzag_index = input.zigzag_index;
+    int dimension = 2;
+    if (sub_mb_size > 15) {
+        dimension = 4;
+    }
+    if (sub_mb_size > 32) {
+        dimension = 8;
+    }
+    if (scan8_index >= 16 * 3) {
+        // we are DC...
+        int linear_index = unzigzag4[zigzag_index];
+        if (sub_mb_size == 16) {
+            linear_index = unzigzag16[zigzag_index];
+        } else {
+            assert(sub_mb_size <= 4);
+        }
+        if ((above && linear_index >= dimension) // if is inner
+            || ((linear_index & (dimension - 1)) && !above)) {
+            if (above) {
+                linear_index -= dimension;
+            } else {
+                -- linear_index;
+            }
+            if (sub_mb_size == 16) {
+                output->zigzag_index = zigzag16[linear_index];
+            } else {
+                output->zigzag_index = zigzag4[linear_index];
+            }
+            output->mb_x = mb_x;
+            output->mb_y = mb_y;
+            output->scan8_index = scan8_index;
+            return true;
+        }
+        if (above) {
+            if (mb_y == 0) {
+                return false;
+            }
+            linear_index += dimension * (dimension - 1);//go to bottom
+            --mb_y;
+        } else {
+            if (mb_x == 0) {
+                return false;
+            }
+            linear_index += dimension - 1;//go to end of row
+            --mb_x;
+        }
+        if (sub_mb_size == 16) {
+            output->zigzag_index = zigzag16[linear_index];
+        } else {
+            output->zigzag_index = linear_index;
+        }
+        output->mb_x = mb_x;
+        output->mb_y = mb_y;
+        output->scan8_index = scan8_index;
+        return true;
+    }
+    int scan8 = scan_8[scan8_index];
+    int left_shift = (above ? 0 : -1);
+    int above_shift = (above ? -1 : 0);
+    auto neighbor = reverse_scan_8[(scan8 >> 3) + above_shift][(scan8 & 7) + left_shift];
+    if (neighbor.neighbor_left) {
+        if (mb_x == 0){
+            return false;
+        } else {
+            --mb_x;
+        }
+    }
+    if (neighbor.neighbor_up) {
+        if (mb_y == 0) {
+            return false;
+        } else {
+            --mb_y;
+        }
+    }
+    output->scan8_index = neighbor.scan8_index;
+    if (sub_mb_size >= 32) {
+        output->scan8_index /= 4;
+        output->scan8_index *= 4; // round down to the nearest multiple of 4
+    }
+    output->zigzag_index = zigzag_index;
+    output->mb_x = mb_x;
+    output->mb_y = mb_y;
+    return true;
+}
+
+bool get_neighbor_coefficient(bool above,
+                              int sub_mb_size,
+                              CoefficientCoord input,
+                              CoefficientCoord *output) {
+    if (input.scan8_index >= 16 * 3) {
+        return get_neighbor(above, sub_mb_size, input, output);
+    }
+    int zigzag_addition = 0;
+
+    if ((sub_mb_size & (sub_mb_size - 1)) != 0) {
+        zigzag_addition = 1;// the DC is not included
+    }
+    const uint8_t *zigzag_to_raster = unzigzag16;
+    const uint8_t *raster_to_zigzag = zigzag16;
+    int dim = 4;
+    if (sub_mb_size <= 4) {
+        dim = 2;
+        zigzag_to_raster = zigzag4;
+        raster_to_zigzag = unzigzag4;
+    }
+    if (sub_mb_size > 16) {
+        dim = 16;
+        zigzag_to_raster = zigzag64;
+        raster_to_zigzag = unzigzag64;
+    }
+    int raster_coord = zigzag_to_raster[input.zigzag_index + zigzag_addition];
+    //fprintf(stderr, "%d %d   %d -> %d\n", sub_mb_size, zigzag_addition, input.zigzag_index, raster_coord);
+    if (above) {
+        if (raster_coord >= dim) {
+            raster_coord -= dim;
+        } else {
+            return false;
+        }
+    } else {
+        if (raster_coord & (dim - 1)) {
+            raster_coord -= 1;
+        } else {
+            return false;
+        }
+    }
+    *output = input;
+    output->zigzag_index = raster_to_zigzag[raster_coord] - zigzag_addition;
+    return true;
+}
+#define STRINGIFY_COMMA(s) #s ,
+const char * billing_names [] = {EACH_PIP_CODING_TYPE(STRINGIFY_COMMA)};
+#undef STRINGIFY_COMMA
+
+// Significance map context offsets, indexed by sub-block category (ctxBlockCat).
+constexpr int significance_cat_offset[14] = {
+    105+0, 105+15, 105+29, 105+44, 105+47, 402, 484+0, 484+15, 484+29, 660, 528+0, 528+15, 528+29, 718
+};
+// Significance map context offsets for 8x8 blocks (frame, field), indexed by zigzag position.
+constexpr uint8_t significance_offset_8x8[2][63] = {
+    { 0, 1, 2, 3, 4, 5, 5, 4, 4, 3, 3, 4, 4, 4, 5, 5,
+      4, 4, 4, 4, 3, 3, 6, 7, 7, 7, 8, 9,10, 9, 8, 7,
+      7, 6,11,12,13,11, 6, 7, 8, 9,14,10, 9, 8, 6,11,
+      12,13,11, 6, 9,14,10, 9,11,12,13,11,14,10,12 },
+    { 0, 1, 1, 2, 2, 3, 3, 4, 5, 6, 7, 7, 7, 8, 4, 5,
+      6, 9,10,10, 8,11,12,11, 9, 9,10,10, 8,11,12,11,
+      9, 9,10,10, 8,11,12,11, 9, 9,10,10, 8,13,13, 9,
+      9,10,10, 8,13,13, 9, 9,10,10,14,14,14,14,14 }
+};
+// Significance map context offsets for 4:2:2 chroma DC blocks, indexed by zigzag position.
+constexpr uint8_t significance_offset_chroma422_dc[7] = { 0, 0, 1, 1, 2, 2, 2 };
+
+// How zigzag positions within a sub-block map to significance map contexts.
+enum SignificanceLayout {
+  SIGNIFICANCE_LAYOUT_4x4,
+  SIGNIFICANCE_LAYOUT_8x8,
+  SIGNIFICANCE_LAYOUT_CHROMA422_DC,
+};
+
+// Varints for h264_model snapshots; signed values are zigzag coded.
+class snapshot_writer {
+ public:
+  void put(uint64_t value) {
+    for (; value >= 0x80; value >>= 7) {
+      bytes += char(value | 0x80);
+    }
+    bytes += char(value);
+  }
+  void put_signed(int64_t value) {
+    put(uint64_t(value) << 1 ^ uint64_t(value >> 63));
+  }
+  // Frames are mostly zeros: writes the length of each run of zeros and of
+  // the bytes up to the next run of 8 or more.
+  void put_sparse(const void *data, size_t size) {
+    const uint8_t *p = static_cast<const uint8_t*>(data);
+    size_t pos = 0;
+    while (pos < size) {
+      size_t start = pos;
+      while (pos < size && p[pos] == 0) pos++;
+      size_t literal = pos;
+      int zeros = 0;
+      for (; pos < size && zeros < 8; pos++) {
+        zeros = p[pos] ? 0 : zeros + 1;
+      }
+      pos -= zeros;
+      put(literal - start);
+      put(pos - literal);
+      bytes.append(reinterpret_cast<const char*>(p + literal), pos - literal);
+    }
+  }
+  std::string bytes;
+};
+
+class snapshot_reader {
+ public:
+  explicit snapshot_reader(const std::string& bytes)
+    : p(reinterpret_cast<const uint8_t*>(bytes.data())), end(p + bytes.size()) {}
+
+  uint64_t get() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+      uint8_t byte = *p++;
+      value |= uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) return value;
+    }
+    throw std::runtime_error("Invalid model snapshot.");
+  }
+  // A value in [0, max].
+  uint64_t get(uint64_t max) {
+    uint64_t value = get();
+    if (value > max) {
+      throw std::runtime_error("Invalid model snapshot.");
+    }
+    return value;
+  }
+  int64_t get_signed() {
+    uint64_t value = get();
+    return int64_t(value >> 1) ^ -int64_t(value & 1);
+  }
+  // A value in [min, max].
+  int64_t get_signed(int64_t min, int64_t max) {
+    int64_t value = get_signed();
+    if (value < min || value > max) {
+      throw std::runtime_error("Invalid model snapshot.");
+    }
+    return value;
+  }
+  void get_sparse(void *data, size_t size) {
+    uint8_t *out = static_cast<uint8_t*>(data);
+    for (size_t pos = 0; pos < size; ) {
+      uint64_t zeros = get(), literal = get();
+      if (zeros > size - pos || literal > size - pos - zeros || literal > size_t(end - p)) {
+        throw std::runtime_error("Invalid model snapshot.");
+      }
+      memset(out + pos, 0, zeros);
+      pos += zeros;
+      memcpy(out + pos, p, literal);
+      pos += literal;
+      p += literal;
+    }
+  }
+  bool done() const {
+    return p == end;
+  }
+
+ private:
+  const uint8_t *p, *end;
+};
+
+class h264_model {
+  public:
+  CodingType coding_type = PIP_UNKNOWN;
+  size_t bill[sizeof(billing_names)/sizeof(billing_names[0])];
+  size_t cabac_bill[sizeof(billing_names)/sizeof(billing_names[0])];
+  FrameBuffer frames[2];
+  int cur_frame = 0;
+  uint8_t STATE_FOR_NUM_NONZERO_BIT[6];
+#ifdef DO_NEIGHBOR_LOGGING
+  bool do_print = false;
+#endif
+ public:
+  h264_model() { reset(); memset(bill, 0, sizeof(bill)); memset(cabac_bill, 0, sizeof(cabac_bill));}
+#ifdef DO_NEIGHBOR_LOGGING
+  void enable_debug() {
+    do_print = true;
+  }
+  void disable_debug() {
+    do_print = false;
+  }
+#endif
+  ~h264_model() {
+      bool first = true;
+      for (size_t i = 0; i < sizeof(billing_names)/sizeof(billing_names[i]); ++i) {
+          if (bill[i]) {
+              if (first) {
+                  fprintf(stderr, "Avrecode Bill\n=============\n");
+              }
+              first = false;
+              fprintf(stderr, "%s : %ld\n", billing_names[i], bill[i]);
+          }
+      }
+      for (size_t i = 0; i < sizeof(billing_names)/sizeof(billing_names[i]); ++i) {
+          if (cabac_bill[i]) {
+              if (first) {
+                  fprintf(stderr, "CABAC Bill\n=============\n");
+              }
+              first = false;
+              fprintf(stderr, "%s : %ld\n", billing_names[i], cabac_bill[i]);
+          }
+      }
+  }
+  void billable_bytes(size_t num_bytes_emitted) {
+      bill[coding_type] += num_bytes_emitted;
+  }
+  void billable_cabac_bytes(size_t num_bytes_emitted, CodingType ct) {
+      cabac_bill[ct] += num_bytes_emitted;
+  }
+  void reset() {
+      // reset should do nothing as we wish to remember what we've learned
+    memset(STATE_FOR_NUM_NONZERO_BIT, 0, sizeof(STATE_FOR_NUM_NONZERO_BIT));
+  }
+  // Forgets everything learned, for a new file, but keeps the frame
+  // allocations. Predicts the same as a newly constructed model.
+  void clear() {
+    forget();
+    memset(bill, 0, sizeof(bill));
+    memset(cabac_bill, 0, sizeof(cabac_bill));
+    spec_mb_width = 0;
+  }
+  // Forgets everything learned, at a checkpoint, and begins the current
+  // frame again: predicts the same as a new model given only the last
+  // frame_spec, as when decompression starts at the checkpoint.
+  void restart() {
+    forget();
+    if (spec_mb_width != 0) {
+      update_frame_spec(spec_frame_num, spec_mb_width, spec_mb_height);
+    }
+  }
+  // libavcodec's CABAC states are keyed by their offset from the states of
+  // their CABACContext, as the address of that entry of cabac_states, so
+  // that keys neither depend on the context that parsed them (slice threads
+  // parse with one each) nor on where a restored model lives.
+  // The states of the H264SliceContext that ctx belongs to, which follow its
+  // CABACContext; h264_layout.c checks this against libavcodec's header.
+  static const uint8_t* slice_cabac_states(const CABACContext *ctx) {
+    return reinterpret_cast<const uint8_t*>(ctx + 1);
+  }
+  static int cabac_state_offset(const uint8_t *states, const uint8_t *state) {
+    size_t offset = state - states;
+    if (offset >= num_cabac_states) {
+      throw std::runtime_error("CABAC state outside its slice context.");
+    }
+    return offset;
+  }
+  const void* cabac_state(int offset) const {
+    return &cabac_states[offset];
+  }
+
+  // A compact copy of what the model has learned and of the frames it
+  // predicts from, taken between blocks. A model restored from it predicts
+  // exactly the same, in any process. Bills are not included.
+  std::string snapshot() const {
+    snapshot_writer w;
+    w.put(snapshot_version);
+    w.put(coding_type);
+    w.put(significance_layout);
+    w.put_signed(significance_cat_base);
+    for (int value : {mb_coord.mb_x, mb_coord.mb_y, mb_coord.scan8_index, mb_coord.zigzag_index,
+                      nonzeros_observed, sub_mb_cat, sub_mb_size, sub_mb_is_dc, sub_mb_chroma422,
+                      spec_frame_num, spec_mb_width, spec_mb_height}) {
+      w.put_signed(value);
+    }
+    for (uint8_t state : STATE_FOR_NUM_NONZERO_BIT) {
+      w.put(state);
+    }
+    w.put(cur_frame);
+    for (const FrameBuffer& frame : frames) {
+      w.put(frame.width());
+      w.put(frame.height());
+      if (frame.width() != 0) {
+        w.put_signed(frame.frame_num());
+        w.put_sparse(&frame.at(0, 0), sizeof(Block) * frame.width() * frame.height());
+        w.put_sparse(&frame.meta_at(0, 0), sizeof(BlockMeta) * frame.width() * frame.height());
+      }
+    }
+    w.put(estimators.size());
+    int prev_id = 0;
+    for (const auto& e : estimators) {
+      int id = context_id(std::get<0>(e.first));
+      w.put_signed(id - prev_id);
+      prev_id = id;
+      w.put_signed(std::get<1>(e.first));
+      w.put_signed(std::get<2>(e.first));
+      w.put(e.second.pos);
+      w.put(e.second.neg);
+    }
+    return w.bytes;
+  }
+
+  // Replaces the model's state with a snapshot's. Throws if the snapshot is
+  // invalid.
+  void restore(const std::string& snapshot) {
+    snapshot_reader r(snapshot);
+    if (r.get() != snapshot_version) {
+      throw std::runtime_error("Unsupported model snapshot version.");
+    }
+    forget();
+    CodingType ct = CodingType(r.get(sizeof(billing_names)/sizeof(billing_names[0]) - 1));
+    significance_layout = SignificanceLayout(r.get(2));
+    significance_cat_base = r.get_signed(INT_MIN, INT_MAX);
+    for (int *value : {&mb_coord.mb_x, &mb_coord.mb_y, &mb_coord.scan8_index, &mb_coord.zigzag_index,
+                       &nonzeros_observed, &sub_mb_cat, &sub_mb_size, &sub_mb_is_dc, &sub_mb_chroma422,
+                       &spec_frame_num, &spec_mb_width, &spec_mb_height}) {
+      *value = r.get_signed(INT_MIN, INT_MAX);
+    }
+    for (uint8_t& state : STATE_FOR_NUM_NONZERO_BIT) {
+      state = r.get(255);
+    }
+    cur_frame = r.get(1);
+    for (FrameBuffer& frame : frames) {
+      uint32_t width = r.get(max_frame_mbs), height = r.get(max_frame_mbs);
+      if (uint64_t(width) * height > max_frame_mbs || (width == 0) != (height == 0)) {
+        throw std::runtime_error("Invalid model snapshot.");
+      }
+      if (width == 0) {
+        continue;
+      }
+      if (frame.width() != width || frame.height() != height) {
+        frame.init(width, height, width * height);
+      }
+      frame.set_frame_num(r.get_signed(INT_MIN, INT_MAX));
+      r.get_sparse(&frame.at(0, 0), sizeof(Block) * width * height);
+      r.get_sparse(&frame.meta_at(0, 0), sizeof(BlockMeta) * width * height);
+    }
+    int id = 0;
+    for (uint64_t n = r.get(); n > 0; n--) {
+      id += r.get_signed(-num_contexts, num_contexts);
+      const void *context = context_for_id(id);
+      int a = r.get_signed(INT_MIN, INT_MAX), b = r.get_signed(INT_MIN, INT_MAX);
+      estimator& e = estimators.emplace_hint(estimators.end(), model_key(context, a, b), estimator())->second;
+      e.pos = r.get(INT_MAX);
+      e.neg = r.get(INT_MAX);
+      if (e.pos == 0 || e.neg == 0) {
+        throw std::runtime_error("Invalid model snapshot.");
+      }
+    }
+    if (!r.done()) {
+      throw std::runtime_error("Invalid model snapshot.");
+    }
+    set_coding_type(ct);
+  }
+
+  void forget() {
+    reset();
+    coding_type = PIP_UNKNOWN;
+    for (auto& frame : frames) {
+      if (frame.width() != 0) {
+        frame.bzero();
+        frame.set_frame_num(-1);
+      }
+    }
+    cur_frame = 0;
+    mb_coord = CoefficientCoord();
+    nonzeros_observed = 0;
+    sub_mb_cat = -1;
+    sub_mb_size = -1;
+    sub_mb_is_dc = 0;
+    sub_mb_chroma422 = 0;
+    significance_layout = SIGNIFICANCE_LAYOUT_4x4;
+    significance_cat_base = 0;
+    estimators.clear();
+  }
+  bool fetch(bool previous, bool match_type, CoefficientCoord coord, int16_t*output) const{
+      if (match_type && (previous || coord.mb_x != mb_coord.mb_x || coord.mb_y != mb_coord.mb_y)) {
+          BlockMeta meta = frames[previous ? !cur_frame : cur_frame].meta_at(coord.mb_x, coord.mb_y);
+          if (!meta.coded) { // when we populate mb_type in the metadata, then we can use it here
+              return false;
+          }
+      }
+      *output = frames[previous ? !cur_frame : cur_frame].at(coord.mb_x, coord.mb_y).residual[coord.scan8_index * 16 + coord.zigzag_index];
+      return true;
+  }
+  // For bins driven one at a time by libavcodec. A whole significance map
+  // queued by the compressor goes through code_significance_map() instead.
+  model_key get_model_key(const void *context) const {
+      switch (coding_type) {
+        case PIP_SIGNIFICANCE_MAP:
+          switch (significance_layout) {
+            case SIGNIFICANCE_LAYOUT_8x8:
+              return model_key_for<PIP_SIGNIFICANCE_MAP, SIGNIFICANCE_LAYOUT_8x8>(context);
+            case SIGNIFICANCE_LAYOUT_CHROMA422_DC:
+              return model_key_for<PIP_SIGNIFICANCE_MAP, SIGNIFICANCE_LAYOUT_CHROMA422_DC>(context);
+            default:
+              return model_key_for<PIP_SIGNIFICANCE_MAP, SIGNIFICANCE_LAYOUT_4x4>(context);
+          }
+        case PIP_SIGNIFICANCE_EOB:
+          return model_key_for<PIP_SIGNIFICANCE_EOB>(context);
+        case PIP_SIGNIFICANCE_NZ:
+        case PIP_UNKNOWN:
+        case PIP_UNREACHABLE:
+        case PIP_RESIDUALS:
+          return model_key_for<PIP_UNKNOWN>(context);
+        default:
+          assert(false && "Unreachable");
+          abort();
+      }
+  }
+  void set_coding_type(CodingType ct) {
+      coding_type = ct;
+  }
+  // Runs the bins of a significance map, queued while the sub-block was
+  // parsed, back through the model and calls code_bin(symbol, key) for each
+  // bin the encoder has to code; EOB bins follow from the nonzero count. The
+  // sub-block's layout is dispatched on once for the run, not per bin.
+  template <class Iterator, class CodeBin>
+  void code_significance_map(Iterator begin, Iterator end, const CodeBin &code_bin) {
+    reset_mb_significance_state_tracking();
+    switch (significance_layout) {
+      case SIGNIFICANCE_LAYOUT_8x8:
+        significance_run<SIGNIFICANCE_LAYOUT_8x8>(begin, end, code_bin);
+        break;
+      case SIGNIFICANCE_LAYOUT_CHROMA422_DC:
+        significance_run<SIGNIFICANCE_LAYOUT_CHROMA422_DC>(begin, end, code_bin);
+        break;
+      default:
+        significance_run<SIGNIFICANCE_LAYOUT_4x4>(begin, end, code_bin);
+        break;
+    }
+  }
+  range_t probability_for_model_key(range_t range, model_key key) {
+    auto* e = &estimators[key];
+    int total = e->pos + e->neg;
+    return (range/total) * e->pos;
+  }
+  range_t probability_for_state(range_t range, const void *context) {
+    return probability_for_model_key(range, get_model_key(context));
+  }
+  // Model hooks, called by libavcodec as it parses each macroblock.
+  void frame_spec(int frame_num, int mb_width, int mb_height) {
+    update_frame_spec(frame_num, mb_width, mb_height);
+  }
+  void mb_xy(int x, int y) {
+    mb_coord.mb_x = x;
+    mb_coord.mb_y = y;
+  }
+  void begin_sub_mb(int cat, int scan8index, int max_coeff, int is_dc, int chroma422) {
+    sub_mb_cat = cat;
+    mb_coord.scan8_index = scan8index;
+    sub_mb_size = max_coeff;
+    sub_mb_is_dc = is_dc;
+    sub_mb_chroma422 = chroma422;
+  }
+  void end_sub_mb(int cat, int scan8index, int max_coeff, int is_dc, int chroma422) {
+    assert(sub_mb_cat == cat);
+    assert(mb_coord.scan8_index == scan8index);
+    assert(sub_mb_size == max_coeff);
+    assert(sub_mb_is_dc == is_dc);
+    assert(sub_mb_chroma422 == chroma422);
+    sub_mb_cat = -1;
+    mb_coord.scan8_index = -1;
+    sub_mb_size = -1;
+    sub_mb_is_dc = 0;
+    sub_mb_chroma422 = 0;
+  }
+
+  void update_frame_spec(int frame_num, int mb_width, int mb_height) {
+    spec_frame_num = frame_num;
+    spec_mb_width = mb_width;
+    spec_mb_height = mb_height;
+    if (frames[cur_frame].width() != (uint32_t)mb_width
+        || frames[cur_frame].height() != (uint32_t)mb_height
+        || !frames[cur_frame].is_same_frame(frame_num)) {
+      cur_frame = !cur_frame;
+      if (frames[cur_frame].width() != (uint32_t)mb_width
+          || frames[cur_frame].height() != (uint32_t)mb_height) {
+        frames[cur_frame].init(mb_width, mb_height, mb_width * mb_height);
+        if (frames[!cur_frame].width() != (uint32_t)mb_width
+            || frames[!cur_frame].height() != (uint32_t)mb_height) {
+            frames[!cur_frame].init(mb_width, mb_height, mb_width * mb_height);
+        }
+        //fprintf(stderr, "Init(%d=%d) %d x %d\n", frame_num, cur_frame, mb_width, mb_height);
+      } else {
+        frames[cur_frame].bzero();
+        //fprintf(stderr, "Clear (%d=%d)\n", frame_num, cur_frame);
+      }
+      frames[cur_frame].set_frame_num(frame_num);
+    }
+  }
+  template <class Functor>
+  void finished_queueing(CodingType ct, const Functor &put_or_get) {
+
+    if (ct == PIP_SIGNIFICANCE_MAP) {
+      bool block_of_interest = (sub_mb_cat == 1 || sub_mb_cat == 2);
+      CodingType last = coding_type;
+      set_coding_type(PIP_SIGNIFICANCE_NZ);
+      BlockMeta &meta = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y);
+      int nonzero_bits[6] = {};
+      for (int i= 0; i < 6; ++i) {
+          nonzero_bits[i] = (meta.num_nonzeros[mb_coord.scan8_index] & (1 << i)) >> i;
+      }
+#define QUEUE_MODE
+#ifdef QUEUE_MODE
+      const uint32_t serialized_bits = sub_mb_size > 16 ? 6 : sub_mb_size > 4 ? 4 : 2;
+      {
+          uint32_t i = 0;
+          uint32_t serialized_so_far = 0;
+          CoefficientCoord neighbor;
+          uint32_t left_nonzero = 0;
+          uint32_t above_nonzero = 0;
+          bool has_left = get_neighbor_sub_mb(false, sub_mb_size, mb_coord, &neighbor);
+          if (has_left) {
+              left_nonzero = frames[cur_frame].meta_at(neighbor.mb_x, neighbor.mb_y).num_nonzeros[neighbor.scan8_index];
+          }
+          bool has_above = get_neighbor_sub_mb(true, sub_mb_size, mb_coord, &neighbor);
+          if (has_above) {
+              above_nonzero = frames[cur_frame].meta_at(neighbor.mb_x, neighbor.mb_y).num_nonzeros[neighbor.scan8_index];
+          }
+          
+          do {
+              uint32_t cur_bit = (1<<i);
+              int left_nonzero_bit = 2;
+              if (has_left) {
+                  left_nonzero_bit = (left_nonzero >= cur_bit);
+              }
+              int above_nonzero_bit = 2;
+              if (above_nonzero) {
+                  above_nonzero_bit = (above_nonzero >= cur_bit);
+              }
+              put_or_get(model_key(&(STATE_FOR_NUM_NONZERO_BIT[i]), serialized_so_far + 64 * (frames[!cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index] >= cur_bit) + 128 * left_nonzero_bit + 384 * above_nonzero_bit, meta.is_8x8 + sub_mb_is_dc * 2 + sub_mb_chroma422 + sub_mb_cat * 4), &nonzero_bits[i]);
+              if (nonzero_bits[i]) {
+                  serialized_so_far |= cur_bit;
+              }
+          } while (++i < serialized_bits);
+          if (block_of_interest) {
+              LOG_NEIGHBORS("<{");
+          }
+          if (has_left) {
+              if (block_of_interest) {
+                  LOG_NEIGHBORS("%d,", left_nonzero);
+              }
+          } else {
+              if (block_of_interest) {
+                  LOG_NEIGHBORS("X,");
+              }
+          }
+          if (has_above) {
+              if (block_of_interest) {
+                  LOG_NEIGHBORS("%d,", above_nonzero);
+              }
+          } else {
+              if (block_of_interest) {
+                  LOG_NEIGHBORS("X,");
+              }
+          }
+          if (frames[!cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).coded) {
+              if (block_of_interest) {
+                  LOG_NEIGHBORS("%d",frames[!cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index]);
+              }
+          } else {
+              if (block_of_interest) {
+                  LOG_NEIGHBORS("X");
+              }
+          }
+      }
+#endif
+      meta.num_nonzeros[mb_coord.scan8_index] = 0;
+      for (int i= 0; i < 6; ++i) {
+          meta.num_nonzeros[mb_coord.scan8_index] |= nonzero_bits[i] << i;
+      }
+      if (block_of_interest) {
+          LOG_NEIGHBORS("} %d> ",meta.num_nonzeros[mb_coord.scan8_index]);
+      }
+      set_coding_type(last);
+    }
+  }
+  void end_coding_type(CodingType ct) {
+      if (ct == PIP_SIGNIFICANCE_MAP) {
+        assert(coding_type == PIP_UNREACHABLE
+               || (coding_type == PIP_SIGNIFICANCE_MAP && mb_coord.zigzag_index == 0));
+        uint8_t num_nonzeros = 0;
+        for (int i = 0; i < sub_mb_size; ++i) {
+            int16_t res = frames[cur_frame].at(mb_coord.mb_x, mb_coord.mb_y).residual[mb_coord.scan8_index * 16 + i];
+            assert(res == 1 || res == 0);
+            if (res != 0) {
+                num_nonzeros += 1;
+            }
+        }
+        BlockMeta &meta = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y);
+        meta.is_8x8 = meta.is_8x8 || (sub_mb_size > 32); // 8x8 will have DC be 2x2
+        meta.coded = true;
+        assert(meta.num_nonzeros[mb_coord.scan8_index] == 0 || meta.num_nonzeros[mb_coord.scan8_index] == num_nonzeros);
+        meta.num_nonzeros[mb_coord.scan8_index] = num_nonzeros;
+      }
+      set_coding_type(PIP_UNKNOWN);
+  }
+  bool begin_coding_type(CodingType ct, int zz_index, int param0, int param1) {
+
+    bool begin_queueing = false;
+    switch (ct) {
+    case PIP_SIGNIFICANCE_MAP:
+      {
+          BlockMeta &meta = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y);
+          meta.num_nonzeros[mb_coord.scan8_index] = 0;
+      }
+      assert(sub_mb_cat >= 0 && sub_mb_cat < (int)(sizeof(significance_cat_offset)/sizeof(significance_cat_offset[0])));
+      significance_cat_base = 16 * 2 * significance_cat_offset[sub_mb_cat];
+      if (sub_mb_is_dc && sub_mb_chroma422) {
+          significance_layout = SIGNIFICANCE_LAYOUT_CHROMA422_DC;
+      } else if (sub_mb_size > 32) {
+          significance_layout = SIGNIFICANCE_LAYOUT_8x8;
+      } else {
+          significance_layout = SIGNIFICANCE_LAYOUT_4x4;
+      }
+      assert(!zz_index);
+      nonzeros_observed = 0;
+      if (sub_mb_is_dc) {
+        mb_coord.zigzag_index = 0;
+      } else {
+        mb_coord.zigzag_index = 0;
+      }
+      begin_queueing = true;
+      break;
+    default:
+      break;
+    }
+    set_coding_type(ct);
+    return begin_queueing;
+  }
+  void reset_mb_significance_state_tracking() {
+      mb_coord.zigzag_index = 0;
+      nonzeros_observed = 0;
+      set_coding_type(PIP_SIGNIFICANCE_MAP);
+  }
+  void update_state_tracking(int symbol) {
+    switch (coding_type) {
+    case PIP_SIGNIFICANCE_NZ:
+      break;
+    case PIP_SIGNIFICANCE_MAP:
+      frames[cur_frame].at(mb_coord.mb_x, mb_coord.mb_y).residual[mb_coord.scan8_index * 16 + mb_coord.zigzag_index] = symbol;
+      nonzeros_observed += symbol;
+      if (mb_coord.zigzag_index + 1 == sub_mb_size) {
+        set_coding_type(PIP_UNREACHABLE);
+        mb_coord.zigzag_index = 0;
+      } else {
+        if (symbol) {
+          set_coding_type(PIP_SIGNIFICANCE_EOB);
+        } else {
+          ++mb_coord.zigzag_index;
+          if (mb_coord.zigzag_index + 1 == sub_mb_size) {
+              // if we were a zero and we haven't eob'd then the
+              // next and last must be a one
+              frames[cur_frame].at(mb_coord.mb_x, mb_coord.mb_y).residual[mb_coord.scan8_index * 16 + mb_coord.zigzag_index] = 1;
+              ++nonzeros_observed;
+              set_coding_type(PIP_UNREACHABLE);
+              mb_coord.zigzag_index = 0;
+          }
+        }
+      }
+      break;
+    case PIP_SIGNIFICANCE_EOB:
+      if (symbol) {
+        mb_coord.zigzag_index = 0;
+        set_coding_type(PIP_UNREACHABLE);
+      } else if (mb_coord.zigzag_index + 2 == sub_mb_size) {
+        frames[cur_frame].at(mb_coord.mb_x, mb_coord.mb_y).residual[mb_coord.scan8_index * 16 + mb_coord.zigzag_index + 1] = 1;
+        set_coding_type(PIP_UNREACHABLE);
+      } else {
+        set_coding_type(PIP_SIGNIFICANCE_MAP);
+        ++mb_coord.zigzag_index;
+      }
+      break;
+    case PIP_RESIDUALS:
+    case PIP_UNKNOWN:
+      break;
+    case PIP_UNREACHABLE:
+      assert(false);
+    default:
+      assert(false);
+    }
+  }
+  void update_state(int symbol, const void *context) {
+      update_state_for_model_key(symbol, get_model_key(context));
+  }
+  void update_state_for_model_key(int symbol, model_key key) {
+    if (coding_type == PIP_SIGNIFICANCE_EOB) {
+        int num_nonzeros = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index];
+        assert(symbol == (num_nonzeros == nonzeros_observed));
+    }
+    auto* e = &estimators[key];
+    if (symbol) {
+      e->pos++;
+    } else {
+      e->neg++;
+    }
+    if ((coding_type != PIP_SIGNIFICANCE_MAP && e->pos + e->neg > 0x60)
+        || (coding_type == PIP_SIGNIFICANCE_MAP && e->pos + e->neg > 0x50)) {
+      e->pos = (e->pos + 1) / 2;
+      e->neg = (e->neg + 1) / 2;
+    }
+    update_state_tracking(symbol);
+  }
+
+  const uint8_t bypass_context = 0, terminate_context = 0, significance_context = 0, significance_eob_context = 0;
+  CoefficientCoord mb_coord;
+  int nonzeros_observed = 0;
+  int sub_mb_cat = -1;
+  int sub_mb_size = -1;
+  int sub_mb_is_dc = 0;
+  int sub_mb_chroma422 = 0;
+  // The last frame_spec, for restart.
+  int spec_frame_num = 0, spec_mb_width = 0, spec_mb_height = 0;
+  static constexpr int num_cabac_states = 1024;
+  uint8_t cabac_states[num_cabac_states];
+ private:
+  // Context derivation is specialised at compile time per coding type and,
+  // for the significance map, per sub-block layout.
+  template <CodingType ct, SignificanceLayout layout = SIGNIFICANCE_LAYOUT_4x4>
+  model_key model_key_for(const void *context) const {
+      switch (ct) {
+        case PIP_SIGNIFICANCE_MAP:
+          {
+              int zigzag_offset = mb_coord.zigzag_index;
+              if (layout == SIGNIFICANCE_LAYOUT_CHROMA422_DC) {
+                  assert(mb_coord.zigzag_index < 7);
+                  zigzag_offset = significance_offset_chroma422_dc[mb_coord.zigzag_index];
+              } else if (layout == SIGNIFICANCE_LAYOUT_8x8) {
+                  assert(mb_coord.zigzag_index < 63);
+                  zigzag_offset = significance_offset_8x8[0][mb_coord.zigzag_index];
+              }
+#ifdef DO_NEIGHBOR_LOGGING
+              if (do_print) {
+                  log_significance_neighbors();
+              }
+#endif
+              int num_nonzeros = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index];
+              return model_key(&significance_context,
+                               64 * num_nonzeros + nonzeros_observed,
+                               sub_mb_is_dc + zigzag_offset * 2 + significance_cat_base);
+          }
+        case PIP_SIGNIFICANCE_EOB:
+          {
+            // FIXME: why doesn't this prior help at all
+            int num_nonzeros = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index];
+
+            return model_key(&significance_eob_context, num_nonzeros == nonzeros_observed, 0);
+          }
+        default:
+          return model_key(context, 0, 0);
+      }
+  }
+
+  template <SignificanceLayout layout, class Iterator, class CodeBin>
+  void significance_run(Iterator bin, Iterator end, const CodeBin &code_bin) {
+    for (; bin != end; ++bin) {
+      int symbol = *bin;
+      assert(coding_type == PIP_SIGNIFICANCE_MAP || coding_type == PIP_SIGNIFICANCE_EOB);
+#ifdef DO_NEIGHBOR_LOGGING
+      if (sub_mb_cat == 1 || sub_mb_cat == 2) {
+        if (coding_type == PIP_SIGNIFICANCE_MAP) {
+          log_significance_neighbors();
+          LOG_NEIGHBORS("%d ", symbol);
+        } else if (symbol) {
+          LOG_NEIGHBORS("\n");
+        }
+      }
+#endif
+      if (coding_type == PIP_SIGNIFICANCE_MAP) {
+        model_key key = model_key_for<PIP_SIGNIFICANCE_MAP, layout>(nullptr);
+        code_bin(symbol, key);
+        update_state_for_model_key(symbol, key);
+      } else {
+        update_state_for_model_key(symbol, model_key_for<PIP_SIGNIFICANCE_EOB>(nullptr));
+      }
+    }
+  }
+
+  // Snapshot ids of the contexts estimators are keyed by: the CABAC states
+  // by offset, then the model's own contexts.
+  int context_id(const void *context) const {
+    const uint8_t *p = static_cast<const uint8_t*>(context);
+    if (p >= cabac_states && p < cabac_states + num_cabac_states) {
+      return p - cabac_states;
+    }
+    if (p >= STATE_FOR_NUM_NONZERO_BIT && p < STATE_FOR_NUM_NONZERO_BIT + 6) {
+      return num_cabac_states + (p - STATE_FOR_NUM_NONZERO_BIT);
+    }
+    const uint8_t *own[] = {&bypass_context, &terminate_context, &significance_context, &significance_eob_context};
+    for (int i = 0; i < 4; i++) {
+      if (p == own[i]) return num_cabac_states + 6 + i;
+    }
+    throw std::runtime_error("Model key outside the model.");
+  }
+  const void* context_for_id(int id) const {
+    if (id >= 0 && id < num_cabac_states) {
+      return &cabac_states[id];
+    }
+    if (id >= num_cabac_states && id < num_cabac_states + 6) {
+      return &STATE_FOR_NUM_NONZERO_BIT[id - num_cabac_states];
+    }
+    const uint8_t *own[] = {&bypass_context, &terminate_context, &significance_context, &significance_eob_context};
+    if (id >= num_cabac_states + 6 && id < num_contexts) {
+      return own[id - num_cabac_states - 6];
+    }
+    throw std::runtime_error("Invalid model snapshot.");
+  }
+  static constexpr int num_contexts = num_cabac_states + 6 + 4;
+  static constexpr int snapshot_version = 1;
+  static constexpr uint32_t max_frame_mbs = 1 << 18;
+
+#ifdef DO_NEIGHBOR_LOGGING
+  // Print the significance of the left, above and previous-frame coefficients.
+  // Haven't found a good way to utilize these priors to make the results better.
+  void log_significance_neighbors() const {
+      LOG_NEIGHBORS("[");
+      for (bool above : {false, true}) {
+          CoefficientCoord neighbor = {0, 0, 0, 0};
+          int16_t tmp = 0;
+          if (!get_neighbor(above, sub_mb_size, mb_coord, &neighbor)) {
+              LOG_NEIGHBORS("x,");
+          } else if (fetch(false, true, neighbor, &tmp)) {
+              LOG_NEIGHBORS("%d,", tmp);
+          } else {
+              LOG_NEIGHBORS("_,");
+          }
+      }
+      // FIXME: why doesn't this prior help at all
+      int16_t output = 0;
+      if (fetch(true, true, mb_coord, &output)) {
+          LOG_NEIGHBORS("%d] ", output);
+      } else {
+          LOG_NEIGHBORS("x] ");
+      }
+  }
+#endif
+
+  // Chosen per sub-block by begin_coding_type(PIP_SIGNIFICANCE_MAP).
+  SignificanceLayout significance_layout = SIGNIFICANCE_LAYOUT_4x4;
+  int significance_cat_base = 0;
+
+  struct estimator { int pos = 1, neg = 1; };
+  std::map<model_key, estimator> estimators;
+};
+
+}  // namespace
+}  // namespace
@@ -0,0 +1,379 @@
+//
+// Compression of literal (non-CABAC) blocks: container boxes, parameter sets,
+// SEI, audio, and slices that could not be recoded.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// A static order-0 or order-1 byte model per block, coded with four
+// interleaved rANS states, so decoding runs at hundreds of MB/s.
+struct literal_code {
+  // Blocks smaller than this are not worth a frequency table.
+  static constexpr size_t min_size = 256;
+
+  // Compresses size bytes to *out. Returns false if the block is too small
+  // or the model doesn't help, in which case it should be stored raw.
+  static bool encode(const uint8_t *in, size_t size, std::string *out) {
+    out->clear();
+    if (size < min_size) {
+      return false;
+    }
+    // Both orders are counted; the one with the smaller estimated size,
+    // tables included, is coded.
+    tables order0(0), order1(1);
+    order0.count(in, size);
+    order1.count(in, size);
+    std::string header0, header1;
+    double size0 = order0.normalize(&header0), size1 = order1.normalize(&header1);
+    tables& t = size1 < size0 ? order1 : order0;
+    const std::string& header = size1 < size0 ? header1 : header0;
+    if (std::min(size0, size1) >= size - size / 32) {
+      return false;
+    }
+
+    // Each lane codes its segment to a stream of its own, so that lanes
+    // decode independently. rANS codes backwards: a lane's stream is
+    // produced from its end, starting with its last byte.
+    *out = header;
+    std::string streams;
+    segments s(size);
+    std::vector<uint8_t> buffer(2 * (size - s.start[lanes - 1]) + 4);
+    for (int lane = 0; lane < lanes; lane++) {
+      uint8_t *end = buffer.data() + buffer.size(), *p = end;
+      uint32_t state = rans_low;
+      for (size_t i = s.end(lane); i-- > s.start[lane];) {
+        int context = t.order && i != s.start[lane] ? in[i - 1] : 0;
+        const symbol& sym = t.symbols[context << 8 | in[i]];
+        if (state >= uint64_t((rans_low >> scale_bits) << 16) * sym.freq) {
+          p -= 2;
+          p[0] = uint8_t(state);
+          p[1] = uint8_t(state >> 8);
+          state >>= 16;
+        }
+        state = ((state / sym.freq) << scale_bits) + state % sym.freq + sym.start;
+      }
+      for (int shift = 0; shift < 32; shift += 8) {
+        *--p = uint8_t(state >> shift);
+      }
+      if (lane < lanes - 1) {
+        put_varint(out, end - p);
+      }
+      streams.append(reinterpret_cast<const char*>(p), end - p);
+    }
+    if (out->size() + streams.size() >= size) {
+      return false;
+    }
+    out->append(streams);
+    return true;
+  }
+
+  // Decompresses a block of the given original size.
+  static std::string decode(const std::string& in, size_t size) {
+    std::string out(size, '\0');
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(in.data()), *end = p + in.size();
+    tables t(0);
+    t.read(&p, end);
+    size_t lengths[lanes];
+    for (int i = 0; i < lanes - 1; i++) {
+      lengths[i] = get_varint(&p, end);
+    }
+    lane l[lanes];
+    for (int i = 0; i < lanes; i++) {
+      size_t length = i < lanes - 1 ? lengths[i] : end - p;
+      if (length < 4 || length > size_t(end - p)) {
+        throw std::runtime_error("Truncated coded literal.");
+      }
+      l[i].state = uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+      l[i].p = p + 4;
+      p += length;
+      l[i].end = p;
+    }
+    // The lanes and tables are read through locals, so the byte stores
+    // can't make them reload.
+    const decoder d{t.slots.data(), t.symbols.data(), t.slot_base, uint32_t(t.order ? 0xff : 0)};
+    lane l0 = l[0], l1 = l[1], l2 = l[2], l3 = l[3];
+    segments s(size);
+    uint8_t *o = reinterpret_cast<uint8_t*>(&out[0]);
+    uint8_t *o0 = o + s.start[0], *o1 = o + s.start[1], *o2 = o + s.start[2], *o3 = o + s.start[3];
+    // A byte reads at most 2 bytes of its lane's stream, so runs of bytes
+    // whose streams are long enough are decoded without bounds checks.
+    for (size_t i = 0; i < s.length;) {
+      size_t run = std::min<size_t>(s.length - i, 64);
+      if (std::min(std::min(l0.end - l0.p, l1.end - l1.p), std::min(l2.end - l2.p, l3.end - l3.p)) >=
+          ptrdiff_t(2 * run)) {
+        for (size_t end = i + run; i < end; i++) {
+          o0[i] = d.get<false>(&l0);
+          o1[i] = d.get<false>(&l1);
+          o2[i] = d.get<false>(&l2);
+          o3[i] = d.get<false>(&l3);
+        }
+      } else {
+        for (size_t end = i + run; i < end; i++) {
+          o0[i] = d.get<true>(&l0);
+          o1[i] = d.get<true>(&l1);
+          o2[i] = d.get<true>(&l2);
+          o3[i] = d.get<true>(&l3);
+        }
+      }
+    }
+    for (size_t i = s.start[3] + s.length; i < size; i++) {
+      o[i] = d.get<true>(&l3);
+    }
+    return out;
+  }
+
+ private:
+  static constexpr int lanes = 4;
+  static constexpr int scale_bits = 12;
+  static constexpr uint32_t scale = 1 << scale_bits;
+  // States stay in [rans_low, 2^32), and are renormalized 16 bits at a
+  // time.
+  static constexpr uint32_t rans_low = 1 << 16;
+
+  // The block is split into one segment per lane, the last taking the
+  // remainder. Each segment's first byte has context 0.
+  struct segments {
+    explicit segments(size_t size) : size(size), length(size / lanes) {
+      for (int lane = 0; lane < lanes; lane++) {
+        start[lane] = lane * length;
+      }
+    }
+    size_t end(int lane) const {
+      return lane == lanes - 1 ? size : start[lane] + length;
+    }
+    size_t size, length;
+    size_t start[lanes];
+  };
+
+  struct symbol {
+    uint16_t freq = 0, start = 0;
+  };
+
+  // A lane's decoding state, the last byte it decoded, and its stream.
+  struct lane {
+    uint32_t state, context = 0;
+    const uint8_t *p, *end;
+  };
+
+  struct decoder {
+    // Decodes a lane's next byte, checking that its stream has the bytes
+    // read if checked.
+    template <bool checked>
+    uint8_t get(lane *l) const {
+      uint32_t slot = l->state & (scale - 1);
+      uint8_t byte = slots[slot_base[l->context] + slot];
+      const symbol& sym = symbols[l->context << 8 | byte];
+      l->state = sym.freq * (l->state >> scale_bits) + slot - sym.start;
+      // At most one 16-bit renormalization, taken at random, so it is
+      // done without a branch.
+      uint32_t renormalize = l->state < rans_low;
+      if (checked && l->end - l->p < 2) {
+        if (renormalize) {
+          throw std::runtime_error("Truncated coded literal.");
+        }
+      } else {
+        uint32_t word = l->p[0] | l->p[1] << 8;
+        l->state = l->state << (16 * renormalize) | (word & -renormalize);
+        l->p += 2 * renormalize;
+      }
+      l->context = byte & context_mask;
+      return byte;
+    }
+
+    const uint8_t *slots;
+    const symbol *symbols;
+    const uint32_t *slot_base;
+    uint32_t context_mask;
+  };
+
+  static void put_varint(std::string *out, uint64_t value) {
+    for (; value >= 0x80; value >>= 7) {
+      out->push_back(char(value | 0x80));
+    }
+    out->push_back(char(value));
+  }
+
+  static uint64_t get_varint(const uint8_t **p, const uint8_t *end) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+      uint8_t byte = *(*p)++;
+      value |= uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) return value;
+    }
+    throw std::runtime_error("Truncated coded literal.");
+  }
+
+  // A frequency table per context: one for order 0, or one for each
+  // previous byte for order 1. Written as the order, for order 1 a bitmap
+  // of the contexts that occur, then for each table the number of symbols,
+  // the symbols as deltas, and their frequencies as varints.
+  struct tables {
+    explicit tables(int order) : order(order) {}
+
+    void count(const uint8_t *in, size_t size) {
+      counts.assign(order ? 256 * 256 : 256, 0);
+      segments s(size);
+      for (int lane = 0; lane < lanes; lane++) {
+        int context = 0;
+        for (size_t i = s.start[lane]; i < s.end(lane); i++) {
+          counts[(order ? context << 8 : 0) | in[i]]++;
+          context = in[i];
+        }
+      }
+    }
+
+    // Scales the counts to frequencies summing to scale, writes the tables
+    // to *header, and returns the estimated coded size in bytes.
+    double normalize(std::string *header) {
+      int contexts = order ? 256 : 1;
+      symbols.assign(contexts << 8, symbol());
+      header->assign(1, char(order));
+      size_t bitmap = header->size();
+      if (order) {
+        header->append(32, '\0');
+      }
+      double bits = 0;
+      for (int context = 0; context < contexts; context++) {
+        const uint32_t *c = &counts[context << 8];
+        uint64_t total = 0;
+        int used = 0, largest = 0;
+        for (int byte = 0; byte < 256; byte++) {
+          total += c[byte];
+          used += c[byte] > 0;
+          if (c[byte] > c[largest]) largest = byte;
+        }
+        if (total == 0) {
+          continue;
+        }
+        symbol *sym = &symbols[context << 8];
+        int64_t sum = 0;
+        for (int byte = 0; byte < 256; byte++) {
+          if (c[byte]) {
+            sym[byte].freq = std::max<uint64_t>(1, c[byte] * scale / total);
+            sum += sym[byte].freq;
+          }
+        }
+        // Rounding leaves the sum off by at most the number of symbols.
+        if (sum < scale) {
+          sym[largest].freq += scale - sum;
+        }
+        while (sum > scale) {
+          int most = 0;
+          for (int byte = 1; byte < 256; byte++) {
+            if (sym[byte].freq > sym[most].freq) most = byte;
+          }
+          int cut = std::min<int64_t>(sum - scale, sym[most].freq / 2);
+          sym[most].freq -= cut;
+          sum -= cut;
+        }
+
+        if (order) {
+          (*header)[bitmap + context / 8] |= char(1 << (context % 8));
+        }
+        header->push_back(char(used - 1));
+        int prev = 0;
+        for (int byte = 0; byte < 256; byte++) {
+          if (sym[byte].freq) {
+            header->push_back(char(byte - prev));
+            prev = byte;
+            bits += c[byte] * (scale_bits - std::log2(sym[byte].freq));
+          }
+        }
+        for (int byte = 0; byte < 256; byte++) {
+          if (sym[byte].freq) {
+            put_varint(header, sym[byte].freq);
+          }
+        }
+        assign_starts(context);
+      }
+      return header->size() + bits / 8 + 4 * lanes;
+    }
+
+    // Reads the tables written by normalize, and builds the slot lookups.
+    void read(const uint8_t **p, const uint8_t *end) {
+      auto byte = [&]() {
+        if (*p == end) {
+          throw std::runtime_error("Truncated coded literal.");
+        }
+        return *(*p)++;
+      };
+      order = byte();
+      if (order > 1) {
+        throw std::runtime_error("Invalid coded literal.");
+      }
+      int contexts = order ? 256 : 1;
+      uint8_t present[32];
+      for (int i = 0; i < 32; i++) {
+        present[i] = order ? byte() : 1;
+      }
+      // Contexts without a table only occur in invalid input; they get
+      // zero frequencies and the slots at 0, so decoding them stays in
+      // bounds.
+      symbols.assign(contexts << 8, symbol());
+      slots.assign(scale, 0);
+      for (int context = 0; context < contexts; context++) {
+        slot_base[context] = 0;
+        if (!(present[context / 8] & (1 << (context % 8)))) {
+          continue;
+        }
+        symbol *sym = &symbols[context << 8];
+        int used = byte() + 1, value = 0;
+        uint8_t bytes[256];
+        for (int i = 0; i < used; i++) {
+          value += byte();
+          if (value > 255 || (i > 0 && bytes[i - 1] == value)) {
+            throw std::runtime_error("Invalid coded literal.");
+          }
+          bytes[i] = value;
+        }
+        uint32_t sum = 0;
+        for (int i = 0; i < used; i++) {
+          uint64_t freq = get_varint(p, end);
+          if (freq == 0 || freq > scale) {
+            throw std::runtime_error("Invalid coded literal.");
+          }
+          sym[bytes[i]].freq = freq;
+          sum += freq;
+        }
+        if (sum != scale) {
+          throw std::runtime_error("Invalid coded literal.");
+        }
+        assign_starts(context);
+        slot_base[context] = slots.size();
+        slots.resize(slots.size() + scale);
+        for (int i = 0; i < used; i++) {
+          const symbol& s = sym[bytes[i]];
+          std::fill(slots.begin() + slot_base[context] + s.start,
+                    slots.begin() + slot_base[context] + s.start + s.freq, bytes[i]);
+        }
+      }
+    }
+
+    void assign_starts(int context) {
+      uint32_t start = 0;
+      for (int byte = 0; byte < 256; byte++) {
+        symbol& s = symbols[context << 8 | byte];
+        s.start = start;
+        start += s.freq;
+      }
+    }
+
+    int order;
+    std::vector<uint32_t> counts;
+    // By context << 8 | byte.
+    std::vector<symbol> symbols;
+    // For decoding: the byte of each slot, scale per context from
+    // slot_base[context].
+    std::vector<uint8_t> slots;
+    uint32_t slot_base[256];
+  };
+};
@@ -0,0 +1,240 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+
+#include <unistd.h>
+
+#include "batch.h"
+#include "recode.h"
+#include "serve.h"
+
+using avrecode::compressor_options;
+using avrecode::decompressor_options;
+
+
+// Counts the bytes written to it and compares them with an original in
+// memory, so the decompressed file needn't be kept.
+class compare_buf : public std::streambuf {
+ public:
+  compare_buf(const uint8_t *original, size_t size) : original(original), size(size) {}
+
+  bool matches() const {
+    return mismatch == std::string::npos && written == size;
+  }
+  // Offset of the first differing byte, or npos.
+  size_t first_mismatch() const {
+    return mismatch != std::string::npos ? mismatch : written != size ? std::min(written, size) : mismatch;
+  }
+
+ protected:
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    if (mismatch == std::string::npos) {
+      size_t common = written < size ? std::min<size_t>(n, size - written) : 0;
+      if (memcmp(original + written, s, common) != 0) {
+        mismatch = written;
+        while (original[mismatch] == uint8_t(s[mismatch - written])) mismatch++;
+      } else if (common < size_t(n)) {
+        mismatch = written + common;
+      }
+    }
+    written += n;
+    return n;
+  }
+  int overflow(int c) override {
+    if (c != traits_type::eof()) {
+      char ch = c;
+      xsputn(&ch, 1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+ private:
+  const uint8_t *original;
+  size_t size;
+  size_t written = 0;
+  size_t mismatch = std::string::npos;
+};
+
+
+// Compresses to the output file, or a temporary file that is removed, then
+// decompresses the mapped compressed file against the mapped original.
+// Decompressing and comparing take memory independent of the input's size;
+// compressing still holds every recoded block until the video is decoded.
+int roundtrip(const std::string& input_filename, const std::string& output_filename,
+    const compressor_options& opts = compressor_options(),
+    const decompressor_options& decompress_opts = decompressor_options()) {
+  mapped_file original(input_filename);
+  std::string compressed_filename = output_filename;
+  if (compressed_filename.empty()) {
+    const char *tmpdir = getenv("TMPDIR");
+    compressed_filename = std::string(tmpdir ? tmpdir : "/tmp") + "/avrecode-XXXXXX";
+    int fd = mkstemp(&compressed_filename[0]);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to create a temporary file: " + std::string(strerror(errno)));
+    }
+    close(fd);
+  }
+  avrecode::compress_stats stats;
+  bool matches = false;
+  size_t first_mismatch = 0;
+  try {
+    {
+      std::ofstream compressed_out(compressed_filename, std::ios::binary | std::ios::trunc);
+      avrecode::compress(original.bytes, original.size, compressed_out, opts, &stats);
+      if (!compressed_out.flush()) {
+        throw std::runtime_error("Failed to write " + compressed_filename);
+      }
+    }
+    mapped_file compressed(compressed_filename);
+    compare_buf compare(original.bytes, original.size);
+    std::ostream decompressed(&compare);
+    avrecode::decompress(compressed.bytes, compressed.size, decompressed, decompress_opts);
+    matches = compare.matches();
+    first_mismatch = compare.first_mismatch();
+  } catch (...) {
+    unlink(compressed_filename.c_str());
+    throw;
+  }
+  if (!matches || output_filename.empty()) {
+    unlink(compressed_filename.c_str());
+  }
+
+  if (matches) {
+    double ratio = stats.compressed_bytes * 1.0 / original.size;
+    double proto_overhead = (stats.compressed_bytes - stats.payload_bytes) * 1.0 / stats.compressed_bytes;
+
+    std::cout << "Compress-decompress roundtrip succeeded:" << std::endl;
+    std::cout << " compression ratio: " << ratio*100. << "%" << std::endl;
+    std::cout << " protobuf overhead: " << proto_overhead*100. << "%" << std::endl;
+    return 0;
+  } else {
+    std::cerr << "Compress-decompress roundtrip failed at byte " << first_mismatch << "." << std::endl;
+    return 1;
+  }
+}
+
+
+int
+main(int argc, char **argv) {
+  compressor_options opts;
+  decompressor_options decompress_opts;
+  int workers = std::thread::hardware_concurrency();
+  size_t max_memory_mb = 4096;
+  std::string journal;
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 10, "--workers=") == 0) {
+      workers = std::atoi(arg.c_str() + 10);
+    } else if (arg.compare(0, 13, "--max-memory=") == 0) {
+      max_memory_mb = std::atoll(arg.c_str() + 13);
+    } else if (arg.compare(0, 16, "--slice-threads=") == 0) {
+      opts.slice_threads = std::max(1, std::atoi(arg.c_str() + 16));
+    } else if (arg.compare(0, 22, "--checkpoint-interval=") == 0) {
+      opts.checkpoint_interval = size_t(std::atoll(arg.c_str() + 22)) << 20;
+    } else if (arg.compare(0, 8, "--range=") == 0) {
+      // start:end, in bytes of the original; either may be left out.
+      const char *range = arg.c_str() + 8;
+      const char *colon = strchr(range, ':');
+      if (!colon) {
+        std::cerr << "Invalid range: " << range << std::endl;
+        return 1;
+      }
+      decompress_opts.range_start = strtoull(range, nullptr, 10);
+      if (colon[1]) {
+        decompress_opts.range_end = strtoull(colon + 1, nullptr, 10);
+      }
+    } else if (arg.compare(0, 10, "--journal=") == 0) {
+      journal = arg.substr(10);
+    } else if (arg.compare(0, 16, "--coder-streams=") == 0) {
+      opts.coder_streams = std::atoi(arg.c_str() + 16);
+    } else if (arg == "--pipeline") {
+      opts.pipeline = true;
+      decompress_opts.pipeline = true;
+    } else if (arg == "--parallel-streams") {
+      opts.parallel_streams = true;
+      decompress_opts.parallel_streams = true;
+    } else if (arg == "--verify") {
+      opts.verify = true;
+    } else if (arg == "--raw-bypass") {
+      opts.raw_bypass = true;
+    } else if (arg == "--raw-literals") {
+      opts.code_literals = false;
+    } else if (arg == "--raw-mp4-index") {
+      opts.code_mp4_index = false;
+    } else {
+      args.push_back(arg);
+    }
+  }
+
+  bool client = (!args.empty() && args[0] == "client");
+  if (args.size() < 2 || (args.size() > 3 && !client) || (client && args.size() < 3)) {
+    std::cerr << "Usage: " << argv[0] << " [--coder-streams=1|2|4] [--pipeline] [--parallel-streams] [--slice-threads=N]"
+              << " [--verify] [--checkpoint-interval=MB] [--range=start:end] [--journal=FILE]"
+              << " [--raw-bypass] [--raw-literals] [--raw-mp4-index]"
+              << " [compress|decompress|verify|roundtrip|estimate] <input> [output]" << std::endl;
+    std::cerr << "       roundtrip compares without keeping the decompressed file, but compressing holds"
+              << " the recoded blocks in memory." << std::endl;
+    std::cerr << "       --range decompresses from the nearest checkpoint, which only files compressed"
+              << " with --checkpoint-interval have." << std::endl;
+    std::cerr << "       " << argv[0] << " [--workers=N] [options] serve <socket>" << std::endl;
+    std::cerr << "       " << argv[0] << " [--workers=N] [--max-memory=MB] [options] batch <manifest> [summary]"
+              << std::endl;
+    std::cerr << "       " << argv[0] << " client <socket> compress|decompress|verify|stats [<input> <output>]"
+              << std::endl;
+    return 1;
+  }
+  std::string command = args[0];
+  std::string input_filename = args[1];
+  std::string output_filename = args.size() > 2 && !client ? args[2] : "";
+  std::ofstream out_file;
+  if (!output_filename.empty() && command != "roundtrip") {
+    out_file.open(output_filename);
+  }
+  std::ostream& out = out_file.is_open() ? out_file : std::cout;
+
+  try {
+    if (command == "compress") {
+      mapped_file input(input_filename);
+      // One file's progress, so only for compress.
+      opts.journal = journal;
+      avrecode::compress(input.bytes, input.size, out, opts);
+    } else if (command == "decompress") {
+      mapped_file input(input_filename);
+      avrecode::decompress(input.bytes, input.size, out, decompress_opts);
+    } else if (command == "verify") {
+      mapped_file input(input_filename);
+      return avrecode::verify(input.bytes, input.size, out, decompress_opts) ? 0 : 1;
+    } else if (command == "roundtrip") {
+      return roundtrip(input_filename, output_filename, opts, decompress_opts);
+    } else if (command == "estimate") {
+      mapped_file input(input_filename);
+      avrecode::estimate(input.bytes, input.size, out, opts);
+    } else if (command == "batch") {
+      batch_compressor batch(workers, max_memory_mb << 20, opts);
+      batch.read_manifest(input_filename);
+      return batch.run(out) == 0 ? 0 : 1;
+    } else if (command == "serve") {
+      recode_server server(input_filename, workers, opts);
+      server.run();
+    } else if (command == "client") {
+      return run_client(input_filename, std::vector<std::string>(args.begin() + 2, args.end()));
+    } else {
+      throw std::invalid_argument("Unknown command: " + command);
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "Exception (" << typeid(e).name() << "): " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,480 @@
+//
+// Compact, exactly reversible representation of an MP4 moov box.
+//
+// Most of a large moov is the sample tables: sample sizes (stsz), chunk
+// offsets (stco/co64) and composition time offsets (ctts). The decompressor
+// has to feed libavformat the moov before any packet, so everything here is
+// predicted from the moov itself:
+//  - sample sizes are stored as varints;
+//  - chunk sizes follow from stsz and stsc, so chunk offsets of all tracks
+//    are merged in file order and stored as the track index plus the
+//    difference from the end of the previous chunk, which is usually zero;
+//  - composition offsets are stored as varint counts and offset deltas.
+// Every other box is kept verbatim in a skeleton that also keeps the table
+// headers, so the original bytes can be regenerated.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "literal_code.h"
+
+
+class mp4_index {
+ public:
+  // Transforms a moov box to *out. Returns false if the box has a layout
+  // this doesn't handle, in which case it should be stored as a literal.
+  static bool encode(const uint8_t *moov, size_t size, std::string *out) {
+    std::string transformed;
+    try {
+      mp4_index index;
+      index.parse(moov, size);
+      transformed = index.serialize();
+      // Anything unexpected in the tables (e.g. chunk offsets out of order
+      // within a track) shows up as a mismatch here.
+      if (decode_transformed(transformed) != std::string(reinterpret_cast<const char*>(moov), size)) {
+        return false;
+      }
+    } catch (const std::runtime_error&) {
+      return false;
+    }
+
+    std::string coded;
+    out->clear();
+    if (literal_code::encode(reinterpret_cast<const uint8_t*>(transformed.data()),
+                             transformed.size(), &coded)) {
+      out->push_back(1);
+      put_varint(out, transformed.size());
+      out->append(coded);
+    } else {
+      out->push_back(0);
+      out->append(transformed);
+    }
+    return out->size() < size;
+  }
+
+  // Regenerates the original moov box.
+  static std::string decode(const std::string& in) {
+    if (in.empty()) {
+      throw std::runtime_error("Empty mp4 index.");
+    }
+    if (in[0] == 0) {
+      return decode_transformed(in.substr(1));
+    }
+    reader r(in);
+    r.get_bytes(1);
+    size_t transformed_size = r.get_varint();
+    return decode_transformed(literal_code::decode(in.substr(r.position()), transformed_size));
+  }
+
+ private:
+  static constexpr uint32_t box_type(const char (&name)[5]) {
+    return uint32_t(uint8_t(name[0])) << 24 | uint32_t(uint8_t(name[1])) << 16 |
+           uint32_t(uint8_t(name[2])) << 8 | uint32_t(uint8_t(name[3]));
+  }
+  static bool is_container(uint32_t type) {
+    return type == box_type("moov") || type == box_type("trak") || type == box_type("mdia") ||
+           type == box_type("minf") || type == box_type("stbl");
+  }
+
+  static void put_varint(std::string *out, uint64_t n) {
+    for (; n >= 0x80; n >>= 7) {
+      out->push_back(char((n & 0x7F) | 0x80));
+    }
+    out->push_back(char(n));
+  }
+  static uint64_t zigzag(int64_t n) { return (uint64_t(n) << 1) ^ uint64_t(n >> 63); }
+  static int64_t unzigzag(uint64_t n) { return int64_t(n >> 1) ^ -int64_t(n & 1); }
+  static void put_be(std::string *out, uint64_t n, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+      out->push_back(char(n >> (8 * i)));
+    }
+  }
+
+  class reader {
+   public:
+    explicit reader(const std::string& s)
+      : p(reinterpret_cast<const uint8_t*>(s.data())), begin(p), end(p + s.size()) {}
+    reader(const uint8_t *p, size_t size) : p(p), begin(p), end(p + size) {}
+
+    const uint8_t* get_bytes(size_t n) {
+      if (n > size_t(end - p)) {
+        throw std::runtime_error("Truncated mp4 index.");
+      }
+      const uint8_t *bytes = p;
+      p += n;
+      return bytes;
+    }
+    uint64_t get_be(int bytes) {
+      const uint8_t *b = get_bytes(bytes);
+      uint64_t n = 0;
+      for (int i = 0; i < bytes; i++) {
+        n = (n << 8) | b[i];
+      }
+      return n;
+    }
+    uint64_t get_varint() {
+      uint64_t n = 0;
+      for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = *get_bytes(1);
+        n |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+          return n;
+        }
+      }
+      throw std::runtime_error("Invalid varint in mp4 index.");
+    }
+    size_t position() const { return p - begin; }
+    bool done() const { return p == end; }
+
+   private:
+    const uint8_t *p, *begin, *end;
+  };
+
+  struct track {
+    uint32_t constant_sample_size = 0;
+    std::vector<uint32_t> sample_sizes;
+    // (first_chunk, samples_per_chunk) from stsc.
+    std::vector<std::pair<uint32_t, uint32_t>> sample_to_chunk;
+    std::vector<uint64_t> chunk_offsets;
+    bool has_sizes = false, has_sample_to_chunk = false, has_offsets = false;
+
+    std::vector<uint64_t> chunk_sizes() const {
+      if (!has_sizes || !has_sample_to_chunk) {
+        throw std::runtime_error("Chunk offsets without sample tables.");
+      }
+      std::vector<uint64_t> sizes(chunk_offsets.size());
+      size_t sample = 0, entry = 0;
+      for (size_t chunk = 0; chunk < sizes.size(); chunk++) {
+        while (entry + 1 < sample_to_chunk.size() && sample_to_chunk[entry + 1].first <= chunk + 1) {
+          entry++;
+        }
+        uint32_t samples = sample_to_chunk.empty() ? 0 : sample_to_chunk[entry].second;
+        if (constant_sample_size) {
+          sizes[chunk] = uint64_t(constant_sample_size) * samples;
+        } else {
+          if (samples > sample_sizes.size() - sample) {
+            throw std::runtime_error("Chunk refers to missing samples.");
+          }
+          for (uint32_t i = 0; i < samples; i++) {
+            sizes[chunk] += sample_sizes[sample++];
+          }
+        }
+      }
+      return sizes;
+    }
+  };
+
+  // Encoder: splits the moov into the skeleton and the table streams.
+  void parse(const uint8_t *box, size_t size) {
+    reader r(box, size);
+    parse_boxes(&r, size);
+  }
+
+  void parse_boxes(reader *r, uint64_t remaining) {
+    while (remaining > 0) {
+      const uint8_t *header = r->get_bytes(8);
+      uint64_t size = uint64_t(header[0]) << 24 | header[1] << 16 | header[2] << 8 | header[3];
+      uint32_t type = uint32_t(header[4]) << 24 | header[5] << 16 | header[6] << 8 | header[7];
+      if (size < 8 || size > remaining) {
+        // Includes 64-bit and to-end-of-file sizes, which don't occur in moov.
+        throw std::runtime_error("Unsupported box size.");
+      }
+      remaining -= size;
+      skeleton.append(reinterpret_cast<const char*>(header), 8);
+      uint64_t body = size - 8;
+
+      if (is_container(type)) {
+        if (type == box_type("trak")) {
+          tracks.emplace_back();
+        }
+        parse_boxes(r, body);
+      } else if (type == box_type("stsz") && !tracks.empty()) {
+        track& t = tracks.back();
+        append_skeleton(r, 4);  // version, flags
+        t.constant_sample_size = r->get_be(4);
+        uint32_t count = r->get_be(4);
+        put_be(&skeleton, t.constant_sample_size, 4);
+        put_be(&skeleton, count, 4);
+        if (body != 12 + (t.constant_sample_size ? 0 : uint64_t(count) * 4)) {
+          throw std::runtime_error("Unexpected stsz size.");
+        }
+        if (!t.constant_sample_size) {
+          for (uint32_t i = 0; i < count; i++) {
+            t.sample_sizes.push_back(r->get_be(4));
+            put_varint(&sizes, t.sample_sizes.back());
+          }
+        }
+        t.has_sizes = true;
+      } else if ((type == box_type("stco") || type == box_type("co64")) && !tracks.empty()) {
+        track& t = tracks.back();
+        int entry_bytes = (type == box_type("stco")) ? 4 : 8;
+        append_skeleton(r, 4);
+        uint32_t count = r->get_be(4);
+        put_be(&skeleton, count, 4);
+        if (body != 8 + uint64_t(count) * entry_bytes || t.has_offsets) {
+          throw std::runtime_error("Unexpected chunk offset box.");
+        }
+        for (uint32_t i = 0; i < count; i++) {
+          t.chunk_offsets.push_back(r->get_be(entry_bytes));
+        }
+        t.has_offsets = true;
+      } else if (type == box_type("stsc") && !tracks.empty()) {
+        // Kept verbatim; parsed for the chunk sizes.
+        const uint8_t *data = r->get_bytes(body);
+        skeleton.append(reinterpret_cast<const char*>(data), body);
+        tracks.back().sample_to_chunk = parse_sample_to_chunk(data, body);
+        tracks.back().has_sample_to_chunk = true;
+      } else if (type == box_type("ctts")) {
+        append_skeleton(r, 4);
+        uint32_t count = r->get_be(4);
+        put_be(&skeleton, count, 4);
+        if (body != 8 + uint64_t(count) * 8) {
+          throw std::runtime_error("Unexpected ctts size.");
+        }
+        uint32_t prev_offset = 0;
+        for (uint32_t i = 0; i < count; i++) {
+          put_varint(&composition_offsets, r->get_be(4));
+          uint32_t offset = r->get_be(4);
+          put_varint(&composition_offsets, zigzag(int32_t(offset - prev_offset)));
+          prev_offset = offset;
+        }
+      } else {
+        append_skeleton(r, body);
+      }
+    }
+  }
+
+  void append_skeleton(reader *r, uint64_t n) {
+    skeleton.append(reinterpret_cast<const char*>(r->get_bytes(n)), n);
+  }
+
+  static std::vector<std::pair<uint32_t, uint32_t>> parse_sample_to_chunk(const uint8_t *data, size_t size) {
+    reader r(data, size);
+    r.get_bytes(4);
+    uint32_t count = r.get_be(4);
+    if (size != 8 + uint64_t(count) * 12) {
+      throw std::runtime_error("Unexpected stsc size.");
+    }
+    std::vector<std::pair<uint32_t, uint32_t>> entries;
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t first_chunk = r.get_be(4);
+      uint32_t samples_per_chunk = r.get_be(4);
+      r.get_bytes(4);  // sample_description_index
+      entries.emplace_back(first_chunk, samples_per_chunk);
+    }
+    return entries;
+  }
+
+  // (offset, track, chunk) of every chunk, in file order.
+  static std::vector<std::tuple<uint64_t, uint32_t, uint32_t>> chunks_in_file_order(
+      const std::vector<track>& tracks) {
+    std::vector<std::tuple<uint64_t, uint32_t, uint32_t>> chunks;
+    for (uint32_t t = 0; t < tracks.size(); t++) {
+      for (uint32_t c = 0; c < tracks[t].chunk_offsets.size(); c++) {
+        chunks.emplace_back(tracks[t].chunk_offsets[c], t, c);
+      }
+    }
+    std::sort(chunks.begin(), chunks.end());
+    return chunks;
+  }
+
+  std::string serialize() {
+    std::vector<std::vector<uint64_t>> chunk_sizes;
+    for (const auto& t : tracks) {
+      chunk_sizes.push_back(t.has_offsets ? t.chunk_sizes() : std::vector<uint64_t>());
+    }
+    std::string offsets;
+    uint64_t predicted = 0;
+    for (const auto& chunk : chunks_in_file_order(tracks)) {
+      uint64_t offset;
+      uint32_t t, c;
+      std::tie(offset, t, c) = chunk;
+      put_varint(&offsets, t);
+      put_varint(&offsets, zigzag(int64_t(offset - predicted)));
+      predicted = offset + chunk_sizes[t][c];
+    }
+
+    std::string out;
+    for (const std::string *section : {&skeleton, &sizes, &composition_offsets}) {
+      put_varint(&out, section->size());
+    }
+    for (const std::string *section : {&skeleton, &sizes, &composition_offsets, &offsets}) {
+      out.append(*section);
+    }
+    return out;
+  }
+
+  // Decoder: the skeleton is walked twice. The first pass recovers the
+  // sample tables of every track, which determine the chunk sizes needed to
+  // place the chunk offsets. The second pass writes the moov.
+  class rebuilder {
+   public:
+    rebuilder(const std::string& skeleton, const std::string& sizes,
+              const std::string& composition_offsets, const std::string& offsets)
+      : skeleton(skeleton), sizes(sizes), composition_offsets(composition_offsets),
+        offsets(offsets) {}
+
+    std::string run() {
+      walk(false);
+      place_chunk_offsets();
+      return walk(true);
+    }
+
+   private:
+    std::string walk(bool write) {
+      reader skeleton_reader(skeleton), sizes_reader(sizes), composition_reader(composition_offsets);
+      std::string out;
+      int track_index = -1;
+      walk_boxes(write, &skeleton_reader, &sizes_reader, &composition_reader, &track_index, &out,
+                 std::numeric_limits<uint64_t>::max());
+      if (!skeleton_reader.done() || !sizes_reader.done() || !composition_reader.done()) {
+        throw std::runtime_error("Trailing data in mp4 index.");
+      }
+      return out;
+    }
+
+    void walk_boxes(bool write, reader *r, reader *sizes_reader, reader *composition_reader,
+                    int *track_index, std::string *out, uint64_t remaining) {
+      bool top_level = (remaining == std::numeric_limits<uint64_t>::max());
+      while (top_level ? !r->done() : remaining > 0) {
+        const uint8_t *header = r->get_bytes(8);
+        uint64_t size = uint64_t(header[0]) << 24 | header[1] << 16 | header[2] << 8 | header[3];
+        uint32_t type = uint32_t(header[4]) << 24 | header[5] << 16 | header[6] << 8 | header[7];
+        if (size < 8 || (!top_level && size > remaining)) {
+          throw std::runtime_error("Invalid box size in mp4 index.");
+        }
+        if (!top_level) {
+          remaining -= size;
+        }
+        out->append(reinterpret_cast<const char*>(header), 8);
+        uint64_t body = size - 8;
+        size_t body_start = out->size();
+
+        if (is_container(type)) {
+          if (type == box_type("trak")) {
+            ++*track_index;
+            if (!write) {
+              tracks.emplace_back();
+            }
+          }
+          walk_boxes(write, r, sizes_reader, composition_reader, track_index, out, body);
+        } else if (type == box_type("stsz") && *track_index >= 0) {
+          track& t = tracks[*track_index];
+          copy(r, 4, out);
+          uint32_t sample_size = r->get_be(4);
+          uint32_t count = r->get_be(4);
+          put_be(out, sample_size, 4);
+          put_be(out, count, 4);
+          if (!write) {
+            t.constant_sample_size = sample_size;
+            t.has_sizes = true;
+          }
+          if (!sample_size) {
+            for (uint32_t i = 0; i < count; i++) {
+              uint64_t n = sizes_reader->get_varint();
+              put_be(out, n, 4);
+              if (!write) {
+                t.sample_sizes.push_back(n);
+              }
+            }
+          }
+        } else if ((type == box_type("stco") || type == box_type("co64")) && *track_index >= 0) {
+          track& t = tracks[*track_index];
+          copy(r, 4, out);
+          uint32_t count = r->get_be(4);
+          put_be(out, count, 4);
+          if (!write) {
+            // Placeholders until place_chunk_offsets.
+            t.chunk_offsets.assign(count, 0);
+            t.has_offsets = true;
+          }
+          for (uint64_t offset : t.chunk_offsets) {
+            put_be(out, offset, type == box_type("stco") ? 4 : 8);
+          }
+        } else if (type == box_type("stsc") && *track_index >= 0) {
+          const uint8_t *data = r->get_bytes(body);
+          out->append(reinterpret_cast<const char*>(data), body);
+          if (!write) {
+            tracks[*track_index].sample_to_chunk = parse_sample_to_chunk(data, body);
+            tracks[*track_index].has_sample_to_chunk = true;
+          }
+        } else if (type == box_type("ctts")) {
+          copy(r, 4, out);
+          uint32_t count = r->get_be(4);
+          put_be(out, count, 4);
+          uint32_t offset = 0;
+          for (uint32_t i = 0; i < count; i++) {
+            put_be(out, composition_reader->get_varint(), 4);
+            offset += uint32_t(unzigzag(composition_reader->get_varint()));
+            put_be(out, offset, 4);
+          }
+        } else {
+          copy(r, body, out);
+        }
+        if (out->size() - body_start != body) {
+          throw std::runtime_error("Box size mismatch in mp4 index.");
+        }
+      }
+    }
+
+    void place_chunk_offsets() {
+      std::vector<std::vector<uint64_t>> chunk_sizes;
+      for (const auto& t : tracks) {
+        chunk_sizes.push_back(t.has_offsets ? t.chunk_sizes() : std::vector<uint64_t>());
+      }
+      std::vector<uint32_t> next_chunk(tracks.size());
+      size_t num_chunks = 0;
+      for (const auto& t : tracks) {
+        num_chunks += t.chunk_offsets.size();
+      }
+      reader r(offsets);
+      uint64_t predicted = 0;
+      for (size_t i = 0; i < num_chunks; i++) {
+        uint64_t t = r.get_varint();
+        if (t >= tracks.size() || next_chunk[t] >= tracks[t].chunk_offsets.size()) {
+          throw std::runtime_error("Invalid chunk in mp4 index.");
+        }
+        uint32_t c = next_chunk[t]++;
+        uint64_t offset = predicted + unzigzag(r.get_varint());
+        tracks[t].chunk_offsets[c] = offset;
+        predicted = offset + chunk_sizes[t][c];
+      }
+      if (!r.done()) {
+        throw std::runtime_error("Trailing chunk offsets in mp4 index.");
+      }
+    }
+
+    static void copy(reader *r, uint64_t n, std::string *out) {
+      out->append(reinterpret_cast<const char*>(r->get_bytes(n)), n);
+    }
+
+    const std::string &skeleton, &sizes, &composition_offsets, &offsets;
+    std::vector<track> tracks;
+  };
+
+  static std::string decode_transformed(const std::string& in) {
+    reader r(in);
+    uint64_t section_sizes[3];
+    for (auto& size : section_sizes) {
+      size = r.get_varint();
+    }
+    std::string sections[4];
+    for (int i = 0; i < 3; i++) {
+      sections[i].assign(reinterpret_cast<const char*>(r.get_bytes(section_sizes[i])), section_sizes[i]);
+    }
+    sections[3] = in.substr(r.position());
+    return rebuilder(sections[0], sections[1], sections[2], sections[3]).run();
+  }
+
+  std::string skeleton, sizes, composition_offsets;
+  std::vector<track> tracks;
+};
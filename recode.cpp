@@ -1,13 +1,28 @@
 /* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
-#include <typeinfo>
+#include <thread>
+#include <tuple>
 #include <vector>
 
+#include <unistd.h>
+
 extern "C" {
 #include "libavcodec/avcodec.h"
 #include "libavcodec/cabac.h"
@@ -15,22 +30,23 @@ extern "C" {
 #include "libavformat/avformat.h"
 #include "libavformat/avio.h"
 #include "libavutil/error.h"
-#include "libavutil/file.h"
 }
 
 #include "arithmetic_code.h"
 #include "cabac_code.h"
+#include "crc32c.h"
+#include "literal_code.h"
+#include "mp4_index.h"
 #include "recode.pb.h"
-#include "framebuffer.h"
+#include "h264_model.h"
+#include "recode.h"
+#include "spsc_ring.h"
+
+namespace avrecode {
+namespace {
 
 // CABAC blocks smaller than this will be skipped.
 const int SURROGATE_MARKER_BYTES = 8;
-//#define DO_NEIGHBOR_LOGGING
-#ifdef DO_NEIGHBOR_LOGGING
-#define LOG_NEIGHBORS printf
-#else
-#define LOG_NEIGHBORS(...)
-#endif
 template <typename T>
 std::unique_ptr<T, std::function<void(T*&)>> av_unique_ptr(T* p, const std::function<void(T*&)>& deleter) {
   if (p == nullptr) {
@@ -70,11 +86,168 @@ bool av_check(int return_value, const std::string& message = "") {
 }
 
 
+// Applies H.264 emulation prevention to an unescaped payload: a 0x03 byte is
+// inserted wherever two zero bytes are followed by a byte <= 3. The positions
+// of the inserted bytes in the escaped output are appended to *escapes as
+// varint deltas.
+std::string nal_escape(const uint8_t *buf, int size, std::string *escapes) {
+  std::string escaped;
+  escaped.reserve(size + size / 64);
+  size_t prev_escape = 0;
+  int zeros = 0;
+  for (int i = 0; i < size; i++) {
+    if (zeros >= 2 && buf[i] <= 3) {
+      size_t delta = escaped.size() - prev_escape;
+      prev_escape = escaped.size();
+      for (; delta >= 0x80; delta >>= 7) {
+        escapes->push_back(char((delta & 0x7F) | 0x80));
+      }
+      escapes->push_back(char(delta));
+      escaped.push_back('\x03');
+      zeros = 0;
+    }
+    escaped.push_back(char(buf[i]));
+    zeros = (buf[i] == 0) ? zeros + 1 : 0;
+  }
+  return escaped;
+}
+
+// Re-inserts the emulation prevention bytes recorded by nal_escape.
+std::string nal_apply_escapes(const std::string& unescaped, const std::string& escapes) {
+  std::string escaped;
+  escaped.reserve(unescaped.size() + escapes.size());
+  size_t escape_pos = 0, read_pos = 0;
+  for (size_t i = 0; i < escapes.size(); ) {
+    size_t delta = 0;
+    for (int shift = 0; ; shift += 7) {
+      if (i >= escapes.size() || shift > 63) {
+        throw std::runtime_error("Truncated NAL escape positions.");
+      }
+      uint8_t byte = escapes[i++];
+      delta |= size_t(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) break;
+    }
+    escape_pos += delta;
+    size_t n = escape_pos - escaped.size();
+    if (escape_pos < escaped.size() || n > unescaped.size() - read_pos) {
+      throw std::runtime_error("Invalid NAL escape position.");
+    }
+    escaped.append(unescaped, read_pos, n);
+    read_pos += n;
+    escaped.push_back('\x03');
+  }
+  escaped.append(unescaped, read_pos, std::string::npos);
+  return escaped;
+}
+
+
+// Finds H.264 picture parameter sets in extradata and packets without
+// decoding, to tell whether a stream is CABAC coded.
+class h264_pps_scanner {
+ public:
+  // Reads an avcC decoder configuration record, or Annex B NAL units.
+  void scan_extradata(const uint8_t *data, int size) {
+    if (size < 7 || data[0] != 1) {
+      scan_annex_b(data, size);
+      return;
+    }
+    nal_length_size = (data[4] & 3) + 1;
+    const uint8_t *p = data + 6, *end = data + size;
+    for (int n = data[5] & 0x1F; n > 0 && end - p >= 2; n--) {  // SPS
+      p += 2 + (p[0] << 8 | p[1]);
+    }
+    if (p >= end) return;
+    for (int n = *p++; n > 0 && end - p >= 2; n--) {  // PPS
+      int length = p[0] << 8 | p[1];
+      p += 2;
+      if (end - p < length) return;
+      scan_nal(p, length);
+      p += length;
+    }
+  }
+
+  // Reads the NAL units of a packet, in the framing set by the extradata.
+  void scan_packet(const uint8_t *data, int size) {
+    if (nal_length_size == 0) {
+      scan_annex_b(data, size);
+      return;
+    }
+    const uint8_t *p = data, *end = data + size;
+    while (end - p >= nal_length_size) {
+      size_t length = 0;
+      for (int i = 0; i < nal_length_size; i++) {
+        length = length << 8 | *p++;
+      }
+      if (size_t(end - p) < length) return;
+      scan_nal(p, length);
+      p += length;
+    }
+  }
+
+  bool found_pps() const { return pps_count > 0; }
+  bool cabac() const { return cabac_pps_count > 0; }
+
+ private:
+  void scan_annex_b(const uint8_t *data, int size) {
+    const uint8_t *nal = nullptr;
+    for (int i = 0; i + 2 < size; i++) {
+      if (data[i] == 0 && data[i+1] == 0 && data[i+2] == 1) {
+        if (nal) scan_nal(nal, &data[i] - nal);
+        nal = &data[i + 3];
+        i += 2;
+      }
+    }
+    if (nal) scan_nal(nal, data + size - nal);
+  }
+
+  // Parses pic_parameter_set_id, seq_parameter_set_id and
+  // entropy_coding_mode_flag from the start of a PPS NAL unit.
+  void scan_nal(const uint8_t *nal, size_t size) {
+    if (size < 2 || (nal[0] & 0x1F) != 8) return;
+    std::vector<uint8_t> rbsp;
+    int zeros = 0;
+    for (size_t i = 1; i < size && rbsp.size() < 16; i++) {
+      if (zeros >= 2 && nal[i] == 3) {
+        zeros = 0;
+        continue;
+      }
+      rbsp.push_back(nal[i]);
+      zeros = (nal[i] == 0) ? zeros + 1 : 0;
+    }
+    size_t bit = 0;
+    auto read_bit = [&]() {
+      int b = (rbsp[bit / 8] >> (7 - bit % 8)) & 1;
+      bit++;
+      return b;
+    };
+    for (int ue = 0; ue < 2; ue++) {
+      int leading_zeros = 0;
+      while (bit < rbsp.size() * 8 && !read_bit()) {
+        if (++leading_zeros > 31) return;
+      }
+      bit += leading_zeros;
+    }
+    if (bit >= rbsp.size() * 8) return;
+    pps_count++;
+    cabac_pps_count += read_bit();
+  }
+
+  int nal_length_size = 0;  // 0 for Annex B start codes.
+  int pps_count = 0;
+  int cabac_pps_count = 0;
+};
+
+
+std::once_flag av_register_once;
+
 // Sets up a libavcodec decoder with I/O and decoding hooks.
 template <typename Driver>
 class av_decoder {
  public:
-  av_decoder(Driver *driver, const std::string& input_filename) : driver(driver) {
+  // A seekable decoder can use decode_video_samples; the driver then has to
+  // support seek().
+  av_decoder(Driver *driver, bool seekable = false) : driver(driver) {
+    std::call_once(av_register_once, av_register_all);
     const size_t avio_ctx_buffer_size = 1024*1024;
     uint8_t *avio_ctx_buffer = static_cast<uint8_t*>( av_malloc(avio_ctx_buffer_size) );
 
@@ -87,10 +260,10 @@ class av_decoder {
         this,                                 // first argument for read_packet()
         read_packet,                          // read callback
         nullptr,                              // write_packet()
-        nullptr);                             // seek()
+        seekable ? seek : nullptr);           // seek()
 
-    if (avformat_open_input(&format_ctx, input_filename.c_str(), nullptr, nullptr) < 0) {
-      throw std::invalid_argument("Failed to initialize decoding context: " + input_filename);
+    if (avformat_open_input(&format_ctx, "", nullptr, nullptr) < 0) {
+      throw std::invalid_argument("Failed to initialize decoding context");
     }
   }
   ~av_decoder() {
@@ -110,40 +283,323 @@ class av_decoder {
     av_dump_format(format_ctx, 0, format_ctx->filename, 0);
   }
 
-  // Decode all video frames in the file in single-threaded mode, calling the driver's hooks.
-  void decode_video() {
+  // The number of video streams in the container.
+  int video_streams() const {
+    int count = 0;
+    for (size_t i = 0; i < format_ctx->nb_streams; i++) {
+      count += format_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO;
+    }
+    return count;
+  }
+
+  // Decides from the container headers and the first video packets, without
+  // decoding, whether any video stream can be recoded, i.e. is H.264 with a
+  // CABAC picture parameter set. H.264 whose parameter sets aren't found is
+  // assumed recodable. Consumes packets, so decode with a fresh av_decoder.
+  bool probe_recodable(int max_video_packets = 32) {
+    std::map<int, h264_pps_scanner> h264_streams;
+    for (size_t i = 0; i < format_ctx->nb_streams; i++) {
+      AVCodecContext *codec = format_ctx->streams[i]->codec;
+      if (codec->codec_type == AVMEDIA_TYPE_VIDEO && codec->codec_id == AV_CODEC_ID_H264) {
+        h264_pps_scanner& scanner = h264_streams[i];
+        scanner.scan_extradata(codec->extradata, codec->extradata_size);
+        if (scanner.cabac()) return true;
+      }
+    }
+    AVPacket packet;
+    for (int n = 0; n < max_video_packets && !h264_streams.empty(); ) {
+      if (av_check( av_read_frame(format_ctx, &packet), AVERROR_EOF, "Failed to read frame" )) {
+        break;
+      }
+      auto scanner = h264_streams.find(packet.stream_index);
+      if (scanner != h264_streams.end()) {
+        scanner->second.scan_packet(packet.data, packet.size);
+        n++;
+      }
+      av_packet_unref(&packet);
+      if (scanner != h264_streams.end() && scanner->second.cabac()) return true;
+    }
+    for (const auto& stream : h264_streams) {
+      if (!stream.second.found_pps()) return true;
+    }
+    return false;
+  }
+
+  // Decode all video frames in the file, calling the driver's hooks, until
+  // the driver's finished(). Each decoder uses the driver's slice_threads();
+  // with parallel_streams, each video stream is decoded on a thread of its
+  // own while this thread demuxes. Returns the number of video packets
+  // decoded.
+  size_t decode_video(bool parallel_streams = false) {
     auto frame = av_unique_ptr(av_frame_alloc(), av_frame_free);
+    std::map<int, std::unique_ptr<stream_thread>> threads;
     AVPacket packet;
+    size_t video_packets = 0;
     // TODO(ctl) add better diagnostics to error results.
-    while (!av_check( av_read_frame(format_ctx, &packet), AVERROR_EOF, "Failed to read frame" )) {
-      AVCodecContext *codec = format_ctx->streams[packet.stream_index]->codec;
-      if (codec->codec_type == AVMEDIA_TYPE_VIDEO) {
-        if (!avcodec_is_open(codec)) {
-          codec->thread_count = 1;
-          codec->hooks = &hooks;
-          av_check( avcodec_open2(codec, avcodec_find_decoder(codec->codec_id), nullptr),
-            "Failed to open decoder for stream " + std::to_string(packet.stream_index) );
+    while (!driver->finished() &&
+           !av_check( av_read_frame(format_ctx, &packet), AVERROR_EOF, "Failed to read frame" )) {
+      if (packet.pos >= 0 && packet.pos < first_packet_pos) {
+        // Before the packet seek_to_packet found.
+        av_packet_unref(&packet);
+        continue;
+      }
+      if (!parallel_streams) {
+        if (decode_packet(packet, frame.get())) {
+          video_packets++;
         }
-
-        int got_frame = 0;
-        av_check( avcodec_decode_video2(codec, frame.get(), &got_frame, &packet),
-            "Failed to decode video frame" );
+      } else if (open_decoder(packet.stream_index)) {
+        std::unique_ptr<stream_thread>& thread = threads[packet.stream_index];
+        if (!thread) {
+          thread.reset(new stream_thread(this));
+        }
+        thread->push(&packet);
+        video_packets++;
       }
       av_packet_unref(&packet);
     }
+    for (auto& thread : threads) {
+      thread.second->join();
+    }
+    return video_packets;
+  }
+
+  // Seeks to a keyframe packet of a video stream, given its dts and position
+  // in the file; decode_video then skips any packets before it. Returns
+  // false if the container can't seek.
+  bool seek_to_packet(int stream_index, int64_t dts, int64_t pos) {
+    if (av_seek_frame(format_ctx, stream_index, dts, AVSEEK_FLAG_BACKWARD) < 0) {
+      return false;
+    }
+    first_packet_pos = pos;
+    return true;
+  }
+
+  // Decodes one GOP at each of num_samples points spread over the duration of
+  // a video stream, or its first num_samples GOPs if the duration is unknown.
+  // Packets of other streams are skipped. on_sample(pos) is called with the
+  // file position of each GOP sought to, before it is decoded. Returns the
+  // bytes of video packets decoded.
+  template <typename OnSample>
+  size_t decode_video_samples(int video_stream, int num_samples, const OnSample& on_sample) {
+    auto frame = av_unique_ptr(av_frame_alloc(), av_frame_free);
+    AVStream *stream = format_ctx->streams[video_stream];
+    AVPacket packet;
+    auto read_video_packet = [&]() {
+      while (!av_check( av_read_frame(format_ctx, &packet), AVERROR_EOF, "Failed to read frame" )) {
+        if (packet.stream_index == video_stream) return true;
+        av_packet_unref(&packet);
+      }
+      return false;
+    };
+    size_t video_bytes = 0;
+
+    if (stream->duration <= 0 || stream->duration == AV_NOPTS_VALUE) {
+      for (int keyframes = 0; read_video_packet(); av_packet_unref(&packet)) {
+        if ((packet.flags & AV_PKT_FLAG_KEY) && ++keyframes > num_samples) {
+          av_packet_unref(&packet);
+          break;
+        }
+        decode_packet(packet, frame.get());
+        video_bytes += packet.size;
+      }
+      return video_bytes;
+    }
+
+    int64_t start_time = stream->start_time == AV_NOPTS_VALUE ? 0 : stream->start_time;
+    int64_t prev_keyframe_pts = AV_NOPTS_VALUE;
+    for (int i = 0; i < num_samples; i++) {
+      av_check( av_seek_frame(format_ctx, video_stream,
+                              start_time + int64_t(double(stream->duration) * i / num_samples),
+                              AVSEEK_FLAG_BACKWARD),
+          "Failed to seek in stream " + std::to_string(video_stream) );
+      if (avcodec_is_open(stream->codec)) {
+        avcodec_flush_buffers(stream->codec);
+      }
+      bool found_keyframe = false;
+      while (read_video_packet()) {
+        if (packet.flags & AV_PKT_FLAG_KEY) {
+          found_keyframe = true;
+          break;
+        }
+        av_packet_unref(&packet);
+      }
+      if (!found_keyframe) break;
+      if (packet.pts == prev_keyframe_pts) {
+        // Long GOPs: this one was already sampled.
+        av_packet_unref(&packet);
+        continue;
+      }
+      prev_keyframe_pts = packet.pts;
+      if (packet.pos >= 0) {
+        on_sample(packet.pos);
+      }
+      // Decode up to the next keyframe.
+      while (true) {
+        decode_packet(packet, frame.get());
+        video_bytes += packet.size;
+        av_packet_unref(&packet);
+        if (!read_video_packet()) break;
+        if (packet.flags & AV_PKT_FLAG_KEY) {
+          av_packet_unref(&packet);
+          break;
+        }
+      }
+    }
+    return video_bytes;
+  }
+
+  // Returns the index of the first H.264 video stream, or -1.
+  int h264_stream() const {
+    for (size_t i = 0; i < format_ctx->nb_streams; i++) {
+      AVCodecContext *codec = format_ctx->streams[i]->codec;
+      if (codec->codec_type == AVMEDIA_TYPE_VIDEO && codec->codec_id == AV_CODEC_ID_H264) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  // Total packet bytes of a stream according to the container index, or -1
+  // if the container has no index.
+  int64_t stream_bytes(int stream_index) const {
+    AVStream *stream = format_ctx->streams[stream_index];
+    if (stream->nb_index_entries == 0) return -1;
+    int64_t bytes = 0;
+    for (int i = 0; i < stream->nb_index_entries; i++) {
+      bytes += stream->index_entries[i].size;
+    }
+    return bytes;
   }
 
  private:
+  // Opens the decoder of a video stream, with hooks for the stream, if it
+  // isn't open yet. Returns false if the stream isn't video.
+  bool open_decoder(int stream_index) {
+    AVCodecContext *codec = format_ctx->streams[stream_index]->codec;
+    if (codec->codec_type != AVMEDIA_TYPE_VIDEO) {
+      return false;
+    }
+    if (!avcodec_is_open(codec)) {
+      std::unique_ptr<stream_hooks>& stream = streams[stream_index];
+      if (!stream) {
+        stream.reset(new stream_hooks(this, driver->stream(stream_index)));
+      }
+      // With slice threads the driver puts the hook calls of a picture's
+      // slices back in bitstream order after each packet.
+      int threads = driver->slice_threads();
+      codec->thread_count = threads;
+      codec->thread_type = threads > 1 ? FF_THREAD_SLICE : 0;
+      codec->hooks = &stream->hooks;
+      av_check( avcodec_open2(codec, avcodec_find_decoder(codec->codec_id), nullptr),
+        "Failed to open decoder for stream " + std::to_string(stream_index) );
+    }
+    return true;
+  }
+
+  // Decodes the packet if it belongs to a video stream; returns whether it did.
+  bool decode_packet(AVPacket& packet, AVFrame *frame) {
+    if (!open_decoder(packet.stream_index)) {
+      return false;
+    }
+    AVCodecContext *codec = format_ctx->streams[packet.stream_index]->codec;
+    auto *stream = static_cast<stream_hooks*>(codec->hooks->opaque)->driver_stream;
+    stream->begin_packet(packet);
+    int got_frame = 0;
+    av_check( avcodec_decode_video2(codec, frame, &got_frame, &packet),
+        "Failed to decode video frame" );
+    stream->packet_decoded();
+    return true;
+  }
+
+  // Decodes the packets of one video stream, in order, on its own thread.
+  class stream_thread {
+   public:
+    explicit stream_thread(av_decoder *d) : d(d), thread([this]() { run(); }) {}
+    ~stream_thread() {
+      if (thread.joinable()) {
+        close();
+        thread.join();
+      }
+      for (AVPacket& packet : packets) {
+        av_packet_unref(&packet);
+      }
+    }
+
+    // Takes the packet's reference. Waits while the thread is far behind.
+    void push(AVPacket *packet) {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&]() { return packets.size() < max_queued_packets; });
+      packets.emplace_back();
+      av_packet_move_ref(&packets.back(), packet);
+      changed.notify_all();
+    }
+
+    // Waits for the queued packets to be decoded, and rethrows a decoding error.
+    void join() {
+      close();
+      thread.join();
+      if (error) std::rethrow_exception(error);
+    }
+
+   private:
+    static constexpr size_t max_queued_packets = 64;
+
+    void close() {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+      changed.notify_all();
+    }
+
+    void run() {
+      auto frame = av_unique_ptr(av_frame_alloc(), av_frame_free);
+      while (true) {
+        AVPacket packet;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          changed.wait(lock, [&]() { return closed || !packets.empty(); });
+          if (packets.empty()) return;
+          av_packet_move_ref(&packet, &packets.front());
+          packets.pop_front();
+          changed.notify_all();
+        }
+        // After an error the rest of the stream is only drained.
+        if (!error) {
+          try {
+            d->decode_packet(packet, frame.get());
+          } catch (...) {
+            error = std::current_exception();
+          }
+        }
+        av_packet_unref(&packet);
+      }
+    }
+
+    av_decoder *d;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<AVPacket> packets;
+    bool closed = false;
+    std::exception_ptr error;
+    std::thread thread;
+  };
+
   // Hook stubs - wrap driver into opaque pointers.
   static int read_packet(void *opaque, uint8_t *buffer_out, int size) {
     av_decoder *self = static_cast<av_decoder*>(opaque);
     return self->driver->read_packet(buffer_out, size);
   }
+  static int64_t seek(void *opaque, int64_t offset, int whence) {
+    av_decoder *self = static_cast<av_decoder*>(opaque);
+    return self->driver->seek(offset, whence);
+  }
   struct cabac {
     static void* init_decoder(void *opaque, CABACContext *ctx, const uint8_t *buf, int size) {
-      av_decoder *self = static_cast<av_decoder*>(opaque);
-      auto *cabac_decoder = new typename Driver::cabac_decoder(self->driver, ctx, buf, size);
-      self->cabac_contexts[ctx].reset(cabac_decoder);
+      auto *stream = static_cast<stream_hooks*>(opaque);
+      auto *cabac_decoder = new typename Driver::cabac_decoder(
+          stream->self->driver, stream->driver_stream, ctx, buf, size);
+      std::lock_guard<std::mutex> lock(stream->cabac_contexts_mutex);
+      stream->cabac_contexts[ctx].reset(cabac_decoder);
+      current_decoder = cabac_decoder;
       return cabac_decoder;
     }
     static int get(void *opaque, uint8_t *state) {
@@ -164,898 +620,127 @@ class av_decoder {
   };
   struct model_hooks {
     static void frame_spec(void *opaque, int frame_num, int mb_width, int mb_height) {
-      auto *self = static_cast<av_decoder*>(opaque)->driver->get_model();
-      self->update_frame_spec(frame_num, mb_width, mb_height);
+      static_cast<stream_hooks*>(opaque)->driver_stream->frame_spec(frame_num, mb_width, mb_height);
     }
     static void mb_xy(void *opaque, int x, int y) {
-      auto *self = static_cast<av_decoder*>(opaque)->driver->get_model();
-      self->mb_coord.mb_x = x;
-      self->mb_coord.mb_y = y;
+      static_cast<stream_hooks*>(opaque)->driver_stream->mb_xy(x, y);
     }
     static void begin_sub_mb(void *opaque, int cat, int scan8index, int max_coeff, int is_dc, int chroma422) {
-      auto *self = static_cast<av_decoder*>(opaque)->driver->get_model();
-      self->sub_mb_cat = cat;
-      self->mb_coord.scan8_index = scan8index;
-      self->sub_mb_size = max_coeff;
-      self->sub_mb_is_dc = is_dc;
-      self->sub_mb_chroma422 = chroma422;
+      static_cast<stream_hooks*>(opaque)->driver_stream->begin_sub_mb(cat, scan8index, max_coeff, is_dc, chroma422);
     }
     static void end_sub_mb(void *opaque, int cat, int scan8index, int max_coeff, int is_dc, int chroma422) {
-      auto *self = static_cast<av_decoder*>(opaque)->driver->get_model();
-      assert(self->sub_mb_cat == cat);
-      assert(self->mb_coord.scan8_index == scan8index);
-      assert(self->sub_mb_size == max_coeff);
-      assert(self->sub_mb_is_dc == is_dc);
-      assert(self->sub_mb_chroma422 == chroma422);
-      self->sub_mb_cat = -1;
-      self->mb_coord.scan8_index = -1;
-      self->sub_mb_size = -1;
-      self->sub_mb_is_dc = 0;
-      self->sub_mb_chroma422 = 0;
+      static_cast<stream_hooks*>(opaque)->driver_stream->end_sub_mb(cat, scan8index, max_coeff, is_dc, chroma422);
     }
+    // Coding types belong to the slice being parsed on this thread.
     static void begin_coding_type(void *opaque, CodingType ct,
                                     int zigzag_index, int param0, int param1) {
-      auto &cabac_contexts = static_cast<av_decoder*>(opaque)->cabac_contexts;
-      assert(cabac_contexts.size() == 1);
-      typename Driver::cabac_decoder*self = cabac_contexts.begin()->second.get();
+      typename Driver::cabac_decoder *self = current_decoder;
+      assert(self != nullptr);
       self->begin_coding_type(ct, zigzag_index, param0, param1);
     }
     static void end_coding_type(void *opaque, CodingType ct) {
-      auto &cabac_contexts = static_cast<av_decoder*>(opaque)->cabac_contexts;
-      assert(cabac_contexts.size() == 1);
-      typename Driver::cabac_decoder*self = cabac_contexts.begin()->second.get();
+      typename Driver::cabac_decoder *self = current_decoder;
+      assert(self != nullptr);
       self->end_coding_type(ct);
     }
   };
-  Driver *driver;
-  AVFormatContext *format_ctx;
-  AVCodecHooks hooks = { this, {
-      cabac::init_decoder,
-      cabac::get,
-      cabac::get_bypass,
-      cabac::get_terminate,
-      cabac::skip_bytes,
-    },
-    {
-      model_hooks::frame_spec,
-      model_hooks::mb_xy,
-      model_hooks::begin_sub_mb,
-      model_hooks::end_sub_mb,
-      model_hooks::begin_coding_type,
-      model_hooks::end_coding_type,
-
-    },
-  };
-  std::map<CABACContext*, std::unique_ptr<typename Driver::cabac_decoder>> cabac_contexts;
-};
-
-
-struct r_scan8 {
-    uint16_t scan8_index;
-    bool neighbor_left;
-    bool neighbor_up;
-    bool is_invalid() const {
-        return scan8_index == 0 && neighbor_left && neighbor_up;
-    }
-    static constexpr r_scan8 inv() {
-        return {0, true, true};
-    }
-};
-/* Scan8 organization:
- *    0 1 2 3 4 5 6 7
- * 0  DY    y y y y y
- * 1        y Y Y Y Y
- * 2        y Y Y Y Y
- * 3        y Y Y Y Y
- * 4  du    y Y Y Y Y
- * 5  DU    u u u u u
- * 6        u U U U U
- * 7        u U U U U
- * 8        u U U U U
- * 9  dv    u U U U U
- * 10 DV    v v v v v
- * 11       v V V V V
- * 12       v V V V V
- * 13       v V V V V
- * 14       v V V V V
- * DY/DU/DV are for luma/chroma DC.
- */
-constexpr uint8_t scan_8[16 * 3 + 3] = {
-    4 +  1 * 8, 5 +  1 * 8, 4 +  2 * 8, 5 +  2 * 8,
-    6 +  1 * 8, 7 +  1 * 8, 6 +  2 * 8, 7 +  2 * 8,
-    4 +  3 * 8, 5 +  3 * 8, 4 +  4 * 8, 5 +  4 * 8,
-    6 +  3 * 8, 7 +  3 * 8, 6 +  4 * 8, 7 +  4 * 8,
-    4 +  6 * 8, 5 +  6 * 8, 4 +  7 * 8, 5 +  7 * 8,
-    6 +  6 * 8, 7 +  6 * 8, 6 +  7 * 8, 7 +  7 * 8,
-    4 +  8 * 8, 5 +  8 * 8, 4 +  9 * 8, 5 +  9 * 8,
-    6 +  8 * 8, 7 +  8 * 8, 6 +  9 * 8, 7 +  9 * 8,
-    4 + 11 * 8, 5 + 11 * 8, 4 + 12 * 8, 5 + 12 * 8,
-    6 + 11 * 8, 7 + 11 * 8, 6 + 12 * 8, 7 + 12 * 8,
-    4 + 13 * 8, 5 + 13 * 8, 4 + 14 * 8, 5 + 14 * 8,
-    6 + 13 * 8, 7 + 13 * 8, 6 + 14 * 8, 7 + 14 * 8,
-    0 +  0 * 8, 0 +  5 * 8, 0 + 10 * 8
-};
-
-constexpr r_scan8 reverse_scan_8[15][8] = {
-    //Y
-    {{16 * 3, false, false}, r_scan8::inv(), r_scan8::inv(), {15, true, true},
-     {10, false, true}, {11, false, true}, {14, false, true}, {15, false, true}},
-    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {5, true, false},
-     {0, false, false}, {1, false, false}, {4, false, false}, {5, false, false}},
-    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {7, true, false},
-     {2, false, false}, {3, false, false}, {6, false, false}, {7, false, false}},
-    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {13, true, false},
-     {8, false, false}, {9, false, false}, {12, false, false}, {13, false, false}},
-    {{16 * 3 + 1,false, true}, r_scan8::inv(), r_scan8::inv(), {15, true, false},
-     {10, false, false}, {11, false, false}, {14, false, false}, {15, false, false}},
-    // U
-    {{16 * 3 + 1,false, false}, r_scan8::inv(), r_scan8::inv(), {16 + 15, true, true},
-     {16 + 10, false, true}, {16 + 11, false, true}, {16 + 14, false, true}, {16 + 15, false, true}},
-    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {16 + 5, true, false},
-     {16 + 0, false, false}, {16 + 1, false, false}, {16 + 4, false, false}, {16 + 5, false, false}},
-    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {16 + 7, true, false},
-     {16 + 2, false, false}, {16 + 3, false, false}, {16 + 6, false, false}, {16 + 7, false, false}},
-    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {16 + 13, true, false},
-     {16 + 8, false, false}, {16 + 9, false, false}, {16 + 12, false, false}, {16 + 13, false, false}},
-    {{16 * 3 + 2,false, true}, r_scan8::inv(), r_scan8::inv(), {16 + 15, true, false},
-     {16 + 10, false, false}, {16 + 11, false, false}, {16 + 14, false, false}, {16 + 15, false, false}},
-    // V
-    {{16 * 3 + 2,false, false}, r_scan8::inv(), r_scan8::inv(), {32 + 15, true, true},
-     {32 + 10, false, true}, {32 + 11, false, true}, {32 + 14, false, true}, {32 + 15, false, true}},
-    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {32 + 5, true, false},
-     {32 + 0, false, false}, {32 + 1, false, false}, {32 + 4, false, false}, {32 + 5, false, false}},
-    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {32 + 7, true, false},
-     {32 + 2, false, false}, {32 + 3, false, false}, {32 + 6, false, false}, {32 + 7, false, false}},
-    {r_scan8::inv(), r_scan8::inv(), r_scan8::inv(), {32 + 13, true, false},
-     {32 + 8, false, false}, {32 + 9, false, false}, {32 + 12, false, false}, {32 + 13, false, false}},
-    {{32 + 16 * 3 + 1,false, true}, r_scan8::inv(), r_scan8::inv(), {32 + 15, true, false},
-     {32 + 10, false, false}, {32 + 11, false, false}, {32 + 14, false, false}, {32 + 15, false, false}}};
-
-// Encoder / decoder for recoded CABAC blocks.
-typedef uint64_t range_t;
-typedef arithmetic_code<range_t, uint8_t> recoded_code;
-
-typedef std::tuple<const void*, int, int> model_key;
-/*
-not sure these tables are the ones we want to use
-constexpr uint8_t unzigzag16[16] = {
-    0 + 0 * 4, 0 + 1 * 4, 1 + 0 * 4, 0 + 2 * 4,
-    0 + 3 * 4, 1 + 1 * 4, 1 + 2 * 4, 1 + 3 * 4,
-    2 + 0 * 4, 2 + 1 * 4, 2 + 2 * 4, 2 + 3 * 4,
-    3 + 0 * 4, 3 + 1 * 4, 3 + 2 * 4, 3 + 3 * 4,
-};
-constexpr uint8_t zigzag16[16] = {
-    0, 2, 8, 12,
-    1, 5, 9, 13,
-    3, 6, 10, 14,
-    4, 7, 11, 15
-};
-
-constexpr uint8_t zigzag_field64[64] = {
-    0 + 0 * 8, 0 + 1 * 8, 0 + 2 * 8, 1 + 0 * 8,
-    1 + 1 * 8, 0 + 3 * 8, 0 + 4 * 8, 1 + 2 * 8,
-    2 + 0 * 8, 1 + 3 * 8, 0 + 5 * 8, 0 + 6 * 8,
-    0 + 7 * 8, 1 + 4 * 8, 2 + 1 * 8, 3 + 0 * 8,
-    2 + 2 * 8, 1 + 5 * 8, 1 + 6 * 8, 1 + 7 * 8,
-    2 + 3 * 8, 3 + 1 * 8, 4 + 0 * 8, 3 + 2 * 8,
-    2 + 4 * 8, 2 + 5 * 8, 2 + 6 * 8, 2 + 7 * 8,
-    3 + 3 * 8, 4 + 1 * 8, 5 + 0 * 8, 4 + 2 * 8,
-    3 + 4 * 8, 3 + 5 * 8, 3 + 6 * 8, 3 + 7 * 8,
-    4 + 3 * 8, 5 + 1 * 8, 6 + 0 * 8, 5 + 2 * 8,
-    4 + 4 * 8, 4 + 5 * 8, 4 + 6 * 8, 4 + 7 * 8,
-    5 + 3 * 8, 6 + 1 * 8, 6 + 2 * 8, 5 + 4 * 8,
-    5 + 5 * 8, 5 + 6 * 8, 5 + 7 * 8, 6 + 3 * 8,
-    7 + 0 * 8, 7 + 1 * 8, 6 + 4 * 8, 6 + 5 * 8,
-    6 + 6 * 8, 6 + 7 * 8, 7 + 2 * 8, 7 + 3 * 8,
-    7 + 4 * 8, 7 + 5 * 8, 7 + 6 * 8, 7 + 7 * 8,
-};
 
-*/
-constexpr uint8_t zigzag4[4] = {
-    0, 1, 2, 3
-};
-constexpr uint8_t unzigzag4[4] = {
-    0, 1, 2, 3
-};
+  // The hooks of one video stream, whose opaque pointer identifies the
+  // stream, and its CABAC decoders.
+  struct stream_hooks {
+    stream_hooks(av_decoder *self, typename Driver::stream_state *driver_stream)
+      : self(self), driver_stream(driver_stream) {}
+
+    av_decoder *self;
+    typename Driver::stream_state *driver_stream;
+    AVCodecHooks hooks = { this, {
+        cabac::init_decoder,
+        cabac::get,
+        cabac::get_bypass,
+        cabac::get_terminate,
+        cabac::skip_bytes,
+      },
+      {
+        model_hooks::frame_spec,
+        model_hooks::mb_xy,
+        model_hooks::begin_sub_mb,
+        model_hooks::end_sub_mb,
+        model_hooks::begin_coding_type,
+        model_hooks::end_coding_type,
+
+      },
+    };
+    // Slice threads each have a CABACContext of their own.
+    std::mutex cabac_contexts_mutex;
+    std::map<CABACContext*, std::unique_ptr<typename Driver::cabac_decoder>> cabac_contexts;
+  };
 
-constexpr uint8_t unzigzag16[16] = {
-    0, 1, 4, 8,
-    5, 2, 3, 6,
-    9, 12, 13, 10,
-    7, 11, 14, 15
-};
-constexpr uint8_t zigzag16[16] = {
-    0, 1, 5, 6,
-    2, 4, 7, 12,
-    3, 8, 11, 13,
-    9, 10, 14, 15
-};
-constexpr uint8_t unzigzag64[64] = {
-    0,   1,  8, 16,  9,  2,  3, 10,
-    17, 24, 32, 25, 18, 11,  4,  5,
-    12, 19, 26, 33, 40, 48, 41, 34,
-    27, 20, 13,  6,  7, 14, 21, 28,
-    35, 42, 49, 56, 57, 50, 43, 36,
-    29, 22, 15, 23, 30, 37, 44, 51,
-    58, 59, 52, 45, 38, 31, 39, 46,
-    53, 60, 61, 54, 47, 55, 62, 63
-};
+  // The decoder of the slice being parsed on this thread. A thread parses
+  // one slice at a time, and with slice threads the slices of a stream are
+  // spread over the codec's threads.
+  static thread_local typename Driver::cabac_decoder *current_decoder;
 
-constexpr uint8_t zigzag64[64] = {
-    0, 1, 5, 6, 14, 15, 27, 28,
-    2, 4, 7, 13, 16, 26, 29, 42,
-    3, 8, 12, 17, 25, 30, 41, 43,
-    9, 11, 18, 24, 31, 40, 44, 53,
-    10, 19, 23, 32, 39, 45, 52, 54,
-    20, 22, 33, 38, 46, 51, 55, 60,
-    21, 34, 37, 47, 50, 56, 59, 61,
-    35, 36, 48, 49, 57, 58, 62, 63
+  Driver *driver;
+  AVFormatContext *format_ctx;
+  std::map<int, std::unique_ptr<stream_hooks>> streams;
+  // Set by seek_to_packet.
+  int64_t first_packet_pos = -1;
 };
 
+template <typename Driver>
+thread_local typename Driver::cabac_decoder *av_decoder<Driver>::current_decoder = nullptr;
 
-int test_reverse_scan8() {
-    for (size_t i = 0; i < sizeof(scan_8)/ sizeof(scan_8[0]); ++i) {
-        auto a = reverse_scan_8[scan_8[i] >> 3][scan_8[i] & 7];
-        assert(a.neighbor_left == false && a.neighbor_up == false);
-        assert(a.scan8_index == i);
-        if (a.scan8_index != i) {
-            return 1;
-        }
-    }
-    for (int i = 0;i < 16; ++i) {
-        assert(zigzag16[unzigzag16[i]] == i);
-        assert(unzigzag16[zigzag16[i]] == i);
-    }
-    return 0;
-}
-int make_sure_reverse_scan8 = test_reverse_scan8();
-struct CoefficientCoord {
-    int mb_x;
-    int mb_y;
-    int scan8_index;
-    int zigzag_index;
-};
-
-bool get_neighbor_sub_mb(bool above, int sub_mb_size,
-                  CoefficientCoord input,
-                  CoefficientCoord *output) {
-    int mb_x = input.mb_x;
-    int mb_y = input.mb_y;
-    int scan8_index = input.scan8_index;
-    output->scan8_index = scan8_index;
-    output->mb_x = mb_x;
-    output->mb_y = mb_y;
-    output->zigzag_index = input.zigzag_index;
-    if (scan8_index >= 16 * 3) {
-        if (above) {
-            if (mb_y > 0) {
-                output->mb_y -= 1;
-                return true;
-            }
-            return false;
-        } else {
-            if (mb_x > 0) {
-                output->mb_x -= 1;
-                return true;
-            }
-            return false;
-        }
-    }
-    int scan8 = scan_8[scan8_index];
-    int left_shift = (above ? 0 : -1);
-    int above_shift = (above ? -1 : 0);
-    auto neighbor = reverse_scan_8[(scan8 >> 3) + above_shift][(scan8 & 7) + left_shift];
-    if (neighbor.neighbor_left) {
-        if (mb_x == 0){
-            return false;
-        } else {
-            --mb_x;
-        }
-    }
-    if (neighbor.neighbor_up) {
-        if (mb_y == 0) {
-            return false;
-        } else {
-            --mb_y;
-        }
-    }
-    output->scan8_index = neighbor.scan8_index;
-    if (sub_mb_size >= 32) {
-        output->scan8_index /= 4;
-        output->scan8_index *= 4; // round down to the nearest multiple of 4
-    }
-    output->zigzag_index = input.zigzag_index;
-    output->mb_x = mb_x;
-    output->mb_y = mb_y;
-    return true;
-}
-int log2(int y) {
-    int x = -1;
-    while (y) {
-        y/=2;
-        x++;
-    }
-    return x;
-}
-bool get_neighbor(bool above, int sub_mb_size,
-                  CoefficientCoord input,
-                  CoefficientCoord *output) {
-    int mb_x = input.mb_x;
-    int mb_y = input.mb_y;
-    int scan8_index = input.scan8_index;
-    int zigzag_index = input.zigzag_index;
-    int dimension = 2;
-    if (sub_mb_size > 15) {
-        dimension = 4;
-    }
-    if (sub_mb_size > 32) {
-        dimension = 8;
-    }
-    if (scan8_index >= 16 * 3) {
-        // we are DC...
-        int linear_index = unzigzag4[zigzag_index];
-        if (sub_mb_size == 16) {
-            linear_index = unzigzag16[zigzag_index];
-        } else {
-            assert(sub_mb_size <= 4);
-        }
-        if ((above && linear_index >= dimension) // if is inner
-            || ((linear_index & (dimension - 1)) && !above)) {
-            if (above) {
-                linear_index -= dimension;
-            } else {
-                -- linear_index;
-            }
-            if (sub_mb_size == 16) {
-                output->zigzag_index = zigzag16[linear_index];
-            } else {
-                output->zigzag_index = zigzag4[linear_index];
-            }
-            output->mb_x = mb_x;
-            output->mb_y = mb_y;
-            output->scan8_index = scan8_index;
-            return true;
-        }
-        if (above) {
-            if (mb_y == 0) {
-                return false;
-            }
-            linear_index += dimension * (dimension - 1);//go to bottom
-            --mb_y;
-        } else {
-            if (mb_x == 0) {
-                return false;
-            }
-            linear_index += dimension - 1;//go to end of row
-            --mb_x;
-        }
-        if (sub_mb_size == 16) {
-            output->zigzag_index = zigzag16[linear_index];
-        } else {
-            output->zigzag_index = linear_index;
-        }
-        output->mb_x = mb_x;
-        output->mb_y = mb_y;
-        output->scan8_index = scan8_index;
-        return true;
-    }
-    int scan8 = scan_8[scan8_index];
-    int left_shift = (above ? 0 : -1);
-    int above_shift = (above ? -1 : 0);
-    auto neighbor = reverse_scan_8[(scan8 >> 3) + above_shift][(scan8 & 7) + left_shift];
-    if (neighbor.neighbor_left) {
-        if (mb_x == 0){
-            return false;
-        } else {
-            --mb_x;
-        }
-    }
-    if (neighbor.neighbor_up) {
-        if (mb_y == 0) {
-            return false;
-        } else {
-            --mb_y;
-        }
-    }
-    output->scan8_index = neighbor.scan8_index;
-    if (sub_mb_size >= 32) {
-        output->scan8_index /= 4;
-        output->scan8_index *= 4; // round down to the nearest multiple of 4
-    }
-    output->zigzag_index = zigzag_index;
-    output->mb_x = mb_x;
-    output->mb_y = mb_y;
-    return true;
-}
+typedef arithmetic_code<range_t, uint8_t> recoded_code;
+typedef interleaved_code<recoded_code> interleaved_recoded_code;
 
-bool get_neighbor_coefficient(bool above,
-                              int sub_mb_size,
-                              CoefficientCoord input,
-                              CoefficientCoord *output) {
-    if (input.scan8_index >= 16 * 3) {
-        return get_neighbor(above, sub_mb_size, input, output);
-    }
-    int zigzag_addition = 0;
-
-    if ((sub_mb_size & (sub_mb_size - 1)) != 0) {
-        zigzag_addition = 1;// the DC is not included
-    }
-    const uint8_t *zigzag_to_raster = unzigzag16;
-    const uint8_t *raster_to_zigzag = zigzag16;
-    int dim = 4;
-    if (sub_mb_size <= 4) {
-        dim = 2;
-        zigzag_to_raster = zigzag4;
-        raster_to_zigzag = unzigzag4;
-    }
-    if (sub_mb_size > 16) {
-        dim = 16;
-        zigzag_to_raster = zigzag64;
-        raster_to_zigzag = unzigzag64;
-    }
-    int raster_coord = zigzag_to_raster[input.zigzag_index + zigzag_addition];
-    //fprintf(stderr, "%d %d   %d -> %d\n", sub_mb_size, zigzag_addition, input.zigzag_index, raster_coord);
-    if (above) {
-        if (raster_coord >= dim) {
-            raster_coord -= dim;
-        } else {
-            return false;
-        }
-    } else {
-        if (raster_coord & (dim - 1)) {
-            raster_coord -= 1;
-        } else {
-            return false;
-        }
-    }
-    *output = input;
-    output->zigzag_index = raster_to_zigzag[raster_coord] - zigzag_addition;
-    return true;
-}
-#define STRINGIFY_COMMA(s) #s ,
-const char * billing_names [] = {EACH_PIP_CODING_TYPE(STRINGIFY_COMMA)};
-#undef STRINGIFY_COMMA
-class h264_model {
-  public:
-  CodingType coding_type = PIP_UNKNOWN;
-  size_t bill[sizeof(billing_names)/sizeof(billing_names[0])];
-  size_t cabac_bill[sizeof(billing_names)/sizeof(billing_names[0])];
-  FrameBuffer frames[2];
-  int cur_frame = 0;
-  uint8_t STATE_FOR_NUM_NONZERO_BIT[6];
-  bool do_print;
+// Bypass bins are close to incompressible, so they can be stored as plain
+// bits instead of going through the model and the arithmetic coder.
+class raw_bit_writer {
  public:
-  h264_model() { reset(); do_print = false; memset(bill, 0, sizeof(bill)); memset(cabac_bill, 0, sizeof(cabac_bill));}
-  void enable_debug() {
-    do_print = true;
-  }
-  void disable_debug() {
-    do_print = false;
-  }
-  ~h264_model() {
-      bool first = true;
-      for (size_t i = 0; i < sizeof(billing_names)/sizeof(billing_names[i]); ++i) {
-          if (bill[i]) {
-              if (first) {
-                  fprintf(stderr, "Avrecode Bill\n=============\n");
-              }
-              first = false;
-              fprintf(stderr, "%s : %ld\n", billing_names[i], bill[i]);
-          }
-      }
-      for (size_t i = 0; i < sizeof(billing_names)/sizeof(billing_names[i]); ++i) {
-          if (cabac_bill[i]) {
-              if (first) {
-                  fprintf(stderr, "CABAC Bill\n=============\n");
-              }
-              first = false;
-              fprintf(stderr, "%s : %ld\n", billing_names[i], cabac_bill[i]);
-          }
-      }
-  }
-  void billable_bytes(size_t num_bytes_emitted) {
-      bill[coding_type] += num_bytes_emitted;
-  }
-  void billable_cabac_bytes(size_t num_bytes_emitted) {
-      cabac_bill[coding_type] += num_bytes_emitted;
-  }
-  void reset() {
-      // reset should do nothing as we wish to remember what we've learned
-    memset(STATE_FOR_NUM_NONZERO_BIT, 0, sizeof(STATE_FOR_NUM_NONZERO_BIT));
-  }
-  bool fetch(bool previous, bool match_type, CoefficientCoord coord, int16_t*output) const{
-      if (match_type && (previous || coord.mb_x != mb_coord.mb_x || coord.mb_y != mb_coord.mb_y)) {
-          BlockMeta meta = frames[previous ? !cur_frame : cur_frame].meta_at(coord.mb_x, coord.mb_y);
-          if (!meta.coded) { // when we populate mb_type in the metadata, then we can use it here
-              return false;
-          }
-      }
-      *output = frames[previous ? !cur_frame : cur_frame].at(coord.mb_x, coord.mb_y).residual[coord.scan8_index * 16 + coord.zigzag_index];
-      return true;
-  }
-  model_key get_model_key(const void *context)const {
-      switch(coding_type) {
-        case PIP_SIGNIFICANCE_NZ:
-          return model_key(context, 0, 0);
-        case PIP_UNKNOWN:
-        case PIP_UNREACHABLE:
-        case PIP_RESIDUALS:
-          return model_key(context, 0, 0);
-        case PIP_SIGNIFICANCE_MAP:
-          {
-              static const uint8_t sig_coeff_flag_offset_8x8[2][63] = {
-                  { 0, 1, 2, 3, 4, 5, 5, 4, 4, 3, 3, 4, 4, 4, 5, 5,
-                    4, 4, 4, 4, 3, 3, 6, 7, 7, 7, 8, 9,10, 9, 8, 7,
-                    7, 6,11,12,13,11, 6, 7, 8, 9,14,10, 9, 8, 6,11,
-                    12,13,11, 6, 9,14,10, 9,11,12,13,11,14,10,12 },
-                  { 0, 1, 1, 2, 2, 3, 3, 4, 5, 6, 7, 7, 7, 8, 4, 5,
-                    6, 9,10,10, 8,11,12,11, 9, 9,10,10, 8,11,12,11,
-                    9, 9,10,10, 8,11,12,11, 9, 9,10,10, 8,13,13, 9,
-                    9,10,10, 8,13,13, 9, 9,10,10,14,14,14,14,14 }
-              };
-              int cat_lookup[14] = { 105+0, 105+15, 105+29, 105+44, 105+47, 402, 484+0, 484+15, 484+29, 660, 528+0, 528+15, 528+29, 718 };
-              static const uint8_t sig_coeff_offset_dc[7] = { 0, 0, 1, 1, 2, 2, 2 };
-              int zigzag_offset = mb_coord.zigzag_index;
-              if (sub_mb_is_dc && sub_mb_chroma422) {
-                  assert(mb_coord.zigzag_index < 7);
-                  zigzag_offset = sig_coeff_offset_dc[mb_coord.zigzag_index];
-              } else {
-                  if (sub_mb_size > 32) {                      assert(mb_coord.zigzag_index < 63);
-                      zigzag_offset = sig_coeff_flag_offset_8x8[0][mb_coord.zigzag_index];
-                  }
-              }
-              assert(sub_mb_cat < (int)(sizeof(cat_lookup)/sizeof(cat_lookup[0])));
-              int neighbor_above = 2;
-              int neighbor_left = 2;
-              int coeff_neighbor_above = 2;
-              int coeff_neighbor_left = 2;
-              if (do_print) {
-                  LOG_NEIGHBORS("[");
-              }
-              {
-                  CoefficientCoord neighbor_left_coord = {0, 0, 0, 0};
-                  if (get_neighbor(false, sub_mb_size, mb_coord, &neighbor_left_coord)) {
-                      int16_t tmp = 0;
-                      if (fetch(false, true, neighbor_left_coord, &tmp)){
-                          neighbor_left = !!tmp;
-                          if (do_print) {
-                              LOG_NEIGHBORS("%d,", tmp);
-                          }
-                      } else {
-                          neighbor_left = 3;
-                          if (do_print) {
-                              LOG_NEIGHBORS("_,");
-                          }
-                      }
-                  } else {
-                      if (do_print) {
-                          LOG_NEIGHBORS("x,");
-                      }
-                  }
-              }
-              {
-                  CoefficientCoord neighbor_above_coord = {0, 0, 0, 0};
-                  if (get_neighbor(true, sub_mb_size, mb_coord, &neighbor_above_coord)) {
-                      int16_t tmp = 0;
-                      if (fetch(false, true, neighbor_above_coord, &tmp)){
-                          neighbor_above = !!tmp;
-                          if (do_print) {
-                              LOG_NEIGHBORS("%d,", tmp);
-                          }
-                      } else {
-                          neighbor_above = 3;
-                          if (do_print) {
-                              LOG_NEIGHBORS("_,");
-                          }
-                      }
-                  } else {
-                      if (do_print) {
-                          LOG_NEIGHBORS("x,");
-                      }
-                  }
-
-              }
-              {
-                  CoefficientCoord neighbor_left_coord = {0, 0, 0, 0};
-                  if (get_neighbor_coefficient(false, sub_mb_size, mb_coord, &neighbor_left_coord)) {
-                      int16_t tmp = 0;
-                      if (fetch(false, true, neighbor_left_coord, &tmp)){
-                          coeff_neighbor_left = !!tmp;
-                      } else {
-                          coeff_neighbor_left = 3;
-                      }
-                  } else {
-                  }
-              }
-              {
-                  CoefficientCoord neighbor_above_coord = {0, 0, 0, 0};
-                  if (get_neighbor_coefficient(true, sub_mb_size, mb_coord, &neighbor_above_coord)) {
-                      int16_t tmp = 0;
-                      if (fetch(false, true, neighbor_above_coord, &tmp)){
-                          coeff_neighbor_above = !!tmp;
-                      } else {
-                          coeff_neighbor_above = 3;
-                      }
-                  } else {
-                  }
-              }
-              
-              // FIXM: why doesn't this prior help at all
-              {
-                  int16_t output = 0;
-                  if (fetch(true, true, mb_coord, &output)) {
-                      if (do_print) LOG_NEIGHBORS("%d] ", output);
-                  } else {
-                      if (do_print) LOG_NEIGHBORS("x] ");
-                  }
-              }
-              //const BlockMeta &meta = frames[!cur_frame].meta_at(mb_x, mb_y);
-              int num_nonzeros = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index];
-              (void)neighbor_above;
-              (void)neighbor_left;
-              (void)coeff_neighbor_above;
-              (void)coeff_neighbor_left;//haven't found a good way to utilize these priors to make the results better
-              return model_key(&significance_context,
-                               64 * num_nonzeros + nonzeros_observed,
-                               sub_mb_is_dc + zigzag_offset * 2 + 16 * 2 * cat_lookup[sub_mb_cat]);
-          }
-        case PIP_SIGNIFICANCE_EOB:
-          {
-            // FIXME: why doesn't this prior help at all
-            static int fake_context = 0;
-            int num_nonzeros = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index];
-            
-            return model_key(&fake_context, num_nonzeros == nonzeros_observed, 0);
-          }
-        default:
-          break;
-      }
-      assert(false && "Unreachable");
-      abort();
-  }
-  range_t probability_for_model_key(range_t range, model_key key) {
-    auto* e = &estimators[key];
-    int total = e->pos + e->neg;
-    return (range/total) * e->pos;
-  }
-  range_t probability_for_state(range_t range, const void *context) {
-    return probability_for_model_key(range, get_model_key(context));
-  }
-  void update_frame_spec(int frame_num, int mb_width, int mb_height) {
-    if (frames[cur_frame].width() != (uint32_t)mb_width
-        || frames[cur_frame].height() != (uint32_t)mb_height
-        || !frames[cur_frame].is_same_frame(frame_num)) {
-      cur_frame = !cur_frame;
-      if (frames[cur_frame].width() != (uint32_t)mb_width
-          || frames[cur_frame].height() != (uint32_t)mb_height) {
-        frames[cur_frame].init(mb_width, mb_height, mb_width * mb_height);
-        if (frames[!cur_frame].width() != (uint32_t)mb_width
-            || frames[!cur_frame].height() != (uint32_t)mb_height) {
-            frames[!cur_frame].init(mb_width, mb_height, mb_width * mb_height);
-        }
-        //fprintf(stderr, "Init(%d=%d) %d x %d\n", frame_num, cur_frame, mb_width, mb_height);
-      } else {
-        frames[cur_frame].bzero();
-        //fprintf(stderr, "Clear (%d=%d)\n", frame_num, cur_frame);
-      }
-      frames[cur_frame].set_frame_num(frame_num);
+  void put(int bit) {
+    pending = (pending << 1) | bit;
+    if (++pending_bits == 8) {
+      bytes.push_back(char(pending));
+      pending = 0;
+      pending_bits = 0;
     }
   }
-  template <class Functor>
-  void finished_queueing(CodingType ct, const Functor &put_or_get) {
-
-    if (ct == PIP_SIGNIFICANCE_MAP) {
-      bool block_of_interest = (sub_mb_cat == 1 || sub_mb_cat == 2);
-      CodingType last = coding_type;
-      coding_type = PIP_SIGNIFICANCE_NZ;
-      BlockMeta &meta = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y);
-      int nonzero_bits[6] = {};
-      for (int i= 0; i < 6; ++i) {
-          nonzero_bits[i] = (meta.num_nonzeros[mb_coord.scan8_index] & (1 << i)) >> i;
-      }
-#define QUEUE_MODE
-#ifdef QUEUE_MODE
-      const uint32_t serialized_bits = sub_mb_size > 16 ? 6 : sub_mb_size > 4 ? 4 : 2;
-      {
-          uint32_t i = 0;
-          uint32_t serialized_so_far = 0;
-          CoefficientCoord neighbor;
-          uint32_t left_nonzero = 0;
-          uint32_t above_nonzero = 0;
-          bool has_left = get_neighbor_sub_mb(false, sub_mb_size, mb_coord, &neighbor);
-          if (has_left) {
-              left_nonzero = frames[cur_frame].meta_at(neighbor.mb_x, neighbor.mb_y).num_nonzeros[neighbor.scan8_index];
-          }
-          bool has_above = get_neighbor_sub_mb(true, sub_mb_size, mb_coord, &neighbor);
-          if (has_above) {
-              above_nonzero = frames[cur_frame].meta_at(neighbor.mb_x, neighbor.mb_y).num_nonzeros[neighbor.scan8_index];
-          }
-          
-          do {
-              uint32_t cur_bit = (1<<i);
-              int left_nonzero_bit = 2;
-              if (has_left) {
-                  left_nonzero_bit = (left_nonzero >= cur_bit);
-              }
-              int above_nonzero_bit = 2;
-              if (above_nonzero) {
-                  above_nonzero_bit = (above_nonzero >= cur_bit);
-              }
-              put_or_get(model_key(&(STATE_FOR_NUM_NONZERO_BIT[i]), serialized_so_far + 64 * (frames[!cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index] >= cur_bit) + 128 * left_nonzero_bit + 384 * above_nonzero_bit, meta.is_8x8 + sub_mb_is_dc * 2 + sub_mb_chroma422 + sub_mb_cat * 4), &nonzero_bits[i]);
-              if (nonzero_bits[i]) {
-                  serialized_so_far |= cur_bit;
-              }
-          } while (++i < serialized_bits);
-          if (block_of_interest) {
-              LOG_NEIGHBORS("<{");
-          }
-          if (has_left) {
-              if (block_of_interest) {
-                  LOG_NEIGHBORS("%d,", left_nonzero);
-              }
-          } else {
-              if (block_of_interest) {
-                  LOG_NEIGHBORS("X,");
-              }
-          }
-          if (has_above) {
-              if (block_of_interest) {
-                  LOG_NEIGHBORS("%d,", above_nonzero);
-              }
-          } else {
-              if (block_of_interest) {
-                  LOG_NEIGHBORS("X,");
-              }
-          }
-          if (frames[!cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).coded) {
-              if (block_of_interest) {
-                  LOG_NEIGHBORS("%d",frames[!cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index]);
-              }
-          } else {
-              if (block_of_interest) {
-                  LOG_NEIGHBORS("X");
-              }
-          }
-      }
-#endif
-      meta.num_nonzeros[mb_coord.scan8_index] = 0;
-      for (int i= 0; i < 6; ++i) {
-          meta.num_nonzeros[mb_coord.scan8_index] |= nonzero_bits[i] << i;
-      }
-      if (block_of_interest) {
-          LOG_NEIGHBORS("} %d> ",meta.num_nonzeros[mb_coord.scan8_index]);
-      }
-      coding_type = last;
-    }
-  }
-  void end_coding_type(CodingType ct) {
-      if (ct == PIP_SIGNIFICANCE_MAP) {
-        assert(coding_type == PIP_UNREACHABLE
-               || (coding_type == PIP_SIGNIFICANCE_MAP && mb_coord.zigzag_index == 0));
-        uint8_t num_nonzeros = 0;
-        for (int i = 0; i < sub_mb_size; ++i) {
-            int16_t res = frames[cur_frame].at(mb_coord.mb_x, mb_coord.mb_y).residual[mb_coord.scan8_index * 16 + i];
-            assert(res == 1 || res == 0);
-            if (res != 0) {
-                num_nonzeros += 1;
-            }
-        }
-        BlockMeta &meta = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y);
-        meta.is_8x8 = meta.is_8x8 || (sub_mb_size > 32); // 8x8 will have DC be 2x2
-        meta.coded = true;
-        assert(meta.num_nonzeros[mb_coord.scan8_index] == 0 || meta.num_nonzeros[mb_coord.scan8_index] == num_nonzeros);
-        meta.num_nonzeros[mb_coord.scan8_index] = num_nonzeros;
-      }
-      coding_type = PIP_UNKNOWN;
+  // Returns the packed bits, zero-padded to a whole byte.
+  const std::string& finish() {
+    if (pending_bits > 0) {
+      bytes.push_back(char(pending << (8 - pending_bits)));
+      pending = 0;
+      pending_bits = 0;
+    }
+    return bytes;
   }
-  bool begin_coding_type(CodingType ct, int zz_index, int param0, int param1) {
 
-    bool begin_queueing = false;
-    coding_type = ct;
-    switch (ct) {
-    case PIP_SIGNIFICANCE_MAP:
-      {
-          BlockMeta &meta = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y);
-          meta.num_nonzeros[mb_coord.scan8_index] = 0;
-      }
-      assert(!zz_index);
-      nonzeros_observed = 0;
-      if (sub_mb_is_dc) {
-        mb_coord.zigzag_index = 0;
-      } else {
-        mb_coord.zigzag_index = 0;
-      }
-      begin_queueing = true;
-      break;
-    default:
-      break;
-    }
-    return begin_queueing;
-  }
-  void reset_mb_significance_state_tracking() {
-      mb_coord.zigzag_index = 0;
-      nonzeros_observed = 0;
-      coding_type = PIP_SIGNIFICANCE_MAP;
-  }
-  void update_state_tracking(int symbol) {
-    switch (coding_type) {
-    case PIP_SIGNIFICANCE_NZ:
-      break;
-    case PIP_SIGNIFICANCE_MAP:
-      frames[cur_frame].at(mb_coord.mb_x, mb_coord.mb_y).residual[mb_coord.scan8_index * 16 + mb_coord.zigzag_index] = symbol;
-      nonzeros_observed += symbol;
-      if (mb_coord.zigzag_index + 1 == sub_mb_size) {
-        coding_type = PIP_UNREACHABLE;
-        mb_coord.zigzag_index = 0;
-      } else {
-        if (symbol) {
-          coding_type = PIP_SIGNIFICANCE_EOB;
-        } else {
-          ++mb_coord.zigzag_index;
-          if (mb_coord.zigzag_index + 1 == sub_mb_size) {
-              // if we were a zero and we haven't eob'd then the
-              // next and last must be a one
-              frames[cur_frame].at(mb_coord.mb_x, mb_coord.mb_y).residual[mb_coord.scan8_index * 16 + mb_coord.zigzag_index] = 1;
-              ++nonzeros_observed;
-              coding_type = PIP_UNREACHABLE;
-              mb_coord.zigzag_index = 0;
-          }
-        }
+ private:
+  std::string bytes;
+  uint32_t pending = 0;
+  int pending_bits = 0;
+};
+
+class raw_bit_reader {
+ public:
+  raw_bit_reader() = default;
+  explicit raw_bit_reader(const std::string& bytes)
+    : in(reinterpret_cast<const uint8_t*>(bytes.data())), end(in + bytes.size()) {}
+  int get() {
+    if (pending_bits == 0) {
+      if (in == end) {
+        throw std::runtime_error("Truncated bypass bits.");
       }
-      break;
-    case PIP_SIGNIFICANCE_EOB:
-      if (symbol) {
-        mb_coord.zigzag_index = 0;
-        coding_type = PIP_UNREACHABLE;
-      } else if (mb_coord.zigzag_index + 2 == sub_mb_size) {
-        frames[cur_frame].at(mb_coord.mb_x, mb_coord.mb_y).residual[mb_coord.scan8_index * 16 + mb_coord.zigzag_index + 1] = 1;
-        coding_type = PIP_UNREACHABLE;  
-      } else {
-        coding_type = PIP_SIGNIFICANCE_MAP;
-        ++mb_coord.zigzag_index;
-      }
-      break;
-    case PIP_RESIDUALS:
-    case PIP_UNKNOWN:
-      break;
-    case PIP_UNREACHABLE:
-      assert(false);
-    default:
-      assert(false);
-    }
-  }
-  void update_state(int symbol, const void *context) {
-      update_state_for_model_key(symbol, get_model_key(context));
-  }
-  void update_state_for_model_key(int symbol, model_key key) {
-    if (coding_type == PIP_SIGNIFICANCE_EOB) {
-        int num_nonzeros = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index];
-        assert(symbol == (num_nonzeros == nonzeros_observed));
-    }
-    auto* e = &estimators[key];
-    if (symbol) {
-      e->pos++;
-    } else {
-      e->neg++;
-    }
-    if ((coding_type != PIP_SIGNIFICANCE_MAP && e->pos + e->neg > 0x60)
-        || (coding_type == PIP_SIGNIFICANCE_MAP && e->pos + e->neg > 0x50)) {
-      e->pos = (e->pos + 1) / 2;
-      e->neg = (e->neg + 1) / 2;
+      pending = *in++;
+      pending_bits = 8;
     }
-    update_state_tracking(symbol);
+    return (pending >> --pending_bits) & 1;
   }
 
-  const uint8_t bypass_context = 0, terminate_context = 0, significance_context = 0;
-  CoefficientCoord mb_coord;
-  int nonzeros_observed = 0;
-  int sub_mb_cat = -1;
-  int sub_mb_size = -1;
-  int sub_mb_is_dc = 0;
-  int sub_mb_chroma422 = 0;
  private:
-  struct estimator { int pos = 1, neg = 1; };
-  std::map<model_key, estimator> estimators;
+  const uint8_t *in = nullptr, *end = nullptr;
+  uint32_t pending = 0;
+  int pending_bits = 0;
 };
 
 class h264_symbol {
@@ -1067,16 +752,20 @@ public:
   template <class T>
   void execute(T &encoder, h264_model *model,
       Recoded::Block *out, std::vector<uint8_t> &encoder_out) {
+#ifdef DO_NEIGHBOR_LOGGING
     bool in_significance_map = (model->coding_type == PIP_SIGNIFICANCE_MAP);
     bool block_of_interest = (model->sub_mb_cat == 1 || model->sub_mb_cat == 2);
     bool print_priors = in_significance_map && block_of_interest;
+#endif
     if (model->coding_type != PIP_SIGNIFICANCE_EOB) {
       size_t billable_bytes = encoder.put(symbol, [&](range_t range){
           return model->probability_for_state(range, state); });
       if (billable_bytes) {
         model->billable_bytes(billable_bytes);
       }
-    }else if (block_of_interest) {
+    }
+#ifdef DO_NEIGHBOR_LOGGING
+    else if (block_of_interest) {
         if (symbol) {
             LOG_NEIGHBORS("\n");
         }
@@ -1084,11 +773,14 @@ public:
     if (print_priors) {
         model->enable_debug();
     }
+#endif
     model->update_state(symbol, state);
+#ifdef DO_NEIGHBOR_LOGGING
     if (print_priors) {
         LOG_NEIGHBORS("%d ", symbol);
         model->disable_debug();
     }
+#endif
     if (state == &model->terminate_context && symbol) {
       encoder.finish();
       out->set_cabac(&encoder_out[0], encoder_out.size());
@@ -1099,29 +791,174 @@ private:
   const void* state;
 };
 
-class compressor {
+// Passes events from a decoding thread to Target::apply: inline, or if
+// pipelined, on a consumer thread fed by an spsc_ring. Both give the same
+// results.
+template <typename Target, typename Event>
+class event_pipeline {
  public:
-  compressor(const std::string& input_filename, std::ostream& out_stream)
-    : input_filename(input_filename), out_stream(out_stream) {
-    if (av_file_map(input_filename.c_str(), &original_bytes, &original_size, 0, NULL) < 0) {
-      throw std::invalid_argument("Failed to open file: " + input_filename);
+  event_pipeline(Target *target, bool pipelined) : target(target) {
+    if (pipelined) {
+      events.reset(new spsc_ring<Event>(1 << 15));
+      consumer = std::thread([this]() { consume(); });
     }
   }
-
-  ~compressor() {
-    av_file_unmap(original_bytes, original_size);
+  event_pipeline(const event_pipeline&) = delete;
+  ~event_pipeline() {
+    if (consumer.joinable()) {
+      events->push(end_of_stream());
+      consumer.join();
+    }
+  }
+
+  void emit(const Event& e) {
+    if (events) {
+      events->push(e);
+    } else {
+      target->apply(e);
+    }
+  }
+
+  // Follows the events with an END_OF_STREAM event and returns when all have
+  // been applied. Later events are applied inline.
+  void finish() {
+    if (!events) {
+      target->apply(end_of_stream());
+      return;
+    }
+    events->push(end_of_stream());
+    consumer.join();
+    events.reset();
+    if (error) std::rethrow_exception(error);
+  }
+
+ private:
+  static Event end_of_stream() {
+    Event end;
+    end.kind = Event::END_OF_STREAM;
+    return end;
+  }
+
+  void consume() {
+    Event e;
+    do {
+      events->pop(&e);
+      if (!error) {
+        try {
+          target->apply(e);
+        } catch (...) {
+          // Keep draining so the decoder doesn't block on a full ring.
+          error = std::current_exception();
+        }
+      }
+    } while (e.kind != Event::END_OF_STREAM);
+  }
+
+  Target *target;
+  std::unique_ptr<spsc_ring<Event>> events;
+  std::exception_ptr error;
+  std::thread consumer;
+};
+
+
+// One model per video stream, by stream index.
+typedef std::map<int, h264_model> h264_models;
+
+
+class compressor {
+ public:
+  compressor(const uint8_t *original_bytes, size_t original_size, std::ostream& out_stream,
+      h264_models& models, const compressor_options& opts = compressor_options())
+    : out_stream(out_stream), opts(opts), original_bytes(original_bytes), original_size(original_size),
+      models(models) {
+    interleaved_recoded_code::check_streams(opts.coder_streams);
+    if (opts.coder_streams != 1) {
+      out.mutable_metadata()->set_coder_streams(opts.coder_streams);
+    }
+    if (opts.code_mp4_index) {
+      find_moov();
+    }
   }
 
   void run() {
-    // Run through all the frames in the file, building the output using our hooks.
-    av_decoder<compressor> d(this, input_filename);
-    d.dump_stream_info();
-    d.decode_video();
+    if (probe_recodable()) {
+      try {
+        recode_video();
+      } catch (const verify_error& e) {
+        // The recoded blocks can't be trusted, and the model has learned
+        // from them, so none are kept.
+        std::cerr << "Warning: " << e.what() << "; the video is stored without recompression." << std::endl;
+        streams.clear();
+        found_blocks.clear();
+        claimed.clear();
+        checkpoints.clear();
+      }
+    } else {
+      std::cerr << "No CABAC-coded H.264 video; storing without recompression." << std::endl;
+    }
+
+    // Decoding from a checkpoint demuxes from its keyframe packet, which
+    // would miss the blocks of other streams from before it.
+    int coded_streams = 0;
+    for (const auto& stream : streams) {
+      coded_streams += stream.second->has_coded_blocks;
+    }
+    if (coded_streams > 1) {
+      checkpoints.clear();
+    }
+
+    // The metadata goes first, so that the blocks can be written as they
+    // are assembled.
+    out.mutable_metadata()->set_crc32c(crc32c::of(original_bytes, original_size));
+    write_field(1, out.metadata());
+    assemble_blocks();
+    write_index();
+  }
+
+  const compress_stats& stats() const {
+    return written;
+  }
 
-    // Flush the final block to the output and write to stdout.
-    out.add_block()->set_literal(
-        &original_bytes[prev_coded_block_end], original_size - prev_coded_block_end);
-    out_stream << out.SerializeAsString();
+  // Recodes num_samples GOPs spread over the H.264 stream instead of the whole
+  // file, and writes the compression ratio and time extrapolated from them.
+  // Savings on literal data are not included.
+  void estimate(int num_samples = 8) {
+    double ratio = 1, seconds = 0, sampled_fraction = 0, cabac_ratio = 1;
+    if (probe_recodable()) {
+      auto start = std::chrono::steady_clock::now();
+      av_decoder<compressor> d(this, true);
+      int stream = d.h264_stream();
+      sampling = true;
+      size_t sampled_bytes = stream < 0 ? 0 : recode([&]() {
+        return d.decode_video_samples(stream, num_samples, [this](int64_t pos) { reposition(pos); });
+      });
+      assemble_blocks();
+      sampling = false;
+      double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      size_t cabac_bytes = 0, recoded_bytes = 0;
+      for (const auto& block : out.block()) {
+        if (block.has_cabac()) {
+          cabac_bytes += block.size();
+          recoded_bytes += block.cabac().size() + block.bypass_bits().size();
+        }
+      }
+      if (sampled_bytes > 0 && cabac_bytes > 0) {
+        int64_t video_bytes = d.stream_bytes(stream);
+        if (video_bytes < 0) {
+          video_bytes = original_size;
+        }
+        cabac_ratio = double(recoded_bytes) / cabac_bytes;
+        double saved = video_bytes * (double(cabac_bytes) / sampled_bytes) * (1 - cabac_ratio);
+        ratio = std::max(0., original_size - saved) / original_size;
+        seconds = elapsed * video_bytes / sampled_bytes;
+        sampled_fraction = std::min(1., double(sampled_bytes) / video_bytes);
+      }
+    }
+    out_stream << "Estimate from " << sampled_fraction*100. << "% of the video:" << std::endl;
+    out_stream << " CABAC recoding ratio: " << cabac_ratio*100. << "%" << std::endl;
+    out_stream << " expected compression ratio: " << ratio*100. << "%" << std::endl;
+    out_stream << " expected compress time: " << seconds << " s" << std::endl;
   }
 
   int read_packet(uint8_t *buffer_out, int size) {
@@ -1131,11 +968,81 @@ class compressor {
     return size;
   }
 
+  // Used by the demuxer, for its own probes as well as for estimate's
+  // samples and resuming from a journal. The search for coded blocks is
+  // left alone; see reposition().
+  int64_t seek(int64_t offset, int whence) {
+    switch (whence & ~AVSEEK_FORCE) {
+      case AVSEEK_SIZE: return original_size;
+      case SEEK_SET: break;
+      case SEEK_CUR: offset += read_offset; break;
+      case SEEK_END: offset += original_size; break;
+      default: return -1;
+    }
+    if (offset < 0 || offset > int64_t(original_size)) {
+      return -1;
+    }
+    read_offset = offset;
+    return offset;
+  }
+
+  // Makes every stream search for coded blocks from offset, where decoding
+  // restarts: at each of estimate's samples, and where a journal resumes.
+  // The skipped bytes are not emitted.
+  void reposition(size_t offset) {
+    std::lock_guard<std::mutex> lock(blocks_mutex);
+    search_start = offset;
+    for (auto& stream : streams) {
+      stream.second->prev_coded_block_end = offset;
+    }
+  }
+
+  int slice_threads() const {
+    return opts.slice_threads;
+  }
+
+  // The whole file is decoded.
+  bool finished() const {
+    return false;
+  }
+
+  struct stream_state;
+
+  // Called by av_decoder, on the demuxing thread, when it opens the stream.
+  stream_state* stream(int index) {
+    std::unique_ptr<stream_state>& stream = streams[index];
+    if (!stream) {
+      stream.reset(new stream_state(this, index, &models[index]));
+      std::lock_guard<std::mutex> lock(blocks_mutex);
+      stream->prev_coded_block_end = search_start;
+    }
+    return stream.get();
+  }
+
+ private:
+  struct recode_event;
+  struct buffered_slice;
+
+ public:
+  // Hook side: decodes the original CABAC bins of a slice and passes them,
+  // with the model hook calls, to the model and coder as recode_events.
+  // With slice threads they are buffered until the packet is decoded.
   class cabac_decoder {
    public:
-    cabac_decoder(compressor *c, CABACContext *ctx_in, const uint8_t *buf, int size) {
-      out = c->find_next_coded_block_and_emit_literal(buf, size);
-      model = nullptr;
+    cabac_decoder(compressor *c, stream_state *stream, CABACContext *ctx_in, const uint8_t *buf, int size)
+      : stream(stream), states(h264_model::slice_cabac_states(ctx_in)) {
+      if (c->opts.slice_threads > 1) {
+        // Whether the slice is recoded is known once the slices before it
+        // have been found, so decode it either way.
+        slice = stream->begin_slice(buf, size);
+        current_slice = slice.get();
+        recoding = true;
+        decoder = cabac::decoder(buf, size);
+        return;
+      }
+      const uint8_t *stored = nullptr;
+      Recoded::Block *out = c->find_coded_block(stream, buf, size, &stored);
+      stream->pipeline.emit(recode_event::begin_block(out, size, stored));
       if (out == nullptr) {
         // We're skipping this block, so disable calls to our hooks.
         ctx_in->coding_hooks = nullptr;
@@ -1143,26 +1050,164 @@ class compressor {
         ::ff_reset_cabac_decoder(ctx_in, buf, size);
         return;
       }
+      recoding = true;
+      decoder = cabac::decoder(buf, size);
+    }
+
+    ~cabac_decoder() {
+      if (slice) {
+        end_slice();
+      }
+    }
+
+    int get(uint8_t *state) {
+      uint8_t cabac_state = *state;
+      int symbol = decoder.get(state);
+      emit(recode_event::bin(recode_event::SYMBOL, symbol, h264_model::cabac_state_offset(states, state), cabac_state));
+      return symbol;
+    }
+
+    int get_bypass() {
+      int symbol = decoder.get_bypass();
+      emit(recode_event::bin(recode_event::BYPASS, symbol));
+      return symbol;
+    }
+
+    int get_terminate() {
+      int symbol = decoder.get_terminate();
+      emit(recode_event::bin(recode_event::TERMINATE, symbol));
+      if (symbol && slice) {
+        end_slice();
+      }
+      return symbol;
+    }
+
+    void begin_coding_type(CodingType ct, int zigzag_index, int param0, int param1) {
+      if (recoding) {
+        emit(recode_event::model_call(recode_event::BEGIN_CODING_TYPE, ct, zigzag_index, param0, param1));
+      }
+    }
+    void end_coding_type(CodingType ct) {
+      if (recoding) {
+        emit(recode_event::model_call(recode_event::END_CODING_TYPE, ct));
+      }
+    }
 
-      out->set_size(size);
+   private:
+    void emit(const recode_event& e) {
+      if (slice) {
+        slice->events.push_back(e);
+      } else {
+        stream->pipeline.emit(e);
+      }
+    }
 
-      ctx = *ctx_in;
-      ctx.coding_hooks = nullptr;
-      ctx.coding_hooks_opaque = nullptr;
-      ::ff_reset_cabac_decoder(&ctx, buf, size);
+    void end_slice() {
+      if (current_slice == slice.get()) {
+        current_slice = nullptr;
+      }
+      stream->end_slice(std::move(slice));
+    }
 
-      this->c = c;
-      model = &c->model;
+    stream_state *stream;
+    // The slice context's CABAC states, which follow its CABACContext.
+    const uint8_t *states;
+    bool recoding = false;
+    // Reads the original CABAC symbols of the block.
+    cabac::decoder decoder;
+    // With slice threads, the slice's events until it is decoded.
+    std::unique_ptr<buffered_slice> slice;
+  };
+
+ private:
+  // A bin or model hook call, in the order libavcodec made them.
+  struct recode_event {
+    enum kind_t : uint8_t {
+      BEGIN_BLOCK, SYMBOL, BYPASS, TERMINATE, BEGIN_CODING_TYPE, END_CODING_TYPE,
+      FRAME_SPEC, MB_XY, BEGIN_SUB_MB, END_SUB_MB, SNAPSHOT, END_OF_STREAM,
+    };
+    kind_t kind;
+    int8_t symbol;
+    // The CABAC state a SYMBOL was decoded in.
+    uint8_t cabac_state;
+    // A BEGIN_BLOCK's bytes in the file.
+    const void *state;
+    Recoded::Block *block;
+    int args[5];
+
+    static recode_event begin_block(Recoded::Block *block, int size, const uint8_t *stored) {
+      recode_event e = model_call(BEGIN_BLOCK, size);
+      e.block = block;
+      e.state = stored;
+      return e;
+    }
+    // A SYMBOL's context is the offset of its CABAC state, in args[0].
+    static recode_event bin(kind_t kind, int symbol, int context = 0, uint8_t cabac_state = 0) {
+      recode_event e;
+      e.kind = kind;
+      e.symbol = symbol;
+      e.args[0] = context;
+      e.cabac_state = cabac_state;
+      return e;
+    }
+    static recode_event model_call(kind_t kind, int a0 = 0, int a1 = 0, int a2 = 0, int a3 = 0, int a4 = 0) {
+      recode_event e;
+      e.kind = kind;
+      e.args[0] = a0;
+      e.args[1] = a1;
+      e.args[2] = a2;
+      e.args[3] = a3;
+      e.args[4] = a4;
+      return e;
+    }
+
+    // Calls made by libavcodec for skipped slices too.
+    bool is_model_hook() const {
+      return kind == FRAME_SPEC || kind == MB_XY || kind == BEGIN_SUB_MB || kind == END_SUB_MB;
+    }
+  };
+
+  // With slice threads: the events of a slice, or a model hook call made
+  // outside any slice, waiting to be passed on in bitstream order. Slices of
+  // a picture are ordered by their first macroblock, after the picture's
+  // frame-level calls.
+  struct buffered_slice {
+    size_t picture = 0;
+    int first_mb_y = -1, first_mb_x = -1;
+    size_t sequence = 0;
+    // The original slice, searched for in the file when its turn comes.
+    std::string bytes;
+    std::vector<recode_event> events;
+
+    bool is_slice() const {
+      return first_mb_y >= 0;
+    }
+    std::tuple<size_t, int, int, size_t> order() const {
+      return std::make_tuple(picture, first_mb_y, first_mb_x, sequence);
+    }
+  };
+
+  // The slice parsed on this thread, with slice threads.
+  static thread_local buffered_slice *current_slice;
+
+  // Model and coder side for one CABAC block: runs h264_model on its bins
+  // and writes them to the recoded arithmetic code.
+  class block_recoder {
+   public:
+    block_recoder(compressor *c, h264_model *model, Recoded::Block *out, int size)
+      : out(out), c(c), model(model), encoder(std::back_inserter(encoder_out), c->opts.coder_streams) {
+      // The recoded block is rarely larger than the original.
+      encoder_out.reserve(size);
+      encoder.reserve(size);
       model->reset();
     }
-    ~cabac_decoder() { assert(out == nullptr || out->has_cabac()); }
 
     void execute_symbol(int symbol, const void* state) {
       h264_symbol sym(symbol, state);
 #define QUEUE_MODE
 #ifdef QUEUE_MODE
-      if (queueing_symbols == PIP_SIGNIFICANCE_MAP || queueing_symbols == PIP_SIGNIFICANCE_EOB || !symbol_buffer.empty()) {
-        symbol_buffer.push_back(sym);
+      if (queueing_symbols == PIP_SIGNIFICANCE_MAP || queueing_symbols == PIP_SIGNIFICANCE_EOB) {
+        significance_bins.push_back(symbol);
         model->update_state_tracking(symbol);
       } else {
 #endif
@@ -1172,39 +1217,33 @@ class compressor {
 #endif
     }
 
-    int get(uint8_t *state) {
-      int symbol = ::ff_get_cabac(&ctx, state);
+    void get(int symbol, const void *state) {
       execute_symbol(symbol, state);
-      return symbol;
     }
 
-    int get_bypass() {
-      int symbol = ::ff_get_cabac_bypass(&ctx);
-      execute_symbol(symbol, &model->bypass_context);
-      return symbol;
+    void get_bypass(int symbol) {
+      if (c->opts.raw_bypass) {
+        bypass_bits.put(symbol);
+      } else {
+        execute_symbol(symbol, &model->bypass_context);
+      }
     }
 
-    int get_terminate() {
-      int n = ::ff_get_cabac_terminate(&ctx);
-      int symbol = (n != 0);
+    void get_terminate(int symbol) {
       execute_symbol(symbol, &model->terminate_context);
-      return symbol;
+      if (symbol && c->opts.raw_bypass) {
+        out->set_bypass_bits(bypass_bits.finish());
+      }
     }
 
     void begin_coding_type(
         CodingType ct, int zigzag_index, int param0, int param1) {
-      if (!model) {
-          return;
-      }
       bool begin_queue = model->begin_coding_type(ct, zigzag_index, param0, param1);
       if (begin_queue && (ct == PIP_SIGNIFICANCE_MAP || ct == PIP_SIGNIFICANCE_EOB)) {
         push_queueing_symbols(ct);
       }
     }
     void end_coding_type(CodingType ct) {
-      if (!model) {
-          return;
-      }
       model->end_coding_type(ct);
 
       if ((ct == PIP_SIGNIFICANCE_MAP || ct == PIP_SIGNIFICANCE_EOB)) {
@@ -1219,179 +1258,1319 @@ class compressor {
                    model->billable_bytes(billable_bytes);
                }
             });
-        static int i = 0;
-        if (i++ < 10) {
-        std::cerr << "FINISHED QUEUING DECODE: " << (int)(model->frames[model->cur_frame].meta_at(model->mb_coord.mb_x, model->mb_coord.mb_y).num_nonzeros[model->mb_coord.scan8_index]) << std::endl;
+        pop_queueing_symbols();
+        model->set_coding_type(PIP_UNKNOWN);
+      }
+    }
+
+   private:
+    void push_queueing_symbols(CodingType ct) {
+      // Does not currently support nested queues.
+      assert (queueing_symbols == PIP_UNKNOWN);
+      assert (significance_bins.empty());
+      queueing_symbols = ct;
+    }
+
+    void stop_queueing_symbols() {
+      assert (queueing_symbols != PIP_UNKNOWN);
+      queueing_symbols = PIP_UNKNOWN;
+    }
+
+    void pop_queueing_symbols() {
+      model->code_significance_map(significance_bins.begin(), significance_bins.end(),
+          [&](int symbol, model_key key) {
+            size_t billable_bytes = encoder.put(symbol, [&](range_t range){
+                return model->probability_for_model_key(range, key);
+            });
+            if (billable_bytes) {
+                model->billable_bytes(billable_bytes);
+            }
+          });
+      significance_bins.clear();
+    }
+
+    Recoded::Block *out;
+    compressor *c;
+    h264_model *model;
+    std::vector<uint8_t> encoder_out;
+    interleaved_recoded_code::encoder<std::back_insert_iterator<std::vector<uint8_t>>> encoder;
+    raw_bit_writer bypass_bits;
+
+    CodingType queueing_symbols = PIP_UNKNOWN;
+    // The bins of the significance map being parsed, coded once it ends.
+    std::vector<uint8_t> significance_bins;
+  };
+
+  // A recoded block that doesn't decode to the original slice.
+  struct verify_error : std::runtime_error {
+    using std::runtime_error::runtime_error;
+  };
+
+  // With verify: follows the events with a second model, as the
+  // decompressor will. Once a block is written, its events are replayed to
+  // decode the recoded bins, which are then re-encoded with CABAC and
+  // compared with the slice in the file.
+  class shadow_decoder {
+   public:
+    explicit shadow_decoder(int coder_streams) : coder_streams(coder_streams) {}
+
+    // Between blocks the shadow model is in step with the stream's.
+    void restore(const std::string& snapshot) {
+      model.restore(snapshot);
+    }
+
+    void apply(const recode_event& e) {
+      if (e.kind == recode_event::BEGIN_BLOCK) {
+        block = e.block;
+        stored = static_cast<const uint8_t*>(e.state);
+        block_events.clear();
+      } else if (block) {
+        block_events.push_back(e);
+        if (e.kind == recode_event::TERMINATE && e.symbol) {
+          verify();
+          block = nullptr;
+        }
+      } else if (e.is_model_hook()) {
+        model_hook(e);
+      }
+    }
+
+   private:
+    void verify() {
+      if (block->model_reset()) {
+        model.restart();
+      }
+      model.reset();
+      interleaved_recoded_code::decoder<char> decoder(
+          block->cabac().data(), block->cabac().data() + block->cabac().size(), coder_streams);
+      raw_bit_reader bypass_bits;
+      if (block->has_bypass_bits()) {
+        bypass_bits = raw_bit_reader(block->bypass_bits());
+      }
+      std::vector<uint8_t> cabac_out;
+      cabac::encoder<std::back_insert_iterator<std::vector<uint8_t>>> encoder{std::back_inserter(cabac_out)};
+      auto check = [&](int symbol, const recode_event& e) {
+        if (symbol != e.symbol) {
+          throw verify_error("Recoded bin differs from the original");
+        }
+      };
+
+      for (const recode_event& e : block_events) {
+        switch (e.kind) {
+          case recode_event::SYMBOL: {
+            const void *context = model.cabac_state(e.args[0]);
+            int symbol;
+            if (model.coding_type == PIP_SIGNIFICANCE_EOB) {
+              symbol = std::get<1>(model.get_model_key(context));
+            } else {
+              symbol = decoder.get([&](range_t range) { return model.probability_for_state(range, context); });
+            }
+            check(symbol, e);
+            uint8_t state = e.cabac_state;
+            encoder.put(symbol, &state);
+            model.update_state(symbol, context);
+            break;
+          }
+          case recode_event::BYPASS: {
+            int symbol;
+            if (block->has_bypass_bits()) {
+              symbol = bypass_bits.get();
+            } else {
+              symbol = decoder.get([&](range_t range) {
+                  return model.probability_for_state(range, &model.bypass_context); });
+              model.update_state(symbol, &model.bypass_context);
+            }
+            check(symbol, e);
+            encoder.put_bypass(symbol);
+            break;
+          }
+          case recode_event::TERMINATE: {
+            int symbol = decoder.get([&](range_t range) {
+                return model.probability_for_state(range, &model.terminate_context); });
+            model.update_state(symbol, &model.terminate_context);
+            check(symbol, e);
+            encoder.put_terminate(symbol);
+            break;
+          }
+          case recode_event::BEGIN_CODING_TYPE: {
+            CodingType ct = CodingType(e.args[0]);
+            if (model.begin_coding_type(ct, e.args[1], e.args[2], e.args[3]) && ct) {
+              model.finished_queueing(ct, [&](model_key key, int *symbol) {
+                *symbol = decoder.get([&](range_t range) { return model.probability_for_model_key(range, key); });
+                model.update_state_for_model_key(*symbol, key);
+              });
+            }
+            break;
+          }
+          case recode_event::END_CODING_TYPE:
+            model.end_coding_type(CodingType(e.args[0]));
+            break;
+          default:
+            model_hook(e);
+            break;
+        }
+      }
+
+      // The slice as the decompressor restores it.
+      if (!cabac_out.empty() && cabac_out.back() == 0x80) {
+        cabac_out.pop_back();
+      }
+      std::string slice(cabac_out.begin(), cabac_out.end());
+      if (block->has_length_parity() && block->has_last_byte() && !block->last_byte().empty()) {
+        if (block->length_parity() != int(slice.size() & 1)) {
+          slice += block->last_byte()[0];
+        } else if (!slice.empty()) {
+          slice.back() = block->last_byte()[0];
+        }
+      }
+      if (!block->nal_escapes().empty()) {
+        slice = nal_apply_escapes(slice, block->nal_escapes());
+      }
+      if (slice.size() != size_t(block->size()) || memcmp(slice.data(), stored, slice.size()) != 0) {
+        throw verify_error("Recoded slice doesn't reproduce the original");
+      }
+    }
+
+    void model_hook(const recode_event& e) {
+      switch (e.kind) {
+        case recode_event::FRAME_SPEC:
+          model.frame_spec(e.args[0], e.args[1], e.args[2]);
+          break;
+        case recode_event::MB_XY:
+          model.mb_xy(e.args[0], e.args[1]);
+          break;
+        case recode_event::BEGIN_SUB_MB:
+          model.begin_sub_mb(e.args[0], e.args[1], e.args[2], e.args[3], e.args[4]);
+          break;
+        case recode_event::END_SUB_MB:
+          model.end_sub_mb(e.args[0], e.args[1], e.args[2], e.args[3], e.args[4]);
+          break;
+        default:
+          break;
+      }
+    }
+
+    int coder_streams;
+    // Sees the same events as the stream's model, a block later.
+    h264_model model;
+    Recoded::Block *block = nullptr;
+    const uint8_t *stored = nullptr;
+    std::vector<recode_event> block_events;
+  };
+
+ public:
+  // A video stream: its model, where its next slice is searched for in the
+  // file, and the model and coder side of its current block.
+  struct stream_state {
+    stream_state(compressor *c, int index, h264_model *model)
+      : c(c), index(index), model(model),
+        shadow(c->opts.verify ? new shadow_decoder(c->opts.coder_streams) : nullptr),
+        pipeline(this, c->opts.pipeline) {}
+
+    // Model hooks, passed on in order with the bins.
+    void frame_spec(int frame_num, int mb_width, int mb_height) {
+      model_call(recode_event::model_call(recode_event::FRAME_SPEC, frame_num, mb_width, mb_height));
+    }
+    void mb_xy(int x, int y) {
+      model_call(recode_event::model_call(recode_event::MB_XY, x, y));
+    }
+    void begin_sub_mb(int cat, int scan8index, int max_coeff, int is_dc, int chroma422) {
+      model_call(recode_event::model_call(recode_event::BEGIN_SUB_MB, cat, scan8index, max_coeff, is_dc, chroma422));
+    }
+    void end_sub_mb(int cat, int scan8index, int max_coeff, int is_dc, int chroma422) {
+      model_call(recode_event::model_call(recode_event::END_SUB_MB, cat, scan8index, max_coeff, is_dc, chroma422));
+    }
+
+    std::unique_ptr<buffered_slice> begin_slice(const uint8_t *buf, int size) {
+      std::unique_ptr<buffered_slice> slice(new buffered_slice);
+      slice->bytes.assign(reinterpret_cast<const char*>(buf), size);
+      std::lock_guard<std::mutex> lock(slices_mutex);
+      slice->picture = pictures;
+      return slice;
+    }
+
+    void end_slice(std::unique_ptr<buffered_slice> slice) {
+      if (!slice->is_slice()) {
+        // Abandoned before its first macroblock.
+        return;
+      }
+      std::lock_guard<std::mutex> lock(slices_mutex);
+      decoded_slices.push_back(std::move(slice));
+    }
+
+    // Called by av_decoder before each packet. At a keyframe, when journaling,
+    // a snapshot is taken every few seconds, from which compression can
+    // resume at this packet. At a keyframe far enough past the last
+    // checkpoint, the stream's next recoded block is made to restart the
+    // model, and decompression can start at this packet.
+    void begin_packet(const AVPacket& packet) {
+      if (!(packet.flags & AV_PKT_FLAG_KEY) || packet.pos < 0 || packet.dts == AV_NOPTS_VALUE) {
+        return;
+      }
+      if (c->journaling && std::chrono::steady_clock::now() - c->last_snapshot >= std::chrono::seconds(5)) {
+        c->queue_snapshot(this, packet);
+        pipeline.emit(recode_event::model_call(recode_event::SNAPSHOT));
+      }
+      if (c->opts.checkpoint_interval == 0) {
+        return;
+      }
+      if (last_checkpoint_pos < 0 || size_t(packet.pos - last_checkpoint_pos) >= c->opts.checkpoint_interval) {
+        checkpoint_pending = true;
+        checkpoint.set_stream(index);
+        checkpoint.set_packet_pos(packet.pos);
+        checkpoint.set_packet_dts(packet.dts);
+      }
+    }
+
+    // Called by av_decoder after each packet. With slice threads, finds the
+    // packet's slices in the file and passes their events on, in bitstream
+    // order.
+    void packet_decoded() {
+      if (c->opts.slice_threads <= 1) {
+        return;
+      }
+      std::vector<std::unique_ptr<buffered_slice>> slices;
+      {
+        std::lock_guard<std::mutex> lock(slices_mutex);
+        slices.swap(decoded_slices);
+      }
+      std::sort(slices.begin(), slices.end(), [](const std::unique_ptr<buffered_slice>& a,
+                                                 const std::unique_ptr<buffered_slice>& b) {
+        return a->order() < b->order();
+      });
+      for (size_t i = 0; i < slices.size(); i++) {
+        const buffered_slice& slice = *slices[i];
+        if (i > 0 && slice.is_slice() && slices[i - 1]->order() == slice.order()) {
+          throw std::runtime_error("Slices of a packet can't be put in order; compress without slice threads.");
+        }
+        Recoded::Block *out = nullptr;
+        if (slice.is_slice()) {
+          const uint8_t *stored = nullptr;
+          out = c->find_coded_block(this, reinterpret_cast<const uint8_t*>(slice.bytes.data()), slice.bytes.size(),
+                                    &stored);
+          pipeline.emit(recode_event::begin_block(out, slice.bytes.size(), stored));
+        }
+        for (const recode_event& e : slice.events) {
+          // A skipped slice's hooks would have been disabled after its
+          // model hook calls.
+          if (out || e.is_model_hook()) {
+            pipeline.emit(e);
+          }
+        }
+      }
+    }
+
+    void model_call(const recode_event& e) {
+      if (c->opts.slice_threads <= 1) {
+        pipeline.emit(e);
+      } else if (current_slice) {
+        if (e.kind == recode_event::MB_XY && !current_slice->is_slice()) {
+          current_slice->first_mb_x = e.args[0];
+          current_slice->first_mb_y = e.args[1];
+        }
+        current_slice->events.push_back(e);
+      } else {
+        // Frame-level calls, made between the pictures' slices.
+        std::unique_ptr<buffered_slice> call(new buffered_slice);
+        call->events.push_back(e);
+        std::lock_guard<std::mutex> lock(slices_mutex);
+        if (e.kind == recode_event::FRAME_SPEC) {
+          pictures++;
+        }
+        call->picture = pictures;
+        call->sequence = decoded_slices.size();
+        decoded_slices.push_back(std::move(call));
+      }
+    }
+
+    // Runs the model and coder for an event, on the consumer thread if
+    // pipelined. Coding type events only arrive for recoded blocks.
+    void apply(const recode_event& e) {
+      switch (e.kind) {
+        case recode_event::BEGIN_BLOCK:
+          if (e.block && e.block->model_reset()) {
+            model->restart();
+          }
+          recoder.reset(e.block ? new block_recoder(c, model, e.block, e.args[0]) : nullptr);
+          break;
+        case recode_event::SYMBOL:
+          recoder->get(e.symbol, model->cabac_state(e.args[0]));
+          break;
+        case recode_event::BYPASS:
+          recoder->get_bypass(e.symbol);
+          break;
+        case recode_event::TERMINATE:
+          recoder->get_terminate(e.symbol);
+          break;
+        case recode_event::BEGIN_CODING_TYPE:
+          recoder->begin_coding_type(CodingType(e.args[0]), e.args[1], e.args[2], e.args[3]);
+          break;
+        case recode_event::END_CODING_TYPE:
+          recoder->end_coding_type(CodingType(e.args[0]));
+          break;
+        case recode_event::FRAME_SPEC:
+          model->frame_spec(e.args[0], e.args[1], e.args[2]);
+          break;
+        case recode_event::MB_XY:
+          model->mb_xy(e.args[0], e.args[1]);
+          break;
+        case recode_event::BEGIN_SUB_MB:
+          model->begin_sub_mb(e.args[0], e.args[1], e.args[2], e.args[3], e.args[4]);
+          break;
+        case recode_event::END_SUB_MB:
+          model->end_sub_mb(e.args[0], e.args[1], e.args[2], e.args[3], e.args[4]);
+          break;
+        case recode_event::SNAPSHOT:
+          c->write_snapshot(this);
+          break;
+        case recode_event::END_OF_STREAM:
+          recoder.reset();
+          break;
+      }
+      if (shadow) {
+        shadow->apply(e);
+      }
+    }
+
+    compressor *c;
+    int index;
+    h264_model *model;
+    // Guarded by the compressor's blocks_mutex while decoding.
+    size_t prev_coded_block_end = 0;
+    bool has_coded_blocks = false;
+    // The keyframe packet the next recoded block is to restart the model
+    // at, and the last packet that did. Used by the stream's decoding thread.
+    bool checkpoint_pending = false;
+    Recoded::Index::Entry checkpoint;
+    int64_t last_checkpoint_pos = -1;
+    std::unique_ptr<block_recoder> recoder;
+    std::unique_ptr<shadow_decoder> shadow;
+
+    // With slice threads: the pictures begun, and the slices and model hook
+    // calls since the last packet.
+    std::mutex slices_mutex;
+    size_t pictures = 0;
+    std::vector<std::unique_ptr<buffered_slice>> decoded_slices;
+    // Last, so the consumer stops before the rest is destroyed.
+    event_pipeline<stream_state, recode_event> pipeline;
+  };
+
+ private:
+  // Runs decode, which drives the hooks. If pipelined, the model and coder
+  // run on other threads, which have finished all blocks on return.
+  template <typename Decode>
+  size_t recode(const Decode& decode) {
+    size_t result = decode();
+    for (auto& stream : streams) {
+      stream.second->pipeline.finish();
+    }
+    return result;
+  }
+
+  // Run through all the frames in the file, building the output using our hooks.
+  void recode_video() {
+    Journal::Snapshot resume;
+    bool resuming = !opts.journal.empty() && open_journal(&resume);
+    av_decoder<compressor> d(this, resuming);
+    d.dump_stream_info();
+    if (resuming) {
+      if (!d.seek_to_packet(resume.stream(), resume.packet_dts(), resume.packet_pos())) {
+        throw std::runtime_error("Failed to seek to where the journal resumes.");
+      }
+      reposition(resume.packet_pos());
+      restore(resume);
+    }
+    if (!opts.journal.empty()) {
+      if (d.video_streams() == 1) {
+        journaling = true;
+        last_snapshot = std::chrono::steady_clock::now();
+      } else {
+        std::cerr << "Warning: journaling needs a single video stream; none is kept." << std::endl;
+      }
+    }
+    recode([&]() { return d.decode_video(opts.parallel_streams); });
+  }
+
+  // Probes with a separate demuxer, then rewinds so decoding starts from the
+  // beginning of the file.
+  bool probe_recodable() {
+    bool recodable;
+    {
+      av_decoder<compressor> d(this);
+      recodable = d.probe_recodable();
+    }
+    read_offset = 0;
+    return recodable;
+  }
+
+  // Locates the top-level moov box, if the input is an MP4 file.
+  void find_moov() {
+    size_t pos = 0;
+    while (original_size - pos >= 8) {
+      const uint8_t *header = &original_bytes[pos];
+      uint64_t size = uint64_t(header[0]) << 24 | header[1] << 16 | header[2] << 8 | header[3];
+      if (size == 1 && original_size - pos >= 16) {
+        size = 0;
+        for (int i = 8; i < 16; i++) {
+          size = (size << 8) | header[i];
+        }
+      } else if (size == 0) {
+        size = original_size - pos;
+      }
+      if (size < 8 || size > original_size - pos) {
+        return;
+      }
+      if (memcmp(header + 4, "moov", 4) == 0) {
+        moov_offset = pos;
+        moov_size = size;
+        return;
+      }
+      pos += size;
+    }
+  }
+
+  void add_literal_block(const uint8_t *bytes, size_t size) {
+    size_t offset = bytes - original_bytes;
+    std::string coded_moov;
+    if (moov_size > 0 && offset <= moov_offset && moov_offset + moov_size <= offset + size &&
+        mp4_index::encode(&original_bytes[moov_offset], moov_size, &coded_moov)) {
+      // Split the literal around the moov.
+      size_t before = moov_offset - offset, after = offset + size - moov_offset - moov_size;
+      if (before > 0) {
+        add_literal_block(bytes, before);
+      }
+      Recoded::Block *block = new Recoded::Block;
+      block->set_size(moov_size);
+      block->set_mp4_moov(coded_moov);
+      block->set_crc32c(crc32c::of(&original_bytes[moov_offset], moov_size));
+      add_block(block);
+      if (after > 0) {
+        add_literal_block(bytes + size - after, after);
+      }
+      return;
+    }
+    Recoded::Block *block = new Recoded::Block;
+    if (opts.code_literals && literal_code::encode(bytes, size, &coded_literal)) {
+      block->set_size(size);
+      block->set_coded_literal(coded_literal);
+    } else {
+      block->set_literal(bytes, size);
+    }
+    block->set_crc32c(crc32c::of(bytes, size));
+    add_block(block);
+  }
+
+  // Finds the slice in the file, after the stream's previous coded block and
+  // within what the demuxer has read. Returns a block for the recoder to fill,
+  // or nullptr if the slice can't be recoded; it is then recorded as skipped.
+  // A block's bytes in the file are returned in *stored. Called from the
+  // streams' decoding threads.
+  Recoded::Block* find_coded_block(stream_state *stream, const uint8_t *buf, int size, const uint8_t **stored) {
+    std::lock_guard<std::mutex> lock(blocks_mutex);
+    size_t offset = find_unclaimed(stream->prev_coded_block_end, buf, size);
+    // The block is stored in the file with the size it has there, so the
+    // decompressor's surrogate keeps container offsets valid.
+    int stored_size = size;
+    std::string escapes;
+    if (offset == std::string::npos) {
+      // The slice was probably NAL-escaped: look for its escaped form.
+      std::string escaped = nal_escape(buf, size, &escapes);
+      if (!escapes.empty()) {
+        offset = find_unclaimed(stream->prev_coded_block_end, escaped.data(), escaped.size());
+        stored_size = escaped.size();
+      }
+    }
+    std::unique_ptr<Recoded::Block> block(new Recoded::Block);
+    if (offset != std::string::npos && stored_size >= SURROGATE_MARKER_BYTES) {
+      block->set_size(stored_size);
+      if (!escapes.empty()) {
+        block->set_nal_escapes(escapes);
+      }
+      block->set_length_parity(size & 1);
+      if (size > 1) {
+        block->set_last_byte(&(buf[size - 1]), 1);
+      }
+      claimed[offset] = offset + stored_size;
+      stream->prev_coded_block_end = offset + stored_size;
+      stream->has_coded_blocks = true;
+      *stored = &original_bytes[offset];
+      Recoded::Block *coded = block.get();
+      if (stream->checkpoint_pending) {
+        block->set_model_reset(true);
+        checkpoints[coded] = stream->checkpoint;
+        stream->checkpoint_pending = false;
+        stream->last_checkpoint_pos = stream->checkpoint.packet_pos();
+      }
+      add_found_block(offset, std::move(block));
+      return coded;  // Return a block for the recoder to fill.
+    } else {
+      // Can't recode this block, e.g. because it is too small for a
+      // surrogate marker. Place a skip marker in the block list, before
+      // the bytes of the slice.
+      block->set_skip_coded(true);
+      block->set_size(size);
+      add_found_block(stream->prev_coded_block_end, std::move(block));
+      return nullptr;  // Tell the recoder to ignore this block.
+    }
+  }
+
+  // Called with blocks_mutex held.
+  void add_found_block(size_t offset, std::unique_ptr<Recoded::Block> block) {
+    auto key = std::make_pair(offset, found_blocks.size());
+    if (journaling) {
+      found_order.push_back(key);
+    }
+    found_blocks[key] = std::move(block);
+  }
+
+  // Reads the journal up to its last snapshot. If the journal was written
+  // with these options and the input still begins with the bytes the
+  // snapshot saw, the blocks found before it are taken back, and the
+  // snapshot is returned in *resume. The journal is then cut after what was
+  // taken back, and opened to append to.
+  bool open_journal(Journal::Snapshot *resume) {
+    Journal::Header header;
+    header.set_coder_streams(opts.coder_streams);
+    header.set_raw_bypass(opts.raw_bypass);
+    header.set_checkpoint_interval(opts.checkpoint_interval);
+    header.set_verify(opts.verify);
+    header.set_parallel_streams(opts.parallel_streams);
+    header.set_slice_threads(opts.slice_threads);
+    std::vector<Journal::FoundBlock> found;
+    size_t found_before_snapshot = 0, valid_end = 0;
+    bool resuming = false, matches = true;
+    {
+      std::ifstream in(opts.journal, std::ios::binary);
+      int field;
+      std::string bytes;
+      size_t pos = 0;
+      while (matches && read_delimited(in, &field, &bytes, &pos)) {
+        if (valid_end == 0) {
+          Journal::Header written;
+          matches = field == 1 && written.ParseFromString(bytes) &&
+              written.coder_streams() == header.coder_streams() && written.raw_bypass() == header.raw_bypass() &&
+              written.has_checkpoint_interval() &&
+              written.checkpoint_interval() == header.checkpoint_interval() &&
+              written.verify() == header.verify() && written.parallel_streams() == header.parallel_streams() &&
+              written.slice_threads() == header.slice_threads();
+          valid_end = pos;
+        } else if (field == 2) {
+          found.emplace_back();
+          if (!found.back().ParseFromString(bytes)) break;
+        } else if (field == 3) {
+          if (!resume->ParseFromString(bytes)) break;
+          found_before_snapshot = found.size();
+          valid_end = pos;
+          resuming = true;
+        } else {
+          break;
+        }
+      }
+    }
+    if (resuming) {
+      matches = matches && resume->prefix_size() >= 0 && size_t(resume->prefix_size()) <= original_size &&
+          crc32c::of(original_bytes, resume->prefix_size()) == resume->prefix_crc32c();
+    }
+    if (!matches) {
+      std::cerr << "Warning: " << opts.journal << " doesn't match the input or options; compressing from the start."
+                << std::endl;
+      resuming = false;
+      valid_end = 0;
+    }
+
+    if (resuming) {
+      found.resize(found_before_snapshot);
+      std::lock_guard<std::mutex> lock(blocks_mutex);
+      for (Journal::FoundBlock& f : found) {
+        std::unique_ptr<Recoded::Block> block(f.release_block());
+        size_t offset = f.offset();
+        if (!block || offset + block->size() > size_t(resume->prefix_size())) {
+          throw std::runtime_error("Invalid journal.");
+        }
+        if (!block->skip_coded()) {
+          claimed[offset] = offset + block->size();
+        }
+        if (f.has_checkpoint()) {
+          checkpoints[block.get()] = f.checkpoint();
+        }
+        found_order.push_back(std::make_pair(offset, found_blocks.size()));
+        found_blocks[found_order.back()] = std::move(block);
+      }
+      journaled_blocks = found_order.size();
+      journal_prefix = resume->prefix_size();
+      journal_crc = resume->prefix_crc32c();
+    }
+
+    if (valid_end > 0 && truncate(opts.journal.c_str(), valid_end) != 0) {
+      throw std::runtime_error("Failed to truncate the journal: " + std::string(strerror(errno)));
+    }
+    journal.open(opts.journal, std::ios::binary | (valid_end > 0 ? std::ios::app : std::ios::trunc));
+    if (!journal) {
+      throw std::runtime_error("Failed to open the journal: " + opts.journal);
+    }
+    if (valid_end == 0) {
+      write_delimited(journal, 1, header);
+      journal.flush();
+    }
+    return resuming;
+  }
+
+  // Puts the stream back as the snapshot found it, once the decoder has
+  // seeked to its packet.
+  void restore(const Journal::Snapshot& snapshot) {
+    stream_state *s = stream(snapshot.stream());
+    s->model->restore(snapshot.model());
+    if (s->shadow) {
+      s->shadow->restore(snapshot.model());
+    }
+    s->prev_coded_block_end = snapshot.prev_coded_block_end();
+    s->has_coded_blocks = !claimed.empty();
+    s->last_checkpoint_pos = snapshot.last_checkpoint_pos();
+    s->checkpoint_pending = snapshot.has_pending_checkpoint();
+    if (s->checkpoint_pending) {
+      s->checkpoint = snapshot.pending_checkpoint();
+    }
+  }
+
+  // On the stream's decoding thread, before a keyframe packet: queues a
+  // snapshot of where the stream is, for write_snapshot to complete.
+  void queue_snapshot(stream_state *stream, const AVPacket& packet) {
+    last_snapshot = std::chrono::steady_clock::now();
+    journal_point point;
+    Journal::Snapshot& snapshot = point.snapshot;
+    snapshot.set_stream(stream->index);
+    snapshot.set_packet_pos(packet.pos);
+    snapshot.set_packet_dts(packet.dts);
+    snapshot.set_last_checkpoint_pos(stream->last_checkpoint_pos);
+    if (stream->checkpoint_pending) {
+      *snapshot.mutable_pending_checkpoint() = stream->checkpoint;
+    }
+    snapshot.set_prefix_size(read_offset);
+    {
+      std::lock_guard<std::mutex> lock(blocks_mutex);
+      snapshot.set_prev_coded_block_end(stream->prev_coded_block_end);
+      point.found = found_order.size();
+    }
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    journal_points.push_back(std::move(point));
+  }
+
+  // On the stream's consumer thread, once the blocks before the snapshot
+  // are recoded: writes them to the journal, then the snapshot with the
+  // model as they left it.
+  void write_snapshot(stream_state *stream) {
+    journal_point point;
+    {
+      std::lock_guard<std::mutex> lock(journal_mutex);
+      point = std::move(journal_points.front());
+      journal_points.pop_front();
+    }
+    std::vector<Journal::FoundBlock> found;
+    {
+      std::lock_guard<std::mutex> lock(blocks_mutex);
+      for (; journaled_blocks < point.found; journaled_blocks++) {
+        const auto& key = found_order[journaled_blocks];
+        const Recoded::Block *block = found_blocks[key].get();
+        found.emplace_back();
+        found.back().set_offset(key.first);
+        *found.back().mutable_block() = *block;
+        auto checkpoint = checkpoints.find(block);
+        if (checkpoint != checkpoints.end()) {
+          *found.back().mutable_checkpoint() = checkpoint->second;
+        }
+      }
+    }
+    for (const Journal::FoundBlock& f : found) {
+      write_delimited(journal, 2, f);
+    }
+
+    Journal::Snapshot& snapshot = point.snapshot;
+    snapshot.set_model(stream->model->snapshot());
+    // The decoder reads from before the packet again after a seek.
+    size_t prefix = std::max<size_t>(snapshot.prefix_size(), journal_prefix);
+    journal_crc = crc32c::extend(journal_crc, &original_bytes[journal_prefix], prefix - journal_prefix);
+    journal_prefix = prefix;
+    snapshot.set_prefix_size(prefix);
+    snapshot.set_prefix_crc32c(journal_crc);
+    write_delimited(journal, 3, snapshot);
+    if (!journal.flush()) {
+      throw std::runtime_error("Failed to write the journal: " + opts.journal);
+    }
+  }
+
+  // Returns the offset of the first copy of bytes from start that doesn't
+  // overlap a coded block, or npos.
+  size_t find_unclaimed(size_t start, const void *bytes, size_t size) {
+    size_t end = read_offset;
+    while (start < end) {
+      const uint8_t *found = static_cast<const uint8_t*>( memmem(
+          &original_bytes[start], end - start, bytes, size) );
+      if (!found) {
+        return std::string::npos;
+      }
+      size_t offset = found - original_bytes;
+      // Coded blocks don't overlap, so only the last one starting before
+      // the copy's end can overlap it.
+      auto block = claimed.lower_bound(offset + size);
+      if (block == claimed.begin() || (--block)->second <= offset) {
+        return offset;
+      }
+      start = block->second;
+    }
+    return std::string::npos;
+  }
+
+  // Takes a block for the output. Blocks are written out as they come, in
+  // the Recoded message's field 2, and indexed, except while sampling, when
+  // estimate reads them from out.
+  void add_block(Recoded::Block *block) {
+    auto checkpoint = checkpoints.find(block);
+    if (sampling) {
+      if (checkpoint != checkpoints.end()) {
+        checkpoints.erase(checkpoint);
+      }
+      out.mutable_block()->AddAllocated(block);
+      return;
+    }
+    std::unique_ptr<Recoded::Block> owned(block);
+    size_t extent = block->skip_coded() ? 0 : block->has_literal() ? block->literal().size() : block->size();
+    if (index.block_count() == 0 || checkpoint != checkpoints.end() ||
+        (extent > 0 && assembled_bytes >= last_indexed_offset + index_interval)) {
+      Recoded::Index::Entry *entry = index.add_entry();
+      if (checkpoint != checkpoints.end()) {
+        *entry = checkpoint->second;
+        checkpoints.erase(checkpoint);
+      }
+      entry->set_block(index.block_count());
+      entry->set_offset(assembled_bytes);
+      entry->set_position(written.compressed_bytes);
+      last_indexed_offset = assembled_bytes;
+    }
+    index.set_block_count(index.block_count() + 1);
+    assembled_bytes += extent;
+    written.payload_bytes += block->literal().size() + block->cabac().size() + block->bypass_bits().size() +
+        block->coded_literal().size() + block->mp4_moov().size();
+    write_field(2, *block);
+  }
+
+  // Ends the output with the index, and the position of the index in the
+  // last 9 bytes, as field 4 of the Recoded message.
+  void write_index() {
+    index.set_original_size(original_size);
+    uint64_t position = written.compressed_bytes;
+    write_field(3, index);
+    char trailer[9] = {char(4 << 3 | 1)};
+    for (int i = 0; i < 8; i++) {
+      trailer[1 + i] = char(position >> (8 * i));
+    }
+    out_stream.write(trailer, sizeof(trailer));
+    written.compressed_bytes += sizeof(trailer);
+  }
+
+  // Writes a length-delimited field of the Recoded message.
+  void write_field(int number, const ::google::protobuf::MessageLite& message) {
+    written.compressed_bytes += write_delimited(out_stream, number, message);
+  }
+
+  // Writes a length-delimited field, returning its size.
+  static size_t write_delimited(std::ostream& out, int number, const ::google::protobuf::MessageLite& message) {
+    std::string bytes = message.SerializeAsString();
+    std::string header(1, char(number << 3 | 2));
+    uint64_t length = bytes.size();
+    for (; length >= 0x80; length >>= 7) {
+      header += char(length | 0x80);
+    }
+    header += char(length);
+    out << header << bytes;
+    return header.size() + bytes.size();
+  }
+
+  // Reads a field written by write_delimited, adding its size to *pos.
+  // Returns false at the end, or at a field that was cut short.
+  static bool read_delimited(std::istream& in, int *number, std::string *bytes, size_t *pos) {
+    size_t size = 0;
+    auto read_varint = [&](uint64_t *value) {
+      *value = 0;
+      for (int shift = 0; shift < 64; shift += 7) {
+        int c = in.get();
+        if (c == EOF) return false;
+        size++;
+        *value |= uint64_t(c & 0x7f) << shift;
+        if (!(c & 0x80)) return true;
+      }
+      return false;
+    };
+    uint64_t tag, length;
+    if (!read_varint(&tag) || (tag & 7) != 2 || !read_varint(&length) || length > INT_MAX) {
+      return false;
+    }
+    bytes->resize(length);
+    if (!in.read(&(*bytes)[0], length)) {
+      return false;
+    }
+    *number = tag >> 3;
+    *pos += size + length;
+    return true;
+  }
+
+  // Moves the blocks found while decoding to the output in file order, with
+  // literal blocks for the bytes between coded blocks unless sampling.
+  void assemble_blocks() {
+    size_t end = 0;
+    for (auto& found : found_blocks) {
+      size_t offset = found.first.first;
+      Recoded::Block *block = found.second.release();
+      if (!block->skip_coded()) {
+        if (offset > end && !sampling) {
+          add_literal_block(&original_bytes[end], offset - end);
+        }
+        end = offset + block->size();
+        if (!sampling) {
+          block->set_crc32c(crc32c::of(&original_bytes[offset], block->size()));
+        }
+      }
+      add_block(block);
+    }
+    found_blocks.clear();
+    claimed.clear();
+    if (end < original_size && !sampling) {
+      add_literal_block(&original_bytes[end], original_size - end);
+    }
+  }
+
+  std::ostream& out_stream;
+  compressor_options opts;
+
+  const uint8_t *original_bytes;
+  size_t original_size;
+  // Written by the demuxing thread, read by the decoding threads.
+  std::atomic<size_t> read_offset{0};
+
+  h264_models& models;
+  // The metadata, and the blocks while sampling.
+  Recoded out;
+  compress_stats written;
+  // Reused between literal blocks.
+  std::string coded_literal;
+  size_t moov_offset = 0, moov_size = 0;
+  // Set by estimate, which recodes only some of the slices.
+  bool sampling = false;
+  // Built as the blocks are written. The original bytes of the blocks
+  // written so far, and of the last block indexed.
+  Recoded::Index index;
+  size_t assembled_bytes = 0, last_indexed_offset = 0;
+  static constexpr size_t index_interval = 1 << 20;
+
+  std::mutex blocks_mutex;
+  // Where streams opened after a reposition start searching. Guarded by
+  // blocks_mutex.
+  size_t search_start = 0;
+  // The blocks found by the hooks, by their offset in the file, and the
+  // byte ranges taken by the coded ones.
+  std::map<std::pair<size_t, size_t>, std::unique_ptr<Recoded::Block>> found_blocks;
+  std::map<size_t, size_t> claimed;
+  // Index entries of the blocks that restart their stream's model.
+  std::map<const Recoded::Block*, Recoded::Index::Entry> checkpoints;
+
+  // A snapshot queued by a stream's decoding thread, and the number of
+  // blocks found before it.
+  struct journal_point {
+    Journal::Snapshot snapshot;
+    size_t found = 0;
+  };
+  // With a journal: whether snapshots are taken, and when the last was.
+  // The keys of the found blocks in the order found, guarded by
+  // blocks_mutex, and how many are in the journal. The CRC-32C of the
+  // original's first journal_prefix bytes.
+  std::ofstream journal;
+  bool journaling = false;
+  std::chrono::steady_clock::time_point last_snapshot;
+  std::mutex journal_mutex;
+  std::deque<journal_point> journal_points;
+  std::vector<std::pair<size_t, size_t>> found_order;
+  size_t journaled_blocks = 0, journal_prefix = 0;
+  uint32_t journal_crc = 0;
+  // After the blocks, so that their recoders stop first.
+  std::map<int, std::unique_ptr<stream_state>> streams;
+};
+
+thread_local compressor::buffered_slice *compressor::current_slice = nullptr;
+
+
+// A serialized Recoded message, read in place. The metadata is parsed up
+// front and each block only when asked for, so the blocks are never all in
+// memory at once. With use_index, if the message ends with an index, only
+// the metadata and the index are read up front, and blocks are located
+// from the nearest index entry before them as they are asked for.
+class recoded_reader {
+ public:
+  recoded_reader(const uint8_t *data, size_t size, bool use_index = false) : data(data), size(size) {
+    if (use_index && read_index()) {
+      return;
+    }
+    for_each_field(data, size, [&](int field, size_t offset, size_t length) {
+      if (field == 1) {
+        Recoded::Metadata m;
+        if (!m.ParseFromArray(data + offset, length)) {
+          throw std::runtime_error("Invalid compressed data.");
         }
-        pop_queueing_symbols(ct);
-        model->coding_type = PIP_UNKNOWN;
+        meta.MergeFrom(m);
+      } else if (field == 2) {
+        blocks.push_back(span{offset, length, 0, 0});
       }
-    }
+    });
+    num_blocks = blocks.size();
+  }
 
-   private:
-    void push_queueing_symbols(CodingType ct) {
-      // Does not currently support nested queues.
-      assert (queueing_symbols == PIP_UNKNOWN);
-      assert (symbol_buffer.empty());
-      queueing_symbols = ct;
-    }
+  const Recoded::Metadata& metadata() const {
+    return meta;
+  }
+  int block_size() const {
+    return num_blocks;
+  }
+  // Whether the index was read, and locates blocks.
+  bool indexed() const {
+    return idx.has_original_size();
+  }
+  const Recoded::Index& index() const {
+    return idx;
+  }
 
-    void stop_queueing_symbols() {
-      assert (queueing_symbols != PIP_UNKNOWN);
-      queueing_symbols = PIP_UNKNOWN;
+  // Parses a block. May be called from any thread.
+  std::unique_ptr<Recoded::Block> block(int index) const {
+    span s = locate(index);
+    std::unique_ptr<Recoded::Block> block(new Recoded::Block);
+    if (!block->ParseFromArray(data + s.position, s.length)) {
+      throw std::runtime_error("Invalid compressed data.");
     }
+    return block;
+  }
 
-    void pop_queueing_symbols(CodingType ct) {
-        //std::cerr<< "FINISHED QUEUEING "<< symbol_buffer.size()<<std::endl;
-      if (ct == PIP_SIGNIFICANCE_MAP || ct == PIP_SIGNIFICANCE_EOB) {
-        if (model) {
-          model->reset_mb_significance_state_tracking();
-        }
-      }
-      for (auto &sym : symbol_buffer) {
-        sym.execute(encoder, model, out, encoder_out);
+  // Whether a block has a field, without parsing it.
+  bool block_has_field(int index, int number) const {
+    span s = locate(index);
+    bool found = false;
+    for_each_field(data + s.position, s.length, [&](int field, size_t, size_t) {
+      found = found || field == number;
+    });
+    return found;
+  }
+
+  // With the index: the block holding a byte of the original, and the
+  // offset its bytes start at. Skip blocks hold no bytes.
+  int block_at(uint64_t offset, uint64_t *start) const {
+    auto entry = std::upper_bound(idx.entry().begin(), idx.entry().end(), offset,
+        [](uint64_t offset, const Recoded::Index::Entry& e) { return offset < uint64_t(e.offset()); });
+    if (entry == idx.entry().begin() || offset >= uint64_t(idx.original_size())) {
+      throw std::runtime_error("Offset outside the original file.");
+    }
+    for (int index = (--entry)->block(); index < num_blocks; index++) {
+      span s = locate(index);
+      if (offset < s.offset + s.extent) {
+        *start = s.offset;
+        return index;
       }
-      symbol_buffer.clear();
     }
+    throw std::runtime_error("Invalid compressed data.");
+  }
 
-    Recoded::Block *out;
-    CABACContext ctx;
+ private:
+  // A block's field, and with the index, the bytes of the original it holds.
+  struct span {
+    size_t position, length;
+    uint64_t offset, extent;
+  };
 
-    compressor *c;
-    h264_model *model;
-    std::vector<uint8_t> encoder_out;
-    recoded_code::encoder<std::back_insert_iterator<std::vector<uint8_t>>, uint8_t> encoder{
-      std::back_inserter(encoder_out)};
+  span locate(int index) const {
+    if (index < 0 || index >= num_blocks) {
+      throw std::runtime_error("Invalid compressed data.");
+    }
+    if (!indexed()) {
+      return blocks[index];
+    }
+    std::lock_guard<std::mutex> lock(located_mutex);
+    auto found = located.upper_bound(index);
+    if (found == located.begin()) {
+      throw std::runtime_error("Invalid compressed data.");
+    }
+    --found;
+    // Each block's field follows the one before it, possibly after other
+    // fields.
+    for (int i = found->first; i < index; i++) {
+      const span& prev = found->second;
+      size_t position = prev.position + prev.length;
+      int field;
+      span next;
+      do {
+        next = field_at(position, &field);
+        position = next.position + next.length;
+      } while (field != 2);
+      next.offset = prev.offset + prev.extent;
+      next.extent = extent_of(next);
+      found = located.emplace_hint(std::next(found), i + 1, next);
+    }
+    return found->second;
+  }
 
-    CodingType queueing_symbols = PIP_UNKNOWN;
-    std::vector<h264_symbol> symbol_buffer;
-  };
-  h264_model *get_model() {
-    return &model;
+  // Reads the index located by the last 9 bytes, and the metadata, which
+  // comes first. Returns false for a message without an index.
+  bool read_index() {
+    if (size < 9 || data[size - 9] != (4 << 3 | 1)) {
+      return false;
+    }
+    uint64_t position = 0;
+    for (int i = 0; i < 8; i++) {
+      position |= uint64_t(data[size - 8 + i]) << (8 * i);
+    }
+    if (position >= size - 9) {
+      return false;
+    }
+    int field;
+    span index_field = field_at(position, &field);
+    if (field != 3 || index_field.position + index_field.length != size - 9) {
+      return false;
+    }
+    span metadata_field = field_at(0, &field);
+    if (field != 1 || !meta.ParseFromArray(data + metadata_field.position, metadata_field.length) ||
+        !idx.ParseFromArray(data + index_field.position, index_field.length) || !idx.has_original_size()) {
+      throw std::runtime_error("Invalid compressed data.");
+    }
+    num_blocks = idx.block_count();
+    for (const auto& entry : idx.entry()) {
+      span s = field_at(entry.position(), &field);
+      if (field != 2 || entry.block() < 0 || entry.block() >= num_blocks) {
+        throw std::runtime_error("Invalid compressed data.");
+      }
+      s.offset = entry.offset();
+      s.extent = extent_of(s);
+      located[entry.block()] = s;
+    }
+    return true;
   }
 
- private:
+  // The length-delimited field whose tag is at position.
+  span field_at(size_t position, int *field) const {
+    if (position >= size) {
+      throw std::runtime_error("Invalid compressed data.");
+    }
+    size_t pos = position;
+    uint64_t tag = read_varint(data, size, &pos);
+    if ((tag & 7) != 2) {
+      throw std::runtime_error("Invalid compressed data.");
+    }
+    uint64_t length = read_varint(data, size, &pos);
+    if (length > size - pos) {
+      throw std::runtime_error("Invalid compressed data.");
+    }
+    *field = tag >> 3;
+    return span{pos, size_t(length), 0, 0};
+  }
 
-  Recoded::Block* find_next_coded_block_and_emit_literal(const uint8_t *buf, int size) {
-    uint8_t *found = static_cast<uint8_t*>( memmem(
-        &original_bytes[prev_coded_block_end], read_offset - prev_coded_block_end,
-        buf, size) );
-    if (found && size >= SURROGATE_MARKER_BYTES) {
-      size_t gap = found - &original_bytes[prev_coded_block_end];
-      out.add_block()->set_literal(&original_bytes[prev_coded_block_end], gap);
-      prev_coded_block_end += gap + size;
-      Recoded::Block *newBlock = out.add_block();
-      newBlock->set_length_parity(size & 1);
-      if (size > 1) {
-        newBlock->set_last_byte(&(buf[size - 1]), 1);
+  // The bytes of the original a block holds, from its size and literal
+  // fields.
+  uint64_t extent_of(const span& s) const {
+    uint64_t extent = 0;
+    bool skip = false;
+    for (size_t pos = 0; pos < s.length; ) {
+      uint64_t tag = read_varint(data + s.position, s.length, &pos);
+      if (tag == (1 << 3 | 0) || tag == (3 << 3 | 0)) {
+        uint64_t value = read_varint(data + s.position, s.length, &pos);
+        if (tag >> 3 == 1) {
+          extent = value;
+        } else {
+          skip = value != 0;
+        }
+        continue;
       }
-      return newBlock;  // Return a block for the recoder to fill.
-    } else {
-      // Can't recode this block, probably because it was NAL-escaped. Place
-      // a skip marker in the block list.
-      Recoded::Block* block = out.add_block();
-      block->set_skip_coded(true);
-      block->set_size(size);
-      return nullptr;  // Tell the recoder to ignore this block.
+      uint64_t length;
+      switch (tag & 7) {
+        case 0: read_varint(data + s.position, s.length, &pos); length = 0; break;
+        case 1: length = 8; break;
+        case 2: length = read_varint(data + s.position, s.length, &pos); break;
+        case 5: length = 4; break;
+        default: throw std::runtime_error("Invalid compressed data.");
+      }
+      if (length > s.length - pos) {
+        throw std::runtime_error("Invalid compressed data.");
+      }
+      if (tag == (2 << 3 | 2)) {
+        return length;
+      }
+      pos += length;
     }
+    return skip ? 0 : extent;
   }
 
-  std::string input_filename;
-  std::ostream& out_stream;
+  static uint64_t read_varint(const uint8_t *p, size_t size, size_t *pos) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (*pos >= size) break;
+      uint8_t byte = p[(*pos)++];
+      value |= uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) return value;
+    }
+    throw std::runtime_error("Invalid compressed data.");
+  }
 
-  uint8_t *original_bytes = nullptr;
-  size_t original_size = 0;
-  int read_offset = 0;
-  int prev_coded_block_end = 0;
+  // Calls f(field, offset, length) for each length-delimited field of a
+  // message, and skips the others.
+  template <typename F>
+  static void for_each_field(const uint8_t *p, size_t size, F f) {
+    size_t pos = 0;
+    while (pos < size) {
+      uint64_t tag = read_varint(p, size, &pos);
+      uint64_t length = 0;
+      switch (tag & 7) {
+        case 0: read_varint(p, size, &pos); break;
+        case 1: length = 8; break;
+        case 2: length = read_varint(p, size, &pos); break;
+        case 5: length = 4; break;
+        default: throw std::runtime_error("Invalid compressed data.");
+      }
+      if (length > size - pos) {
+        throw std::runtime_error("Invalid compressed data.");
+      }
+      if ((tag & 7) == 2) {
+        f(int(tag >> 3), pos, length);
+      }
+      pos += length;
+    }
+  }
 
-  h264_model model;
-  Recoded out;
+  const uint8_t *data;
+  size_t size;
+  Recoded::Metadata meta;
+  Recoded::Index idx;
+  int num_blocks = 0;
+  // Without the index: every block.
+  std::vector<span> blocks;
+  // With the index: the blocks of the index entries, and those located
+  // from them so far.
+  mutable std::mutex located_mutex;
+  mutable std::map<int, span> located;
 };
 
 
 class decompressor {
   // Used to track the decoding state of each block.
   struct block_state {
-    bool coded = false;
     std::string surrogate_marker;
     std::string out_bytes;
-    bool done = false;
+    // Set once out_bytes is complete, possibly on another thread.
+    std::atomic<bool> done{false};
+    int64_t size = 0;
     int8_t length_parity = -1;
     uint8_t last_byte;
+    std::string nal_escapes;
+    bool has_crc32c = false;
+    uint32_t crc32c = 0;
   };
 
  public:
-  decompressor(const std::string& input_filename, std::ostream& out_stream)
-    : input_filename(input_filename), out_stream(out_stream) {
-    uint8_t *bytes;
-    size_t size;
-    if (av_file_map(input_filename.c_str(), &bytes, &size, 0, NULL) < 0) {
-      throw std::invalid_argument("Failed to open file: " + input_filename);
+  decompressor(const uint8_t *in_bytes, size_t in_size, std::ostream& out_stream, h264_models& models,
+      const decompressor_options& opts = decompressor_options())
+    : out_stream(out_stream), opts(opts),
+      in(in_bytes, in_size, opts.range_start != 0 || opts.range_end != UINT64_MAX), models(models) {}
+
+  void run() {
+    if (in.indexed()) {
+      run_range();
+      return;
+    }
+    window_end = in.block_size();
+    blocks.reset(new block_state[window_end]);
+
+    if (has_cabac_blocks()) {
+      av_decoder<decompressor> d(this);
+      d.decode_video(opts.parallel_streams);
+      for (auto& stream : streams) {
+        stream.second->pipeline.finish();
+      }
+    } else {
+      // Nothing to re-encode, e.g. a passthrough archive: just read out the
+      // literal blocks without demuxing.
+      uint8_t buffer[1 << 16];
+      while (read_packet(buffer, sizeof(buffer)) > 0) {}
+    }
+
+    flush_blocks();
+    if (flushed_blocks != in.block_size()) {
+      throw std::runtime_error("Not all blocks were decoded.");
+    }
+    if (in.metadata().has_crc32c() && crc != in.metadata().crc32c()) {
+      throw std::runtime_error("The restored file fails its checksum.");
     }
-    in.ParseFromArray(bytes, size);
-  }
-  decompressor(const std::string& input_filename, const std::string& in_bytes, std::ostream& out_stream)
-    : input_filename(input_filename), out_stream(out_stream) {
-    in.ParseFromString(in_bytes);
   }
 
-  void run() {
-    blocks.clear();
-    blocks.resize(in.block_size());
+  // Restores just the requested range: the blocks holding its bytes, and
+  // the coded blocks from the last checkpoint before the first of them,
+  // where the model restarts. Without such a checkpoint the video is decoded
+  // from the start.
+  void run_range() {
+    const Recoded::Index& index = in.index();
+    uint64_t end = std::min<uint64_t>(opts.range_end, index.original_size());
+    if (opts.range_start >= end) {
+      return;
+    }
+    uint64_t first_offset, last_offset;
+    int first = in.block_at(opts.range_start, &first_offset);
+    int last = in.block_at(end - 1, &last_offset);
+    int first_coded = -1;
+    for (int i = first; i <= last && first_coded < 0; i++) {
+      if (in.block_has_field(i, Recoded::Block::kCabacFieldNumber)) {
+        first_coded = i;
+      }
+    }
+    const Recoded::Index::Entry *checkpoint = nullptr;
+    for (const auto& entry : index.entry()) {
+      if (first_coded < 0 || entry.block() > first_coded) break;
+      if (entry.has_packet_pos()) {
+        checkpoint = &entry;
+      }
+    }
 
-    av_decoder<decompressor> d(this, input_filename);
-    d.decode_video();
+    std::unique_ptr<av_decoder<decompressor>> d;
+    if (first_coded >= 0) {
+      d.reset(new av_decoder<decompressor>(this, true));
+      if (checkpoint && !d->seek_to_packet(checkpoint->stream(), checkpoint->packet_dts(),
+                                           checkpoint->packet_pos())) {
+        checkpoint = nullptr;
+        d.reset();
+        seek(0, SEEK_SET);
+        d.reset(new av_decoder<decompressor>(this, true));
+      }
+    }
+    window_start = checkpoint ? std::min<int>(first, checkpoint->block()) : first_coded >= 0 ? 0 : first;
+    window_end = last + 1;
+    flushed_blocks = window_start;
+    flushed_bytes = window_start == first ? first_offset : checkpoint ? checkpoint->offset() : 0;
 
-    for (auto& block : blocks) {
-      if (!block.done) throw std::runtime_error("Not all blocks were decoded.");
-      if (block.length_parity != -1) {
-        // Correct for x264 padding: replace last byte or add an extra byte.
-        if (block.length_parity != (int)(block.out_bytes.size() & 1)) {
-          block.out_bytes.insert(block.out_bytes.end(), block.last_byte);
-        } else {
-          block.out_bytes[block.out_bytes.size() - 1] = block.last_byte;
-        }
+    if (d) {
+      d->decode_video(opts.parallel_streams);
+      for (auto& stream : streams) {
+        stream.second->pipeline.finish();
       }
-      out_stream << block.out_bytes;
     }
+    flush_blocks();
+    if (flushed_blocks != window_end) {
+      throw std::runtime_error("Not all blocks were decoded.");
+    }
+  }
+
+  // Progress of the output, for reporting where decompression failed.
+  int blocks_written() const {
+    return flushed_blocks;
+  }
+  size_t bytes_written() const {
+    return flushed_bytes;
   }
 
   int read_packet(uint8_t *buffer_out, int size) {
+    flush_blocks();
     uint8_t *p = buffer_out;
     while (size > 0 && read_index < in.block_size()) {
       if (read_block.empty()) {
-        const Recoded::Block& block = in.block(read_index);
-        if (int(block.has_literal()) + int(block.has_cabac()) + int(block.has_skip_coded()) != 1) {
-          throw std::runtime_error("Invalid input block: must have exactly one type");
-        }
-        if (block.has_literal()) {
-          // This block is passed through without any re-coding.
-          blocks[read_index].out_bytes = block.literal();
-          blocks[read_index].done = true;
-          read_block = block.literal();
-        } else if (block.has_cabac()) {
-          // Re-coded CABAC coded block. out_bytes will be filled by cabac_decoder.
-          blocks[read_index].coded = true;
-          blocks[read_index].surrogate_marker = next_surrogate_marker();
-          blocks[read_index].done = false;
-          if (!block.has_size()) {
-            throw std::runtime_error("CABAC block requires size field.");
-          }
-          if (block.has_length_parity() && block.has_last_byte() &&
-              !block.last_byte().empty()) {
-            blocks[read_index].length_parity = block.length_parity();
-            blocks[read_index].last_byte = block.last_byte()[0];
-          }
-          read_block = make_surrogate_block(blocks[read_index].surrogate_marker, block.size());
-        } else if (block.has_skip_coded() && block.skip_coded()) {
-          // Non-re-coded CABAC coded block. The bytes of this block are
-          // emitted in a literal block following this one. This block is
-          // a flag to expect a cabac_decoder without a surrogate marker.
-          blocks[read_index].coded = true;
-          blocks[read_index].done = true;
-        } else {
-          throw std::runtime_error("Unknown input block type");
-        }
+        read_block = stream_bytes(read_index);
       }
       if ((size_t)read_offset < read_block.size()) {
         int n = read_block.copy(reinterpret_cast<char*>(p), size, read_offset);
@@ -1405,70 +2584,138 @@ class decompressor {
         read_index++;
       }
     }
+    read_position += p - buffer_out;
     return p - buffer_out;
   }
 
+  int64_t seek(int64_t offset, int whence) {
+    // Without the index the surrogate stream can only be read sequentially.
+    if (!in.indexed()) {
+      return -1;
+    }
+    int64_t size = in.index().original_size();
+    switch (whence & ~AVSEEK_FORCE) {
+      case AVSEEK_SIZE: return size;
+      case SEEK_SET: break;
+      case SEEK_CUR: offset += read_position; break;
+      case SEEK_END: offset += size; break;
+      default: return -1;
+    }
+    if (offset < 0 || offset > size) {
+      return -1;
+    }
+    read_block.clear();
+    read_offset = 0;
+    read_index = in.block_size();
+    if (offset < size) {
+      uint64_t start;
+      read_index = in.block_at(offset, &start);
+      read_block = stream_bytes(read_index);
+      read_offset = offset - start;
+    }
+    read_position = offset;
+    return offset;
+  }
+
+  // In range decoding, once the blocks of the range are written.
+  bool finished() {
+    if (!in.indexed()) {
+      return false;
+    }
+    flush_blocks();
+    return flushed_blocks >= window_end;
+  }
+
+  // Each recoded bin is decoded with the model as left by all the bins
+  // before it, including those of earlier slices, so slices can't be parsed
+  // in parallel.
+  int slice_threads() const {
+    return 1;
+  }
+
+  struct stream_state;
+
+  // Called by av_decoder, on the demuxing thread, when it opens the stream.
+  stream_state* stream(int index) {
+    std::unique_ptr<stream_state>& stream = streams[index];
+    if (!stream) {
+      stream.reset(new stream_state(&models[index], opts.pipeline));
+    }
+    return stream.get();
+  }
+
+  // Decodes the recoded bins of a block for libavcodec, and passes them on
+  // to be re-encoded with CABAC.
   class cabac_decoder {
    public:
-    cabac_decoder(decompressor *d, CABACContext *ctx_in, const uint8_t *buf, int size) {
+    cabac_decoder(decompressor *d, stream_state *stream, CABACContext *ctx_in, const uint8_t *buf, int size)
+      : stream(stream), states(h264_model::slice_cabac_states(ctx_in)) {
       index = d->recognize_coded_block(buf, size);
-      block = &d->in.block(index);
-      out = &d->blocks[index];
       model = nullptr;
-
-      if (block->has_cabac()) {
-        model = &d->model;
-        model->reset();
-        decoder.reset(new recoded_code::decoder<const char*, uint8_t>(
-            block->cabac().data(), block->cabac().data() + block->cabac().size()));
-      } else if (block->has_skip_coded() && block->skip_coded()) {
+      if (index < 0) {
         // We're skipping this block, so disable calls to our hooks.
         ctx_in->coding_hooks = nullptr;
         ctx_in->coding_hooks_opaque = nullptr;
         ::ff_reset_cabac_decoder(ctx_in, buf, size);
+        finished = true;
+        return;
+      }
+      block = d->in.block(index);
+      if (block->has_cabac()) {
+        model = stream->model;
+        if (block->model_reset()) {
+          model->restart();
+        }
+        model->reset();
+        decoder = interleaved_recoded_code::decoder<char>(
+            block->cabac().data(), block->cabac().data() + block->cabac().size(),
+            d->in.metadata().coder_streams());
+        if (block->has_bypass_bits()) {
+          bypass_bits = raw_bit_reader(block->bypass_bits());
+        }
+        stream->pipeline.emit(cabac_event::begin_block(&d->state(index), block->size()));
       } else {
         throw std::runtime_error("Expected CABAC block.");
       }
     }
-    ~cabac_decoder() { assert(out->done); }
+    ~cabac_decoder() { assert(finished); }
 
     int get(uint8_t *state) {
-     int symbol;
+      const void *context = model->cabac_state(h264_model::cabac_state_offset(states, state));
+      int symbol;
       if (model->coding_type == PIP_SIGNIFICANCE_EOB) {
-          symbol = std::get<1>(model->get_model_key(state));
+          symbol = std::get<1>(model->get_model_key(context));
       } else {
-        symbol = decoder->get([&](range_t range){
-           return model->probability_for_state(range, state); });
+        symbol = decoder.get([&](range_t range){
+           return model->probability_for_state(range, context); });
       }
-      size_t billable_bytes = cabac_encoder.put(symbol, state);
-      if (billable_bytes) {
-          model->billable_cabac_bytes(billable_bytes);
-      }
-      model->update_state(symbol, state);
+      // The encoder gets the state from before this symbol.
+      stream->pipeline.emit(cabac_event::bin(cabac_event::SYMBOL, symbol, model->coding_type, *state));
+      cabac::update_state(symbol, state);
+      model->update_state(symbol, context);
       return symbol;
     }
 
     int get_bypass() {
-      int symbol = decoder->get([&](range_t range){
-          return model->probability_for_state(range, &model->bypass_context); });
-      model->update_state(symbol, &model->bypass_context);
-      size_t billable_bytes = cabac_encoder.put_bypass(symbol);
-      if (billable_bytes) {
-          model->billable_cabac_bytes(billable_bytes);
+      int symbol;
+      if (block->has_bypass_bits()) {
+        symbol = bypass_bits.get();
+      } else {
+        symbol = decoder.get([&](range_t range){
+            return model->probability_for_state(range, &model->bypass_context); });
+        model->update_state(symbol, &model->bypass_context);
       }
+      stream->pipeline.emit(cabac_event::bin(cabac_event::BYPASS, symbol, model->coding_type));
       return symbol;
     }
 
     int get_terminate() {
-      int symbol = decoder->get([&](range_t range){
+      int symbol = decoder.get([&](range_t range){
           return model->probability_for_state(range, &model->terminate_context); });
       model->update_state(symbol, &model->terminate_context);
-      size_t billable_bytes = cabac_encoder.put_terminate(symbol);
-      if (billable_bytes) {
-          model->billable_cabac_bytes(billable_bytes);
-      }
+      stream->pipeline.emit(cabac_event::bin(cabac_event::TERMINATE, symbol, model->coding_type));
       if (symbol) {
-        finish();
+        finished = true;
       }
       return symbol;
     }
@@ -1479,15 +2726,11 @@ class decompressor {
       if (begin_queue && ct) {
         model->finished_queueing(ct,
               [&](model_key key, int * symbol) {
-               *symbol = decoder->get([&](range_t range){
+               *symbol = decoder.get([&](range_t range){
                    return model->probability_for_model_key(range, key);
                });
                model->update_state_for_model_key(*symbol, key);
             });
-        static int i = 0;
-        if (i++ < 10) {
-          std::cerr << "FINISHED QUEUING RECODE: " << (int)model->frames[model->cur_frame].meta_at(model->mb_coord.mb_x, model->mb_coord.mb_y).num_nonzeros[model->mb_coord.scan8_index] << std::endl;
-        }
       }
     }
     void end_coding_type(CodingType ct) {
@@ -1497,6 +2740,83 @@ class decompressor {
       model->end_coding_type(ct);
     }
 
+   private:
+    stream_state *stream;
+    // The slice context's CABAC states, which follow its CABACContext.
+    const uint8_t *states;
+    int index;
+    // Parsed for this decoder, whose decoder reads from it.
+    std::unique_ptr<Recoded::Block> block;
+    bool finished = false;
+
+    h264_model *model;
+    interleaved_recoded_code::decoder<char> decoder;
+    raw_bit_reader bypass_bits;
+  };
+
+ private:
+  // A bin for the CABAC encoder, with the context state it is coded in.
+  struct cabac_event {
+    enum kind_t : uint8_t { BEGIN_BLOCK, SYMBOL, BYPASS, TERMINATE, END_OF_STREAM };
+    kind_t kind;
+    int8_t symbol;
+    uint8_t state;
+    // Billed for the bytes the symbol completes.
+    uint8_t coding_type;
+    block_state *block;
+    int size;
+
+    static cabac_event begin_block(block_state *block, int size) {
+      cabac_event e;
+      e.kind = BEGIN_BLOCK;
+      e.block = block;
+      e.size = size;
+      return e;
+    }
+    static cabac_event bin(kind_t kind, int symbol, CodingType coding_type, uint8_t state = 0) {
+      cabac_event e;
+      e.kind = kind;
+      e.symbol = symbol;
+      e.coding_type = coding_type;
+      e.state = state;
+      return e;
+    }
+  };
+
+  // Re-encodes the bins of one block with CABAC, on the consumer thread if
+  // pipelined.
+  class block_encoder {
+   public:
+    block_encoder(block_state *out, h264_model *model, int size) : out(out), model(model) {
+      // Room for the original bytes plus a trailing stop bit byte.
+      cabac_out.reserve(size + 1);
+    }
+
+    void put(const cabac_event& e) {
+      size_t billable_bytes = 0;
+      switch (e.kind) {
+        case cabac_event::SYMBOL: {
+          uint8_t state = e.state;
+          billable_bytes = cabac_encoder.put(e.symbol, &state);
+          break;
+        }
+        case cabac_event::BYPASS:
+          billable_bytes = cabac_encoder.put_bypass(e.symbol);
+          break;
+        case cabac_event::TERMINATE:
+          billable_bytes = cabac_encoder.put_terminate(e.symbol);
+          if (e.symbol) {
+            finish();
+          }
+          break;
+        default:
+          break;
+      }
+      if (billable_bytes) {
+        model->billable_cabac_bytes(billable_bytes, CodingType(e.coding_type));
+      }
+    }
+
    private:
     void finish() {
       // Omit trailing byte if it's only a stop bit.
@@ -1507,25 +2827,210 @@ class decompressor {
       out->done = true;
     }
 
-    int index;
-    const Recoded::Block *block;
-    block_state *out = nullptr;
-
+    block_state *out;
     h264_model *model;
-    std::unique_ptr<recoded_code::decoder<const char*, uint8_t>> decoder;
-
     std::vector<uint8_t> cabac_out;
     cabac::encoder<std::back_insert_iterator<std::vector<uint8_t>>> cabac_encoder{
       std::back_inserter(cabac_out)};
   };
-  h264_model *get_model() {
-    return &model;
-  }
+
+ public:
+  // A video stream: its model, and the CABAC encoder of its current block.
+  struct stream_state {
+    stream_state(h264_model *model, bool pipelined)
+      : model(model), pipeline(this, pipelined) {}
+
+    void frame_spec(int frame_num, int mb_width, int mb_height) {
+      model->frame_spec(frame_num, mb_width, mb_height);
+    }
+    void mb_xy(int x, int y) {
+      model->mb_xy(x, y);
+    }
+    void begin_sub_mb(int cat, int scan8index, int max_coeff, int is_dc, int chroma422) {
+      model->begin_sub_mb(cat, scan8index, max_coeff, is_dc, chroma422);
+    }
+    void end_sub_mb(int cat, int scan8index, int max_coeff, int is_dc, int chroma422) {
+      model->end_sub_mb(cat, scan8index, max_coeff, is_dc, chroma422);
+    }
+    void begin_packet(const AVPacket&) {}
+    void packet_decoded() {}
+
+    void apply(const cabac_event& e) {
+      switch (e.kind) {
+        case cabac_event::BEGIN_BLOCK:
+          encoder.reset(new block_encoder(e.block, model, e.size));
+          break;
+        case cabac_event::END_OF_STREAM:
+          encoder.reset();
+          break;
+        default:
+          encoder->put(e);
+          break;
+      }
+    }
+
+    h264_model *model;
+    // Re-encoder of the current block. Blocks are only marked done by it.
+    std::unique_ptr<block_encoder> encoder;
+    // Last, so the consumer stops before the rest is destroyed.
+    event_pipeline<stream_state, cabac_event> pipeline;
+  };
 
  private:
+  // Writes out the blocks that are done, in order, checking each against its
+  // checksum and then releasing it. Called on the demuxing thread.
+  void flush_blocks() {
+    while (flushed_blocks < window_end) {
+      block_state *block;
+      std::unique_ptr<block_state> restored;
+      if (blocks) {
+        block = &blocks[flushed_blocks];
+        if (!block->done) break;
+      } else if (in.block_has_field(flushed_blocks, Recoded::Block::kCabacFieldNumber)) {
+        std::lock_guard<std::mutex> lock(coded_blocks_mutex);
+        auto coded = range_blocks.find(flushed_blocks);
+        if (coded == range_blocks.end() || !coded->second.done) break;
+        block = &coded->second;
+      } else {
+        // In range decoding, the other blocks are restored here.
+        restored.reset(new block_state);
+        std::unique_ptr<Recoded::Block> parsed = in.block(flushed_blocks);
+        restored->out_bytes = literal_bytes(*parsed);
+        restored->has_crc32c = parsed->has_crc32c();
+        restored->crc32c = parsed->crc32c();
+        block = restored.get();
+      }
+      if (block->length_parity != -1) {
+        // Correct for x264 padding: replace last byte or add an extra byte.
+        if (block->length_parity != (int)(block->out_bytes.size() & 1)) {
+          block->out_bytes.insert(block->out_bytes.end(), block->last_byte);
+        } else {
+          block->out_bytes[block->out_bytes.size() - 1] = block->last_byte;
+        }
+      }
+      if (!block->nal_escapes.empty()) {
+        block->out_bytes = nal_apply_escapes(block->out_bytes, block->nal_escapes);
+      }
+      if (block->has_crc32c && crc32c::of(block->out_bytes.data(), block->out_bytes.size()) != block->crc32c) {
+        throw std::runtime_error("Block " + std::to_string(flushed_blocks) + ", at byte " +
+                                 std::to_string(flushed_bytes) + " of the original, fails its checksum.");
+      }
+      crc = crc32c::extend(crc, block->out_bytes.data(), block->out_bytes.size());
+      write_output(block->out_bytes);
+      flushed_bytes += block->out_bytes.size();
+      if (blocks) {
+        std::string().swap(block->out_bytes);
+      } else if (!restored) {
+        std::lock_guard<std::mutex> lock(coded_blocks_mutex);
+        range_blocks.erase(flushed_blocks);
+      }
+      flushed_blocks++;
+    }
+  }
+
+  // Writes the part of a block's bytes that is in the requested range.
+  void write_output(const std::string& bytes) {
+    uint64_t begin = std::max<uint64_t>(flushed_bytes, opts.range_start);
+    uint64_t end = std::min<uint64_t>(flushed_bytes + bytes.size(), opts.range_end);
+    if (begin < end) {
+      out_stream.write(bytes.data() + (begin - flushed_bytes), end - begin);
+    }
+  }
+
+  bool has_cabac_blocks() const {
+    for (int i = 0; i < in.block_size(); i++) {
+      if (in.block_has_field(i, Recoded::Block::kCabacFieldNumber)) return true;
+    }
+    return false;
+  }
+
+  // The bytes of the original in a block that isn't coded.
+  static std::string literal_bytes(const Recoded::Block& block) {
+    if (int(block.has_literal()) + int(block.has_cabac()) + int(block.has_skip_coded()) +
+        int(block.has_coded_literal()) + int(block.has_mp4_moov()) != 1) {
+      throw std::runtime_error("Invalid input block: must have exactly one type");
+    }
+    if (block.has_literal()) {
+      // This block is passed through without any re-coding.
+      return block.literal();
+    } else if (block.has_coded_literal()) {
+      if (!block.has_size()) {
+        throw std::runtime_error("Coded literal block requires size field.");
+      }
+      return literal_code::decode(block.coded_literal(), block.size());
+    } else if (block.has_mp4_moov()) {
+      std::string bytes = mp4_index::decode(block.mp4_moov());
+      if (!block.has_size() || bytes.size() != size_t(block.size())) {
+        throw std::runtime_error("Invalid mp4 index block size.");
+      }
+      return bytes;
+    } else if (block.has_skip_coded() && block.skip_coded()) {
+      // Non-re-coded CABAC coded block. The bytes of this block are
+      // emitted in a literal block following this one.
+      return std::string();
+    }
+    throw std::runtime_error("Unknown input block type");
+  }
+
+  // Returns the bytes the demuxer reads for a block. A coded block is read
+  // as a surrogate, and recorded for recognize_coded_block; a skip block is
+  // a flag to expect a cabac_decoder without a surrogate marker.
+  std::string stream_bytes(int index) {
+    std::unique_ptr<Recoded::Block> parsed = in.block(index);
+    const Recoded::Block& block = *parsed;
+    if (block.has_cabac()) {
+      // Re-coded CABAC coded block. out_bytes will be filled by cabac_decoder.
+      if (block.has_literal() || block.has_skip_coded() || block.has_coded_literal() || block.has_mp4_moov()) {
+        throw std::runtime_error("Invalid input block: must have exactly one type");
+      }
+      if (!block.has_size()) {
+        throw std::runtime_error("CABAC block requires size field.");
+      }
+      std::lock_guard<std::mutex> lock(coded_blocks_mutex);
+      block_state& state = state_locked(index);
+      if (state.surrogate_marker.empty()) {
+        state.surrogate_marker = surrogate_marker(index);
+        state.size = block.size();
+        state.has_crc32c = block.has_crc32c();
+        state.crc32c = block.crc32c();
+        if (block.has_length_parity() && block.has_last_byte() &&
+            !block.last_byte().empty()) {
+          state.length_parity = block.length_parity();
+          state.last_byte = block.last_byte()[0];
+        }
+        state.nal_escapes = block.nal_escapes();
+        coded_blocks[state.surrogate_marker] = index;
+      }
+      return make_surrogate_block(state.surrogate_marker, block.size());
+    }
+    std::string bytes = literal_bytes(block);
+    if (block.has_skip_coded()) {
+      std::lock_guard<std::mutex> lock(coded_blocks_mutex);
+      skipped_block_sizes.insert(block.size());
+    }
+    if (blocks) {
+      blocks[index].size = block.size();
+      blocks[index].has_crc32c = block.has_crc32c();
+      blocks[index].crc32c = block.crc32c();
+      blocks[index].out_bytes = bytes;
+      blocks[index].done = true;
+    }
+    return bytes;
+  }
+
+  // The state of a coded block: in full decoding every block has one, and
+  // in range decoding the coded blocks the demuxer has read.
+  block_state& state(int index) {
+    std::lock_guard<std::mutex> lock(coded_blocks_mutex);
+    return state_locked(index);
+  }
+  block_state& state_locked(int index) {
+    return blocks ? blocks[index] : range_blocks[index];
+  }
+
   // Return a unique 8-byte string containing no zero bytes (NAL-encoding-safe).
-  std::string next_surrogate_marker() {
-    uint64_t n = surrogate_marker_sequence_number++;
+  static std::string surrogate_marker(int index) {
+    uint64_t n = uint64_t(index) + 1;
     std::string surrogate_marker(SURROGATE_MARKER_BYTES, '\x01');
     for (int i = 0; i < (int)surrogate_marker.size(); i++) {
       surrogate_marker[i] = (n % 255) + 1;
@@ -1543,117 +3048,195 @@ class decompressor {
     return surrogate_block;
   }
 
+  // Returns the index of the coded block whose surrogate starts buf, or -1
+  // for a block the compressor skipped. Called from the streams' decoding
+  // threads, after read_packet has produced the block.
   int recognize_coded_block(const uint8_t* buf, int size) {
-    while (!blocks[next_coded_block].coded) {
-      if (next_coded_block >= read_index) {
-        throw std::runtime_error("Coded block expected, but not recorded in the compressed data.");
+    std::lock_guard<std::mutex> lock(coded_blocks_mutex);
+    if (size >= SURROGATE_MARKER_BYTES) {
+      auto coded = coded_blocks.find(std::string(reinterpret_cast<const char*>(buf), SURROGATE_MARKER_BYTES));
+      // A skipped slice could start with the same bytes as a marker.
+      if (coded != coded_blocks.end() && state_locked(coded->second).size == size) {
+        int index = coded->second;
+        coded_blocks.erase(coded);
+        return index;
       }
-      next_coded_block++;
     }
-    int index = next_coded_block++;
-    // Validate the decoder init call against the coded block's size and surrogate marker.
-    const Recoded::Block& block = in.block(index);
-    if (block.has_cabac()) {
-      if (block.size() != size) {
-        throw std::runtime_error("Invalid surrogate block size.");
-      }
-      std::string buf_header(reinterpret_cast<const char*>(buf),
-          blocks[index].surrogate_marker.size());
-      if (blocks[index].surrogate_marker != buf_header) {
-        throw std::runtime_error("Invalid surrogate marker in coded block.");
-      }
-    } else if (block.has_skip_coded()) {
-      if (block.size() != size) {
-        throw std::runtime_error("Invalid skip_coded block size.");
+    auto skipped = skipped_block_sizes.find(size);
+    if (skipped == skipped_block_sizes.end()) {
+      if (in.indexed()) {
+        // Decoding from a checkpoint, the demuxer can start after the skip
+        // block of a slice.
+        return -1;
       }
-    } else {
-      throw std::runtime_error("Internal error: expected coded block.");
+      throw std::runtime_error("Coded block expected, but not recorded in the compressed data.");
     }
-    return index;
+    skipped_block_sizes.erase(skipped);
+    return -1;
   }
 
-  std::string input_filename;
   std::ostream& out_stream;
+  decompressor_options opts;
 
-  Recoded in;
+  recoded_reader in;
   int read_index = 0, read_offset = 0;
   std::string read_block;
+  uint64_t read_position = 0;
+
+  // Decoding writes the blocks in [window_start, window_end): all of them,
+  // or those of the requested range and from its checkpoint.
+  int window_start = 0, window_end = 0;
+  // Every block's state in full decoding, or none in range decoding.
+  std::unique_ptr<block_state[]> blocks;
+  // The blocks before flushed_blocks have been written, and checksummed.
+  int flushed_blocks = 0;
+  size_t flushed_bytes = 0;
+  uint32_t crc = 0;
+
+  // Coded blocks that read_packet has produced but no decoder has claimed
+  // yet: recoded ones by surrogate marker, and the sizes of skipped ones.
+  // Also guards range_blocks.
+  std::mutex coded_blocks_mutex;
+  // In range decoding, the states of the coded blocks read so far.
+  std::map<int, block_state> range_blocks;
+  std::map<std::string, int> coded_blocks;
+  std::multiset<int> skipped_block_sizes;
+
+  h264_models& models;
+  std::map<int, std::unique_ptr<stream_state>> streams;
+};
+
+
+}  // namespace
 
-  std::vector<block_state> blocks;
 
-  // Counter used to generate surrogate markers for coded blocks.
-  uint64_t surrogate_marker_sequence_number = 1;
-  // Head of the coded block queue - blocks that have been produced by
-  // read_packet but not yet decoded. Tail of the queue is read_index.
-  int next_coded_block = 0;
+struct recoder::state {
+  h264_models models;
 
-  h264_model model;
+  // Forgets what the models learned, keeping their allocations.
+  void clear() {
+    for (auto& model : models) {
+      model.second.clear();
+    }
+  }
 };
 
+recoder::recoder() : s(new state) {}
 
-int roundtrip(const std::string& input_filename, std::ostream* out) {
-  std::stringstream original, compressed, decompressed;
-  original << std::ifstream(input_filename).rdbuf();
-  compressor c(input_filename, compressed);
+recoder::~recoder() {}
+
+void recoder::compress(const uint8_t *data, size_t size, std::ostream& out, const compressor_options& opts,
+                       compress_stats *stats) {
+  s->clear();
+  compressor c(data, size, out, s->models, opts);
   c.run();
-  decompressor d(input_filename, compressed.str(), decompressed);
+  if (stats) {
+    *stats = c.stats();
+  }
+}
+
+void recoder::decompress(const uint8_t *data, size_t size, std::ostream& out, const decompressor_options& opts) {
+  s->clear();
+  decompressor d(data, size, out, s->models, opts);
   d.run();
+}
 
-  if (original.str() == decompressed.str()) {
-    if (out) {
-      (*out) << compressed.str();
-    }
-    double ratio = compressed.str().size() * 1.0 / original.str().size();
+bool recoder::verify(const uint8_t *data, size_t size, std::ostream& report, const decompressor_options& opts) {
+  s->clear();
+  std::ostream discard(nullptr);
+  std::unique_ptr<decompressor> d;
+  try {
+    d.reset(new decompressor(data, size, discard, s->models, opts));
+    d->run();
+  } catch (const std::exception& e) {
+    report << "Verification failed after " << (d ? d->blocks_written() : 0) << " blocks ("
+           << (d ? d->bytes_written() : 0) << " bytes): " << e.what() << std::endl;
+    return false;
+  }
+  report << "Verified " << d->blocks_written() << " blocks (" << d->bytes_written() << " bytes)." << std::endl;
+  return true;
+}
 
-    Recoded compressed_proto;
-    compressed_proto.ParseFromString(compressed.str());
-    int proto_block_bytes = 0;
-    for (const auto& block : compressed_proto.block()) {
-      proto_block_bytes += block.literal().size() + block.cabac().size();
-    }
-    double proto_overhead = (compressed.str().size() - proto_block_bytes) * 1.0 / compressed.str().size();
+void recoder::estimate(const uint8_t *data, size_t size, std::ostream& out, const compressor_options& opts) {
+  s->clear();
+  compressor c(data, size, out, s->models, opts);
+  c.estimate();
+}
 
-    std::cout << "Compress-decompress roundtrip succeeded:" << std::endl;
-    std::cout << " compression ratio: " << ratio*100. << "%" << std::endl;
-    std::cout << " protobuf overhead: " << proto_overhead*100. << "%" << std::endl;
-    return 0;
-  } else {
-    std::cerr << "Compress-decompress roundtrip failed." << std::endl;
-    return 1;
-  }
+
+void compress(const uint8_t *data, size_t size, std::ostream& out, const compressor_options& opts,
+              compress_stats *stats) {
+  recoder().compress(data, size, out, opts, stats);
 }
 
+std::string compress(const uint8_t *data, size_t size, const compressor_options& opts) {
+  std::ostringstream out;
+  compress(data, size, out, opts);
+  return out.str();
+}
 
-int
-main(int argc, char **argv) {
-  av_register_all();
+void decompress(const uint8_t *data, size_t size, std::ostream& out, const decompressor_options& opts) {
+  recoder().decompress(data, size, out, opts);
+}
 
-  if (argc < 3 || argc > 4) {
-    std::cerr << "Usage: " << argv[0] << " [compress|decompress|roundtrip] <input> [output]" << std::endl;
-    return 1;
-  }
-  std::string command = argv[1];
-  std::string input_filename = argv[2];
-  std::ofstream out_file;
-  if (argc > 3) {
-    out_file.open(argv[3]);
-  }
+std::string decompress(const uint8_t *data, size_t size, const decompressor_options& opts) {
+  std::ostringstream out;
+  decompress(data, size, out, opts);
+  return out.str();
+}
+
+bool verify(const uint8_t *data, size_t size, std::ostream& report, const decompressor_options& opts) {
+  return recoder().verify(data, size, report, opts);
+}
+
+void estimate(const uint8_t *data, size_t size, std::ostream& out, const compressor_options& opts) {
+  recoder().estimate(data, size, out, opts);
+}
+
+}  // namespace avrecode
+
+
+namespace {
 
+// Runs f, which sets *result, and converts exceptions to an error message.
+template <typename F>
+int c_api_call(uint8_t **out, size_t *out_size, char **error, F f) {
+  *out = nullptr;
+  *out_size = 0;
+  if (error) {
+    *error = nullptr;
+  }
   try {
-    if (command == "compress") {
-      compressor c(input_filename, out_file.is_open() ? out_file : std::cout);
-      c.run();
-    } else if (command == "decompress") {
-      decompressor d(input_filename, out_file.is_open() ? out_file : std::cout);
-      d.run();
-    } else if (command == "roundtrip") {
-      return roundtrip(input_filename, out_file.is_open() ? &out_file : nullptr);
-    } else {
-      throw std::invalid_argument("Unknown command: " + command);
+    std::string result = f();
+    *out = static_cast<uint8_t*>(malloc(result.size()));
+    if (*out == nullptr && !result.empty()) {
+      throw std::bad_alloc();
     }
+    memcpy(*out, result.data(), result.size());
+    *out_size = result.size();
+    return 0;
   } catch (const std::exception& e) {
-    std::cerr << "Exception (" << typeid(e).name() << "): " << e.what() << std::endl;
-    return 1;
+    if (error) {
+      *error = strdup(e.what());
+    }
+    return -1;
   }
-  return 0;
+}
+
+}  // namespace
+
+extern "C" {
+
+int avrecode_compress(const uint8_t *in, size_t in_size, uint8_t **out, size_t *out_size, char **error) {
+  return c_api_call(out, out_size, error, [&]() { return avrecode::compress(in, in_size); });
+}
+
+int avrecode_decompress(const uint8_t *in, size_t in_size, uint8_t **out, size_t *out_size, char **error) {
+  return c_api_call(out, out_size, error, [&]() { return avrecode::decompress(in, in_size); });
+}
+
+void avrecode_free(void *p) {
+  free(p);
+}
+
 }
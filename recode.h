@@ -0,0 +1,131 @@
+//
+// Library interface of avrecode: lossless recompression of H.264 video files
+// held in memory. Calls share no state, so they may run concurrently from
+// many threads.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+#include <memory>
+#include <ostream>
+#include <string>
+
+namespace avrecode {
+
+struct compressor_options {
+  // Interleaved arithmetic coder states per block, see interleaved_code.
+  int coder_streams = 1;
+  // Store bypass bins in Recoded::Block.bypass_bits instead of coding them.
+  bool raw_bypass = false;
+  // Compress literal blocks with literal_code when it helps.
+  bool code_literals = true;
+  // Store an MP4 moov box transformed by mp4_index when it helps.
+  bool code_mp4_index = true;
+  // Run the model and arithmetic coder on a second thread, fed by the
+  // decoder. The output is the same either way.
+  bool pipeline = false;
+  // Decode each video stream on its own thread.
+  bool parallel_streams = false;
+  // Threads libavcodec parses the slices of a picture with. The output is
+  // the same for any number.
+  int slice_threads = 1;
+  // Check each recoded block by decoding it as the decompressor will, and
+  // store the video without recompression if one doesn't reproduce.
+  bool verify = false;
+  // Restart the model at the first keyframe this many bytes of the original
+  // past the last restart, so that decompressing a byte range can begin
+  // there. 0 for never; restarts cost some compression, and without them a
+  // range is decompressed from the start of the file, so only files meant
+  // for range reads should set it.
+  size_t checkpoint_interval = 0;
+  // A file to record progress in every few seconds, when a single video
+  // stream is recoded. If it exists, compression resumes from the last
+  // point it recorded, provided the input still begins with the bytes it
+  // had then. It is kept, so a file that has since grown is only recoded
+  // from that point.
+  std::string journal;
+};
+
+struct decompressor_options {
+  // Run the CABAC re-encoder on a second thread, fed by the decoder.
+  bool pipeline = false;
+  // Decode each video stream on its own thread.
+  bool parallel_streams = false;
+  // Restore only the bytes of the original in [range_start, range_end),
+  // starting at the checkpoint before them if the compressed file has one.
+  uint64_t range_start = 0;
+  uint64_t range_end = UINT64_MAX;
+};
+
+// Sizes of a compressed file, counted as it is written.
+struct compress_stats {
+  size_t compressed_bytes = 0;
+  // Bytes of block data, without the protobuf framing.
+  size_t payload_bytes = 0;
+};
+
+// Runs compression jobs one at a time, keeping the model's allocations
+// between them. Use one recoder per thread.
+class recoder {
+ public:
+  recoder();
+  ~recoder();
+  recoder(const recoder&) = delete;
+
+  void compress(const uint8_t *data, size_t size, std::ostream& out,
+      const compressor_options& opts = compressor_options(), compress_stats *stats = nullptr);
+  void decompress(const uint8_t *data, size_t size, std::ostream& out,
+      const decompressor_options& opts = decompressor_options());
+  bool verify(const uint8_t *data, size_t size, std::ostream& report,
+      const decompressor_options& opts = decompressor_options());
+  void estimate(const uint8_t *data, size_t size, std::ostream& out,
+      const compressor_options& opts = compressor_options());
+
+ private:
+  struct state;
+  std::unique_ptr<state> s;
+};
+
+// Compresses a whole video file. Errors are thrown as exceptions. The
+// recoded blocks are held until the video is decoded, as they are written
+// in file order.
+void compress(const uint8_t *data, size_t size, std::ostream& out,
+    const compressor_options& opts = compressor_options(), compress_stats *stats = nullptr);
+std::string compress(const uint8_t *data, size_t size,
+    const compressor_options& opts = compressor_options());
+
+// Restores the original file from compressed data.
+void decompress(const uint8_t *data, size_t size, std::ostream& out,
+    const decompressor_options& opts = decompressor_options());
+std::string decompress(const uint8_t *data, size_t size,
+    const decompressor_options& opts = decompressor_options());
+
+// Decompresses without keeping the output, checking the blocks' checksums.
+// Writes to report how far it got, and where it failed if it returns false.
+bool verify(const uint8_t *data, size_t size, std::ostream& report,
+    const decompressor_options& opts = decompressor_options());
+
+// Writes the compression ratio and time predicted from a sample of the video.
+void estimate(const uint8_t *data, size_t size, std::ostream& out,
+    const compressor_options& opts = compressor_options());
+
+}  // namespace avrecode
+
+extern "C" {
+#endif
+
+// C interface with default options. On success these return 0 and set *out
+// to a buffer of *out_size bytes, to be released with avrecode_free. On
+// failure they return -1 and, if error is not NULL, set *error to a message
+// that is also released with avrecode_free.
+int avrecode_compress(const uint8_t *in, size_t in_size, uint8_t **out, size_t *out_size, char **error);
+int avrecode_decompress(const uint8_t *in, size_t in_size, uint8_t **out, size_t *out_size, char **error);
+void avrecode_free(void *p);
+
+#ifdef __cplusplus
+}
+#endif
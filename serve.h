@@ -0,0 +1,372 @@
+//
+// Long-running recode service on a Unix domain socket, and its client.
+//
+// Each connection sends requests as lines and gets one response line per
+// request, in order:
+//   compress - -
+//   decompress - -
+//   verify - -
+//   stats
+// Each "-" refers to the next file descriptor passed with the request
+// (SCM_RIGHTS); the server opens no paths itself, so a job can only touch
+// the files its client could open. The socket is created mode 0600 and only
+// accepts connections from the server's own user. Responses are
+// "ok <key>=<value>..." or "error <message>".
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "file_io.h"
+#include "recode.h"
+#include "worker_pool.h"
+
+
+inline sockaddr_un unix_socket_address(const std::string& path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    throw std::invalid_argument("Socket path too long: " + path);
+  }
+  strcpy(address.sun_path, path.c_str());
+  return address;
+}
+
+
+class recode_server {
+ public:
+  recode_server(const std::string& socket_path, int num_workers,
+      const avrecode::compressor_options& opts = avrecode::compressor_options())
+    : opts(opts), pool(num_workers) {
+    // Replace a socket left behind by a previous server, but nothing else.
+    struct stat st;
+    if (lstat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+      unlink(socket_path.c_str());
+    }
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = unix_socket_address(socket_path);
+    if (listen_fd < 0 ||
+        bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+        chmod(socket_path.c_str(), 0600) < 0 ||
+        listen(listen_fd, 64) < 0) {
+      throw std::runtime_error("Failed to listen on " + socket_path + ": " + strerror(errno));
+    }
+  }
+  ~recode_server() {
+    close(listen_fd);
+    // Connection threads use the pool, so they must end before it does.
+    for (auto& c : connections) {
+      shutdown(c.fd, SHUT_RDWR);
+    }
+    reap_connections(true);
+  }
+
+  // Accepts connections until the listening socket fails.
+  void run() {
+    while (true) {
+      int fd = accept(listen_fd, nullptr, nullptr);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        throw std::runtime_error(std::string("Accept failed: ") + strerror(errno));
+      }
+      if (!same_user(fd)) {
+        close(fd);
+        continue;
+      }
+      reap_connections(false);
+      // Connection threads only parse requests and wait; the work is done
+      // by the pool.
+      connections.emplace_back(fd);
+      connection *c = &connections.back();
+      c->thread = std::thread([this, c]() {
+        serve_connection(c->fd);
+        c->done = true;
+      });
+    }
+  }
+
+ private:
+  struct connection {
+    explicit connection(int fd) : fd(fd) {}
+    int fd;
+    std::thread thread;
+    std::atomic<bool> done{false};
+  };
+
+  static bool same_user(int fd) {
+#ifdef SO_PEERCRED
+    ucred cred;
+    socklen_t size = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) == 0 && cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == geteuid();
+#endif
+  }
+
+  // Joins and closes the connections that have ended, or all of them.
+  void reap_connections(bool all) {
+    for (auto it = connections.begin(); it != connections.end(); ) {
+      if (all || it->done) {
+        if (it->thread.joinable()) it->thread.join();
+        close(it->fd);
+        it = connections.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // Splits a connection's bytes into lines, collecting passed descriptors.
+  class request_reader {
+   public:
+    explicit request_reader(int fd) : fd(fd) {}
+    ~request_reader() {
+      for (int passed : fds) close(passed);
+    }
+
+    bool read_line(std::string *line) {
+      size_t end;
+      while ((end = buffer.find('\n')) == std::string::npos) {
+        char data[4096];
+        char control[CMSG_SPACE(4 * sizeof(int))];
+        iovec iov = { data, sizeof(data) };
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(fd, &msg, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c)) {
+          if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            const int *passed = reinterpret_cast<const int*>(CMSG_DATA(c));
+            fds.insert(fds.end(), passed, passed + (c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+          }
+        }
+        buffer.append(data, n);
+      }
+      *line = buffer.substr(0, end);
+      buffer.erase(0, end + 1);
+      return true;
+    }
+
+    // Takes the next passed descriptor for a "-" argument.
+    int take_fd(const std::string& path) {
+      if (path != "-") throw std::runtime_error("Paths are not accepted, pass a descriptor for " + path);
+      if (fds.empty()) throw std::runtime_error("No file descriptor passed for -");
+      int fd = fds.front();
+      fds.pop_front();
+      return fd;
+    }
+
+   private:
+    int fd;
+    std::string buffer;
+    std::deque<int> fds;
+  };
+
+  struct job_stats {
+    size_t jobs = 0, failed = 0;
+    double total_ms = 0, max_ms = 0;
+  };
+
+  void serve_connection(int fd) {
+    request_reader reader(fd);
+    std::string line;
+    while (reader.read_line(&line)) {
+      std::string response = handle_request(line, &reader);
+      response.push_back('\n');
+      if (send(fd, response.data(), response.size(), MSG_NOSIGNAL) < 0) {
+        break;
+      }
+    }
+  }
+
+  std::string handle_request(const std::string& line, request_reader *reader) {
+    std::istringstream words(line);
+    std::string command, first, second, extra;
+    words >> command >> first >> second >> extra;
+    if (command == "stats") {
+      return stats();
+    }
+    if ((command != "compress" && command != "decompress" && command != "verify") ||
+        second.empty() || !extra.empty()) {
+      return "error Invalid request: " + line;
+    }
+
+    auto submitted = std::chrono::steady_clock::now();
+    std::promise<std::string> result;
+    std::future<std::string> done = result.get_future();
+    std::string response;
+    try {
+      int in_fd = reader->take_fd(first);
+      int out_fd;
+      try {
+        out_fd = reader->take_fd(second);
+      } catch (...) {
+        close(in_fd);
+        throw;
+      }
+      pool.submit([&, in_fd, out_fd](avrecode::recoder& r) {
+        auto started = std::chrono::steady_clock::now();
+        try {
+          result.set_value(run_job(r, command, in_fd, out_fd) + " queue_ms=" +
+                           std::to_string(milliseconds(started - submitted)));
+        } catch (const std::exception& e) {
+          result.set_value(std::string("error ") + e.what());
+        }
+        close(in_fd);
+        close(out_fd);
+      });
+      response = done.get();
+    } catch (const std::exception& e) {
+      response = std::string("error ") + e.what();
+    }
+
+    double total_ms = milliseconds(std::chrono::steady_clock::now() - submitted);
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    totals.jobs++;
+    totals.failed += response.compare(0, 3, "ok ") != 0;
+    totals.total_ms += total_ms;
+    totals.max_ms = std::max(totals.max_ms, total_ms);
+    return response;
+  }
+
+  std::string run_job(avrecode::recoder& r, const std::string& command, int in_fd, int out_fd) {
+    auto started = std::chrono::steady_clock::now();
+    // verify decompresses its second file and compares with the first.
+    bool verify = (command == "verify");
+    std::string in = read_fd(verify ? out_fd : in_fd);
+    std::ostringstream out;
+    const uint8_t *in_bytes = reinterpret_cast<const uint8_t*>(in.data());
+    if (command == "compress") {
+      r.compress(in_bytes, in.size(), out, opts);
+    } else {
+      r.decompress(in_bytes, in.size(), out);
+    }
+    std::string out_bytes = out.str();
+    if (verify) {
+      if (out_bytes != read_fd(in_fd)) {
+        throw std::runtime_error("Decompressed data differs from the original.");
+      }
+    } else {
+      write_fd(out_fd, out_bytes);
+    }
+    return "ok in_bytes=" + std::to_string(in.size()) + " out_bytes=" + std::to_string(out_bytes.size()) +
+        " run_ms=" + std::to_string(milliseconds(std::chrono::steady_clock::now() - started));
+  }
+
+  std::string stats() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return "ok workers=" + std::to_string(pool.size()) +
+        " queue_depth=" + std::to_string(pool.queue_depth()) +
+        " jobs=" + std::to_string(totals.jobs) +
+        " failed=" + std::to_string(totals.failed) +
+        " mean_ms=" + std::to_string(totals.jobs ? totals.total_ms / totals.jobs : 0.) +
+        " max_ms=" + std::to_string(totals.max_ms);
+  }
+
+  static double milliseconds(std::chrono::steady_clock::duration elapsed) {
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+  }
+
+  avrecode::compressor_options opts;
+  int listen_fd = -1;
+  std::mutex stats_mutex;
+  job_stats totals;
+  std::list<connection> connections;
+  worker_pool<avrecode::recoder> pool;
+};
+
+
+// Sends one request and prints the response to stderr. The client opens the
+// request's paths and passes them to the server; "-" passes its stdin
+// (inputs) or stdout (compress/decompress output). Returns 0 if the server
+// reported success.
+inline int run_client(const std::string& socket_path, const std::vector<std::string>& request) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un address = unix_socket_address(socket_path);
+  if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+    throw std::runtime_error("Failed to connect to " + socket_path + ": " + strerror(errno));
+  }
+
+  std::string line;
+  std::vector<int> fds, opened;
+  auto close_all = [&]() {
+    for (int passed : opened) close(passed);
+    close(fd);
+  };
+  // Only descriptors go to the server, which opens no paths for a client.
+  for (size_t i = 0; i < request.size(); i++) {
+    line += i ? " -" : request[i];
+    if (i == 0) continue;
+    bool output = (i == 2 && request[0] != "verify");
+    if (request[i] == "-") {
+      fds.push_back(output ? STDOUT_FILENO : STDIN_FILENO);
+      continue;
+    }
+    int passed = open(request[i].c_str(), output ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+    if (passed < 0) {
+      std::string error = "Failed to open " + request[i] + ": " + strerror(errno);
+      close_all();
+      throw std::runtime_error(error);
+    }
+    opened.push_back(passed);
+    fds.push_back(passed);
+  }
+  line.push_back('\n');
+
+  iovec iov = { &line[0], line.size() };
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+  if (!fds.empty()) {
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(c), fds.data(), sizeof(int) * fds.size());
+  }
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+    std::string error = std::string("Failed to send request: ") + strerror(errno);
+    close_all();
+    throw std::runtime_error(error);
+  }
+  for (int passed : opened) close(passed);
+
+  std::string response;
+  char c;
+  while (read(fd, &c, 1) == 1 && c != '\n') {
+    response.push_back(c);
+  }
+  close(fd);
+  std::cerr << response << std::endl;
+  return response.compare(0, 3, "ok ") == 0 ? 0 : 1;
+}
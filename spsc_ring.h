@@ -0,0 +1,99 @@
+//
+// Bounded lock-free queue between one producer thread and one consumer
+// thread. A side that finds nothing to do spins briefly, then sleeps until
+// the other side makes progress.
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+template <typename T>
+class spsc_ring {
+ public:
+  // capacity must be a power of two.
+  explicit spsc_ring(size_t capacity) : items(capacity), mask(capacity - 1) {}
+  spsc_ring(const spsc_ring&) = delete;
+
+  // Producer side. Waits while the ring is full.
+  void push(const T& item) {
+    size_t tail = tail_index.load(std::memory_order_relaxed);
+    if (tail - producer_head == items.size()) {
+      wait([&]() {
+        producer_head = head_index.load(std::memory_order_acquire);
+        return tail - producer_head < items.size();
+      });
+    }
+    items[tail & mask] = item;
+    tail_index.store(tail + 1, std::memory_order_release);
+    wake();
+  }
+
+  // Consumer side. Waits while the ring is empty.
+  void pop(T *item) {
+    size_t head = head_index.load(std::memory_order_relaxed);
+    if (head == consumer_tail) {
+      wait([&]() {
+        consumer_tail = tail_index.load(std::memory_order_acquire);
+        return head != consumer_tail;
+      });
+    }
+    *item = items[head & mask];
+    head_index.store(head + 1, std::memory_order_release);
+    wake();
+  }
+
+ private:
+  // Both threads are expected to be busy, so spin and yield briefly before
+  // sleeping. Only one side can be waiting at a time: the ring can't be
+  // both full and empty.
+  template <typename Ready>
+  void wait(Ready ready) {
+    for (int spins = 0; spins < 128; spins++) {
+      if (ready()) return;
+      if (spins >= 64) {
+        std::this_thread::yield();
+      }
+    }
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    sleeping.store(true, std::memory_order_relaxed);
+    // Orders the flag before ready()'s load, against wake()'s fence.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!ready()) {
+      woken.wait(lock);
+    }
+    sleeping.store(false, std::memory_order_relaxed);
+  }
+
+  // Called after publishing an index. Either the waiter's ready() sees the
+  // new index, or this sees its flag and wakes it.
+  void wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      woken.notify_one();
+    }
+  }
+
+  std::vector<T> items;
+  const size_t mask;
+  // Each index is written by one side; each side caches the other's index
+  // on its own cache line, so most operations touch no shared line. The
+  // lines are padded rather than aligned, since the ring is heap allocated.
+  char pad0[64];
+  std::atomic<size_t> head_index{0};
+  size_t consumer_tail = 0;
+  char pad1[64];
+  std::atomic<size_t> tail_index{0};
+  size_t producer_head = 0;
+  char pad2[64];
+  std::atomic<bool> sleeping{false};
+  std::mutex sleep_mutex;
+  std::condition_variable woken;
+};
@@ -1,5 +1,6 @@
 #include <cstdlib>
 #include <iostream>
+#include <stdexcept>
 #include <vector>
 
 #include "arithmetic_code.h"
@@ -108,6 +109,83 @@ int main(int argc, char* argv[]) {
       return 1;
     }
   }
+
+  code::decoder<const uint8_t*, uint8_t> pointer_decoder(out.data(), out.data() + out.size());
+  for (int i = 0; i < bits.size(); i++) {
+    int bit = pointer_decoder.get([](uint64_t range){ return range/2; });
+    if (bit != bits[i]) {
+      std::cerr << "pointer decoder mismatch at bit: " << i << ", " << bit << " != " << bits[i] << std::endl;
+      return 1;
+    }
+  }
+
+  for (int streams : {1, 2, 4}) {
+    std::vector<uint8_t> interleaved_out;
+    {
+      interleaved_code<code>::encoder<std::back_insert_iterator<std::vector<uint8_t>>> interleaved_encoder(
+          std::back_inserter(interleaved_out), streams);
+      for (int i = 0; i < bits.size(); i++) {
+        interleaved_encoder.put(bits[i], [](uint64_t range){ return range/2; });
+      }
+    }
+    std::cout << streams << " interleaved streams: " << interleaved_out.size() << std::endl;
+    if (streams == 1 && interleaved_out != out) {
+      std::cerr << "single interleaved stream differs from encoder" << std::endl;
+      return 1;
+    }
+
+    interleaved_code<code>::decoder<uint8_t> interleaved_decoder(
+        interleaved_out.data(), interleaved_out.data() + interleaved_out.size(), streams);
+    for (int i = 0; i < bits.size(); i++) {
+      int bit = interleaved_decoder.get([](uint64_t range){ return range/2; });
+      if (bit != bits[i]) {
+        std::cerr << streams << " interleaved streams mismatch at bit: " << i << ", " << bit << " != " << bits[i] << std::endl;
+        return 1;
+      }
+    }
+  }
+
+  // Skewed contexts, from nearly always 0 to nearly always 1, in 1/4096ths.
+  const int skewed_probabilities[] = {4, 64, 2048, 4032, 4092};
+  std::vector<int> skewed_bits;
+  std::vector<int> skewed_contexts;
+  for (int i = 0; i < std::stoi(argv[1]); i++) {
+    int context = std::rand() % 5;
+    skewed_contexts.push_back(context);
+    skewed_bits.push_back(std::rand() % 4096 < skewed_probabilities[context]);
+  }
+  for (int streams : {1, 2, 4}) {
+    std::vector<uint8_t> interleaved_out;
+    {
+      interleaved_code<code>::encoder<std::back_insert_iterator<std::vector<uint8_t>>> interleaved_encoder(
+          std::back_inserter(interleaved_out), streams);
+      for (int i = 0; i < skewed_bits.size(); i++) {
+        int p = skewed_probabilities[skewed_contexts[i]];
+        interleaved_encoder.put(skewed_bits[i], [p](uint64_t range){ return range/4096 * p; });
+      }
+    }
+    std::cout << streams << " interleaved skewed streams: " << interleaved_out.size() << std::endl;
+
+    interleaved_code<code>::decoder<uint8_t> interleaved_decoder(
+        interleaved_out.data(), interleaved_out.data() + interleaved_out.size(), streams);
+    for (int i = 0; i < skewed_bits.size(); i++) {
+      int p = skewed_probabilities[skewed_contexts[i]];
+      int bit = interleaved_decoder.get([p](uint64_t range){ return range/4096 * p; });
+      if (bit != skewed_bits[i]) {
+        std::cerr << streams << " interleaved skewed streams mismatch at bit: " << i << ", " << bit << " != " << skewed_bits[i] << std::endl;
+        return 1;
+      }
+    }
+  }
+
+  for (int streams : {0, 3, 5}) {
+    try {
+      interleaved_code<code>::check_streams(streams);
+      std::cerr << streams << " interleaved streams accepted" << std::endl;
+      return 1;
+    } catch (const std::invalid_argument&) {
+    }
+  }
   return 0;
 #endif
 #endif
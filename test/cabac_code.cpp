@@ -0,0 +1,119 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "cabac_code.h"
+
+extern "C" {
+#include "libavcodec/cabac.h"
+}
+
+
+enum { REGULAR, BYPASS, TERMINATE };
+
+// Decode the symbol sequence described by kinds/contexts with the given
+// decoder, comparing against the expected bits. Returns false on mismatch.
+template <typename GetRegular, typename GetBypass, typename GetTerminate>
+bool decode_and_compare(const char* name, const std::vector<int>& kinds,
+    const std::vector<int>& contexts, const std::vector<int>& bits,
+    const std::vector<uint8_t>& expected_states, GetRegular get, GetBypass get_bypass,
+    GetTerminate get_terminate) {
+  std::vector<uint8_t> states(expected_states.size());
+  std::vector<int> decoded(bits.size());
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < bits.size(); i++) {
+    switch (kinds[i]) {
+      case REGULAR: decoded[i] = get(&states[contexts[i]]); break;
+      case BYPASS: decoded[i] = get_bypass(); break;
+      case TERMINATE: decoded[i] = get_terminate(); break;
+    }
+  }
+  int end_of_stream = get_terminate();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  std::cout << name << ": " << std::chrono::duration<double, std::nano>(elapsed).count() / bits.size()
+            << " ns/bin" << std::endl;
+  for (size_t i = 0; i < bits.size(); i++) {
+    if (decoded[i] != bits[i]) {
+      std::cerr << name << " mismatch at bit: " << i << ", " << decoded[i] << " != " << bits[i] << std::endl;
+      return false;
+    }
+  }
+  if (!end_of_stream) {
+    std::cerr << name << " mismatch at terminate" << std::endl;
+    return false;
+  }
+  if (states != expected_states) {
+    std::cerr << name << " mismatch in context states" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+
+// Encodes random symbols with cabac::encoder and checks that both
+// cabac::decoder and libavcodec's CABAC decoder read back the same symbols
+// and context states, reporting the decoding speed of each.
+int main(int argc, char* argv[]) {
+  std::srand(time(nullptr));
+  int num_symbols = argc > 1 ? std::stoi(argv[1]) : 100000;
+
+  std::vector<int> kinds, contexts, bits;
+  std::vector<int> probabilities;
+  for (int i = 0; i < 16; i++) {
+    probabilities.push_back(std::rand() % 100);
+  }
+  for (int i = 0; i < num_symbols; i++) {
+    int r = std::rand() % 100;
+    int kind = r < 80 ? REGULAR : r < 99 ? BYPASS : TERMINATE;
+    int context = std::rand() % probabilities.size();
+    kinds.push_back(kind);
+    contexts.push_back(context);
+    bits.push_back(kind == TERMINATE ? 0 : (std::rand() % 100) >= probabilities[context]);
+  }
+
+  std::vector<uint8_t> states(probabilities.size()), updated_states(probabilities.size());
+  std::vector<uint8_t> out;
+  cabac::encoder<std::back_insert_iterator<std::vector<uint8_t>>> encoder(std::back_inserter(out));
+  for (int i = 0; i < num_symbols; i++) {
+    switch (kinds[i]) {
+      case REGULAR:
+        encoder.put(bits[i], &states[contexts[i]]);
+        cabac::update_state(bits[i], &updated_states[contexts[i]]);
+        break;
+      case BYPASS: encoder.put_bypass(bits[i]); break;
+      case TERMINATE: encoder.put_terminate(bits[i]); break;
+    }
+  }
+  encoder.put_terminate(1);
+  if (updated_states != states) {
+    std::cerr << "cabac::update_state differs from cabac::encoder" << std::endl;
+    return 1;
+  }
+
+  std::cout << "compressed size: " << out.size() << std::endl;
+
+  // libavcodec's decoder reads ahead of the end of its input.
+  size_t size = out.size();
+  out.resize(size + 32);
+
+  cabac::decoder decoder(&out[0], size);
+  if (!decode_and_compare("cabac::decoder", kinds, contexts, bits, states,
+          [&](uint8_t* state) { return decoder.get(state); },
+          [&]() { return decoder.get_bypass(); },
+          [&]() { return decoder.get_terminate(); })) {
+    return 1;
+  }
+
+  CABACContext ctx;
+  ff_init_cabac_decoder(&ctx, &out[0], size);
+  if (!decode_and_compare("ff_get_cabac", kinds, contexts, bits, states,
+          [&](uint8_t* state) { return ff_get_cabac(&ctx, state); },
+          [&]() { return ff_get_cabac_bypass(&ctx); },
+          [&]() { return int(ff_get_cabac_terminate(&ctx) != 0); })) {
+    return 1;
+  }
+  return 0;
+}
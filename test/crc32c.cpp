@@ -0,0 +1,47 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "crc32c.h"
+
+
+// Checks crc32c against known values, and the hardware and software
+// versions against each other on random data split at every alignment.
+int main(int argc, char* argv[]) {
+  int failures = 0;
+  auto expect = [&](const std::string& what, uint32_t got, uint32_t expected) {
+    if (got != expected) {
+      std::cerr << what << ": got " << std::hex << got << ", expected " << expected << std::dec << std::endl;
+      failures++;
+    }
+  };
+
+  expect("empty", crc32c::of("", 0), 0);
+  expect("123456789", crc32c::of("123456789", 9), 0xe3069283);
+  std::string zeros(32, '\0');
+  expect("32 zeros", crc32c::of(zeros.data(), zeros.size()), 0x8a9136aa);
+  std::string ones(32, '\xff');
+  expect("32 ones", crc32c::of(ones.data(), ones.size()), 0x62a8ab43);
+
+  std::string data(4096, '\0');
+  for (char& c : data) {
+    c = std::rand();
+  }
+  const uint8_t *p = reinterpret_cast<const uint8_t*>(data.data());
+  uint32_t whole = crc32c::extend_software(0, p, data.size());
+  expect("whole", crc32c::of(p, data.size()), whole);
+  for (size_t split = 0; split < 64; split++) {
+    uint32_t crc = crc32c::extend(0, p + split, data.size() - split - 17);
+    expect("offset " + std::to_string(split), crc,
+           crc32c::extend_software(0, p + split, data.size() - split - 17));
+    expect("split " + std::to_string(split), crc32c::extend(crc32c::extend(0, p, split), p + split, data.size() - split),
+           whole);
+  }
+
+  if (failures) {
+    std::cerr << failures << " failures" << std::endl;
+    return 1;
+  }
+  std::cout << "crc32c: OK" << std::endl;
+  return 0;
+}
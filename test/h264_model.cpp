@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "h264_model.h"
+
+using namespace avrecode;
+
+
+// Feeds a model the bins of many macroblocks the way the compressor does:
+// a few ordinary bins, then sub-blocks whose significance maps are queued,
+// their nonzero counts coded, and the maps coded afterwards, either one bin
+// at a time through get_model_key() or as a run. Returns the sum of the
+// probabilities given to coded bins, and adds the time spent coding the maps
+// and their number of bins to *elapsed and *num_bins.
+class model_driver {
+ public:
+  explicit model_driver(bool as_run) : as_run(as_run) {
+  }
+
+  uint64_t drive(int num_blocks, uint32_t seed,
+                 std::chrono::steady_clock::duration *elapsed, size_t *num_bins) {
+    uint64_t sum = 0;
+    for (int b = 0; b < num_blocks; b++) {
+      model.frame_spec(b / (120 * 68), 120, 68);
+      model.mb_xy(b % 120, (b / 120) % 68);
+      for (int i = 0; i < 12; i++) {
+        model_key key = model.get_model_key(model.cabac_state(rnd(&seed) % 460));
+        sum += code(rnd(&seed) & 1, key);
+      }
+      // Luma 4x4, luma DC, 8x8 and 4:2:2 chroma DC sub-blocks.
+      static const int cats[4] = {2, 0, 5, 3}, sizes[4] = {15, 16, 64, 8};
+      int kind = b % 4;
+      model.begin_sub_mb(cats[kind], b % 16, sizes[kind], kind % 2, kind == 3);
+      model.begin_coding_type(PIP_SIGNIFICANCE_MAP, 0, 0, 0);
+      bins.clear();
+      while (model.coding_type != PIP_UNREACHABLE) {
+        int symbol = model.coding_type == PIP_SIGNIFICANCE_EOB ? rnd(&seed) % 4 == 0 : rnd(&seed) % 3 == 0;
+        bins.push_back(symbol);
+        model.update_state_tracking(symbol);
+      }
+      model.end_coding_type(PIP_SIGNIFICANCE_MAP);
+      model.finished_queueing(PIP_SIGNIFICANCE_MAP, [&](model_key key, int *symbol) {
+        sum += code(*symbol, key);
+      });
+      auto start = std::chrono::steady_clock::now();
+      if (as_run) {
+        model.code_significance_map(bins.begin(), bins.end(), [&](int symbol, model_key key) {
+          sum += probability(key);
+        });
+      } else {
+        model.reset_mb_significance_state_tracking();
+        for (int symbol : bins) {
+          model_key key = model.get_model_key(nullptr);
+          if (model.coding_type != PIP_SIGNIFICANCE_EOB) {
+            sum += probability(key);
+          }
+          model.update_state_for_model_key(symbol, key);
+        }
+      }
+      *elapsed += std::chrono::steady_clock::now() - start;
+      *num_bins += bins.size();
+      model.set_coding_type(PIP_UNKNOWN);
+      model.end_sub_mb(cats[kind], b % 16, sizes[kind], kind % 2, kind == 3);
+    }
+    return sum;
+  }
+
+  h264_model model;
+
+ private:
+  static uint32_t rnd(uint32_t *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+  }
+  uint64_t probability(model_key key) {
+    return model.probability_for_model_key(range_t(1) << 32, key);
+  }
+  uint64_t code(int symbol, model_key key) {
+    uint64_t p = probability(key);
+    model.update_state_for_model_key(symbol, key);
+    return p;
+  }
+
+  bool as_run;
+  std::vector<uint8_t> bins;
+};
+
+// Checks that coding significance maps as runs predicts exactly as coding
+// them bin by bin, and reports the time per significance map bin of each.
+// Timings are only printed, as other load would make a bound flaky; pass a
+// larger block count to benchmark.
+int main(int argc, char* argv[]) {
+  const int num_blocks = argc > 1 ? std::atoi(argv[1]) : 10000;
+  double ns_per_bin[2] = {};
+  uint64_t sums[2] = {};
+  std::string snapshots[2];
+  for (bool as_run : {false, true}) {
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+      model_driver driver(as_run);
+      std::chrono::steady_clock::duration elapsed(0);
+      size_t num_bins = 0;
+      sums[as_run] = driver.drive(num_blocks, 1, &elapsed, &num_bins);
+      double ns = std::chrono::duration<double, std::nano>(elapsed).count() / num_bins;
+      best = run == 0 ? ns : std::min(best, ns);
+      snapshots[as_run] = driver.model.snapshot();
+    }
+    ns_per_bin[as_run] = best;
+  }
+  std::cout << "per bin: " << ns_per_bin[0] << " ns/bin, as runs: " << ns_per_bin[1] << " ns/bin" << std::endl;
+  if (sums[0] != sums[1] || snapshots[0] != snapshots[1]) {
+    std::cerr << "significance map runs predicted differently" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,89 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "literal_code.h"
+
+
+// Roundtrips skewed bytes of every size around the lane split, and checks
+// that truncated input is rejected rather than read past.
+bool check_sizes() {
+  for (size_t size = literal_code::min_size; size < literal_code::min_size + 64; size++) {
+    std::string original;
+    for (size_t i = 0; i < size; i++) {
+      original.push_back(char(std::rand() % 4 ? 0 : std::rand() % 16));
+    }
+    std::string compressed;
+    if (!literal_code::encode(reinterpret_cast<const uint8_t*>(original.data()), size, &compressed)) {
+      std::cerr << size << " bytes weren't compressed" << std::endl;
+      return false;
+    }
+    if (literal_code::decode(compressed, size) != original) {
+      std::cerr << size << " bytes didn't roundtrip" << std::endl;
+      return false;
+    }
+    try {
+      literal_code::decode(compressed.substr(0, compressed.size() / 2), size);
+      std::cerr << "truncated " << size << " bytes decoded" << std::endl;
+      return false;
+    } catch (const std::runtime_error&) {
+    }
+  }
+  return true;
+}
+
+// Compresses a file (or random text-like bytes) with literal_code and checks
+// that it decompresses to the original, reporting ratio and speed. Built with
+// optimization, decoding has to keep up with restores.
+int main(int argc, char* argv[]) {
+  if (!check_sizes()) {
+    return 1;
+  }
+  std::string original;
+  if (argc > 1) {
+    std::stringstream contents;
+    contents << std::ifstream(argv[1], std::ios::binary).rdbuf();
+    original = contents.str();
+  } else {
+    std::srand(time(nullptr));
+    const char* words[] = {"moov", "trak", "mdia", "minf", "stbl", "stsz", "stco", "\0\0\0\x01"};
+    while (original.size() < 1000000) {
+      original += words[std::rand() % 8];
+      original.push_back(char(std::rand() % 4));
+    }
+  }
+
+  std::string compressed;
+  auto start = std::chrono::steady_clock::now();
+  bool coded = literal_code::encode(
+      reinterpret_cast<const uint8_t*>(original.data()), original.size(), &compressed);
+  auto encoded = std::chrono::steady_clock::now();
+  std::cout << "compressed size: " << compressed.size() << " of " << original.size()
+            << (coded ? "" : " (stored raw)") << std::endl;
+  if (!coded) {
+    return 0;
+  }
+
+  auto mb_per_s = [&](std::chrono::steady_clock::duration elapsed) {
+    return original.size() / std::chrono::duration<double, std::micro>(elapsed).count();
+  };
+  // The fastest of a few runs, as other load only slows it down.
+  double decode_speed = 0;
+  for (int run = 0; run < 5; run++) {
+    auto decode_start = std::chrono::steady_clock::now();
+    std::string decompressed = literal_code::decode(compressed, original.size());
+    decode_speed = std::max(decode_speed, mb_per_s(std::chrono::steady_clock::now() - decode_start));
+    if (decompressed != original) {
+      std::cerr << "decompressed bytes differ from the original" << std::endl;
+      return 1;
+    }
+  }
+  std::cout << "encode: " << mb_per_s(encoded - start) << " MB/s, decode: " << decode_speed << " MB/s"
+            << std::endl;
+  return 0;
+}
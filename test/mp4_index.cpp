@@ -0,0 +1,128 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "mp4_index.h"
+
+
+void put_be32(std::string *out, uint32_t n) {
+  for (int i = 3; i >= 0; i--) {
+    out->push_back(char(n >> (8 * i)));
+  }
+}
+
+std::string make_box(const char *type, const std::string& body) {
+  std::string box;
+  put_be32(&box, 8 + body.size());
+  box.append(type, 4);
+  return box + body;
+}
+
+// A moov with a video track (variable sample sizes, ctts, one sample per
+// chunk) and an audio track (constant sample size, several samples per
+// chunk), whose chunks are interleaved in the mdat.
+std::string make_moov(int num_frames) {
+  std::vector<uint32_t> video_sizes;
+  for (int i = 0; i < num_frames; i++) {
+    video_sizes.push_back(i % 30 == 0 ? 60000 + std::rand() % 20000 : 2000 + std::rand() % 8000);
+  }
+  const uint32_t audio_sample_size = 372, audio_samples_per_chunk = 3;
+
+  std::string video_stsz, video_stco, video_stsc, video_ctts, audio_stsz, audio_stco, audio_stsc;
+  put_be32(&video_stsz, 0);
+  put_be32(&video_stsz, 0);
+  put_be32(&video_stsz, num_frames);
+  put_be32(&video_stco, 0);
+  put_be32(&video_stco, num_frames);
+  put_be32(&audio_stsz, 0);
+  put_be32(&audio_stsz, audio_sample_size);
+  put_be32(&audio_stsz, num_frames * audio_samples_per_chunk);
+  put_be32(&audio_stco, 0);
+  put_be32(&audio_stco, num_frames);
+  uint32_t offset = 48;
+  for (int i = 0; i < num_frames; i++) {
+    put_be32(&video_stsz, video_sizes[i]);
+    put_be32(&video_stco, offset);
+    offset += video_sizes[i];
+    put_be32(&audio_stco, offset);
+    offset += audio_sample_size * audio_samples_per_chunk;
+  }
+  for (std::string *stsc : {&video_stsc, &audio_stsc}) {
+    put_be32(stsc, 0);
+    put_be32(stsc, 1);
+    put_be32(stsc, 1);
+    put_be32(stsc, stsc == &video_stsc ? 1 : audio_samples_per_chunk);
+    put_be32(stsc, 1);
+  }
+  put_be32(&video_ctts, 0);
+  put_be32(&video_ctts, num_frames);
+  for (int i = 0; i < num_frames; i++) {
+    put_be32(&video_ctts, 1);
+    put_be32(&video_ctts, (i % 3) * 1001);
+  }
+
+  std::string stsd = make_box("stsd", std::string(16, '\x01'));
+  std::string video_stbl = make_box("stbl", stsd + make_box("ctts", video_ctts) + make_box("stsc", video_stsc) +
+                                    make_box("stsz", video_stsz) + make_box("stco", video_stco));
+  std::string audio_stbl = make_box("stbl", stsd + make_box("stsc", audio_stsc) +
+                                    make_box("stsz", audio_stsz) + make_box("stco", audio_stco));
+  auto make_trak = [](const std::string& stbl) {
+    return make_box("trak", make_box("tkhd", std::string(84, '\0')) +
+                    make_box("mdia", make_box("minf", stbl)));
+  };
+  return make_box("moov", make_box("mvhd", std::string(100, '\0')) +
+                  make_trak(video_stbl) + make_trak(audio_stbl) + make_box("udta", "recorder"));
+}
+
+// Transforms a synthetic moov, or the moov of an MP4 file, and checks that
+// it is regenerated exactly.
+int main(int argc, char* argv[]) {
+  std::srand(time(nullptr));
+  std::string moov;
+  if (argc > 1) {
+    std::stringstream contents;
+    contents << std::ifstream(argv[1], std::ios::binary).rdbuf();
+    std::string file = contents.str();
+    for (size_t pos = 0; pos + 8 <= file.size(); ) {
+      uint32_t size = uint8_t(file[pos]) << 24 | uint8_t(file[pos+1]) << 16 |
+                      uint8_t(file[pos+2]) << 8 | uint8_t(file[pos+3]);
+      if (size < 8 || pos + size > file.size()) break;
+      if (file.compare(pos + 4, 4, "moov") == 0) {
+        moov = file.substr(pos, size);
+      }
+      pos += size;
+    }
+    if (moov.empty()) {
+      std::cerr << "no moov box found" << std::endl;
+      return 1;
+    }
+  } else {
+    moov = make_moov(20000);
+  }
+
+  std::string transformed;
+  if (!mp4_index::encode(reinterpret_cast<const uint8_t*>(moov.data()), moov.size(), &transformed)) {
+    std::cerr << "moov not transformed" << std::endl;
+    return 1;
+  }
+  std::cout << "moov size: " << moov.size() << ", transformed: " << transformed.size() << std::endl;
+  if (mp4_index::decode(transformed) != moov) {
+    std::cerr << "regenerated moov differs from the original" << std::endl;
+    return 1;
+  }
+
+  // Chunk offsets out of order within a track can't be predicted, and must
+  // be rejected rather than regenerated wrongly.
+  std::string shuffled = moov;
+  size_t stco = shuffled.find("stco");
+  std::swap_ranges(&shuffled[stco + 12], &shuffled[stco + 16], &shuffled[stco + 16]);
+  if (mp4_index::encode(reinterpret_cast<const uint8_t*>(shuffled.data()), shuffled.size(), &transformed) &&
+      mp4_index::decode(transformed) != shuffled) {
+    std::cerr << "out of order chunk offsets regenerated wrongly" << std::endl;
+    return 1;
+  }
+  return 0;
+}
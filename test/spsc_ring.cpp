@@ -0,0 +1,48 @@
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <thread>
+
+#include "spsc_ring.h"
+
+
+// Passes a sequence through a small ring, so both sides often wait, and
+// checks that it arrives complete and in order.
+int main(int argc, char* argv[]) {
+  const size_t num_items = 1000000;
+  spsc_ring<size_t> ring(16);
+  std::thread producer([&]() {
+    for (size_t i = 0; i < num_items; i++) {
+      ring.push(i * 7 + 1);
+    }
+  });
+  size_t errors = 0;
+  for (size_t i = 0; i < num_items; i++) {
+    size_t item;
+    ring.pop(&item);
+    if (item != i * 7 + 1) {
+      errors++;
+    }
+  }
+  producer.join();
+  if (errors) {
+    std::cerr << errors << " items out of order" << std::endl;
+    return 1;
+  }
+
+  // A consumer waiting on an idle producer sleeps instead of spinning.
+  std::clock_t cpu_start = std::clock();
+  std::thread idle_producer([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    ring.push(1);
+  });
+  size_t item;
+  ring.pop(&item);
+  idle_producer.join();
+  double cpu_ms = 1000.0 * (std::clock() - cpu_start) / CLOCKS_PER_SEC;
+  if (cpu_ms > 250) {
+    std::cerr << "waiting for 500 ms used " << cpu_ms << " ms of CPU" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,52 @@
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+#include "worker_pool.h"
+
+
+// Per-thread state: counts the jobs it ran, and checks that no two jobs use
+// it at the same time.
+struct counter_state {
+  int jobs = 0;
+  std::atomic<bool> busy{false};
+};
+
+// Runs many small jobs on a pool and checks that every job ran exactly once
+// and that per-thread state is never shared.
+int main(int argc, char* argv[]) {
+  const int num_jobs = 100000;
+  std::atomic<int> total(0);
+  std::atomic<bool> shared(false);
+  {
+    worker_pool<counter_state> pool(4);
+    for (int i = 0; i < num_jobs; i++) {
+      pool.submit([&](counter_state& state) {
+        if (state.busy.exchange(true)) {
+          shared = true;
+        }
+        state.jobs++;
+        total++;
+        state.busy = false;
+      });
+    }
+    pool.wait_idle();
+    if (pool.queue_depth() != 0 || total != num_jobs) {
+      std::cerr << "pool idle with " << num_jobs - total << " jobs not run" << std::endl;
+      return 1;
+    }
+    // Jobs queued before destruction still run.
+    for (int i = 0; i < 1000; i++) {
+      pool.submit([&](counter_state&) { total++; });
+    }
+  }
+  if (total != num_jobs + 1000) {
+    std::cerr << "jobs dropped at shutdown: " << num_jobs + 1000 - total << std::endl;
+    return 1;
+  }
+  if (shared) {
+    std::cerr << "per-thread state used by two jobs at once" << std::endl;
+    return 1;
+  }
+  return 0;
+}
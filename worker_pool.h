@@ -0,0 +1,96 @@
+//
+// A fixed set of threads running queued jobs. Each thread owns a State that
+// is passed to the jobs it runs, so per-thread allocations are reused.
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+template <typename State>
+class worker_pool {
+ public:
+  typedef std::function<void(State&)> job;
+
+  explicit worker_pool(int num_threads) {
+    if (num_threads < 1) {
+      num_threads = 1;
+    }
+    for (int i = 0; i < num_threads; i++) {
+      threads.emplace_back([this]() { run(); });
+    }
+  }
+  worker_pool(const worker_pool&) = delete;
+
+  // Runs the jobs already queued, then stops the threads.
+  ~worker_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    queue_changed.notify_all();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  // Jobs must not throw; they are run in submission order.
+  void submit(job j) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(std::move(j));
+    }
+    queue_changed.notify_one();
+  }
+
+  // Blocks until no job is queued or running.
+  void wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]() { return queue.empty() && running == 0; });
+  }
+
+  // Jobs waiting for a thread.
+  size_t queue_depth() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.size();
+  }
+
+  size_t size() const { return threads.size(); }
+
+ private:
+  void run() {
+    State state;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      queue_changed.wait(lock, [this]() { return stopping || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      job j = std::move(queue.front());
+      queue.pop_front();
+      running++;
+      lock.unlock();
+      j(state);
+      lock.lock();
+      running--;
+      if (queue.empty() && running == 0) {
+        idle.notify_all();
+      }
+    }
+  }
+
+  mutable std::mutex mutex;
+  std::condition_variable queue_changed;
+  std::condition_variable idle;
+  std::deque<job> queue;
+  int running = 0;
+  bool stopping = false;
+  std::vector<std::thread> threads;
+};